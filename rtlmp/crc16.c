@@ -28,3 +28,71 @@ uint16_t crc16_check(uint8_t *buf, uint16_t len, uint16_t value)
 }
 
 
+/* @mat times @vec over GF(2), @mat a column per bit */
+static uint16_t gf2_times(const uint16_t *mat, uint16_t vec)
+{
+	uint16_t sum = 0;
+
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+
+	return sum;
+}
+
+static void gf2_square(uint16_t *square, const uint16_t *mat)
+{
+	int n;
+
+	for (n = 0; n < 16; n++)
+		square[n] = gf2_times(mat, mat[n]);
+}
+
+/*
+ * @crc carried on over @len zero bytes, in log(len) steps. The CRC is
+ * linear with no final xor, so this shifts a CRC to where a later part
+ * of the buffer ends, as zlib's crc32_combine() does.
+ */
+uint16_t crc16_shift(uint16_t crc, uint32_t len)
+{
+	int n;
+	uint16_t row = 1;
+	uint16_t odd[16], even[16];
+
+	if (len == 0)
+		return crc;
+
+	/* One zero bit */
+	odd[0] = 0xA001;
+	for (n = 1; n < 16; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+
+	gf2_square(even, odd);	/* two bits */
+	gf2_square(odd, even);	/* four */
+
+	do {
+		gf2_square(even, odd);
+		if (len & 1)
+			crc = gf2_times(even, crc);
+		len >>= 1;
+		if (len == 0)
+			break;
+
+		gf2_square(odd, even);
+		if (len & 1)
+			crc = gf2_times(odd, crc);
+		len >>= 1;
+	} while (len);
+
+	return crc;
+}
+
+uint16_t crc16_combine(uint16_t crc1, uint16_t crc2, uint32_t len2)
+{
+	return crc16_shift(crc1, len2) ^ crc2;
+}
@@ -12,6 +12,10 @@
 #include <stdbool.h>
 
 uint16_t crc16_check(uint8_t *buf, uint16_t len, uint16_t value);
+/* @crc after @len more zero bytes */
+uint16_t crc16_shift(uint16_t crc, uint32_t len);
+/* CRC16 of A then B, from the CRC16s of A and of the @len2 bytes of B */
+uint16_t crc16_combine(uint16_t crc1, uint16_t crc2, uint32_t len2);
 
 #endif /* __CRC16_H__*/
 
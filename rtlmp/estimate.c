@@ -0,0 +1,338 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ *
+ * SPDX-License-Identifier:
+ */
+
+/*
+ * Flash time estimate of one device, from the image layout and a model
+ * of the line, and the model fitted to metrics of real runs.
+ */
+
+#include "defs.h"
+#include "rtlmp.h"
+#include "rtlbt.h"
+#include "rtlimg.h"
+#include "rtlmptool.h"
+#include "mcu_protocol.h"
+#include "log.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+/* The speed the chip boots at, as in rtlmptool.c */
+#define EST_BOOT_BAUDRATE	115200
+
+/* HCI patch fragment, H4 command and Command Complete sizes */
+#define EST_HCI_FRAGMENT	252
+#define EST_HCI_CMD_SIZE(n)	(1 + 3 + (n))
+#define EST_HCI_EVT_SIZE(n)	(1 + 2 + 3 + (n))
+
+/* MP command frames with their CRC, and the response */
+#define EST_MP_BAUD_SIZE	(8 + 2)
+#define EST_MP_RESET_SIZE	(4 + 2)
+#define EST_MP_FLASH_SIZE	(11 + 2)
+#define EST_MP_VERIFY_SIZE	(13 + 2)
+#define EST_MP_RSP_SIZE		(RTLMP_RSP_SIZE + 2)
+
+/* Bounds on a fitted bits_per_byte, 8N1 up to a very gappy adapter */
+#define EST_BITS_MIN		10
+#define EST_BITS_MAX		40
+
+#define EST_DIV_UP(a, b)	(((a) + (b) - 1) / (b))
+
+struct est_job {
+	unsigned fw_size;
+	struct rtlimg_region r[32];
+	int nr;
+};
+
+struct est_trace {
+	double io_us;
+	unsigned long long round_trips;
+	unsigned long long bytes;
+};
+
+void rtlmptool_estimate_init(struct rtlmptool_estimate_model *m, unsigned baud)
+{
+	memset(m, 0, sizeof(*m));
+	m->boot_baud = EST_BOOT_BAUDRATE;
+	m->baud = baud;
+	m->rtt_us = 1000;
+	m->bits_per_byte = 10;
+	m->erase_us = 45000;
+	m->crc_us_per_kb = 40;
+	m->boot_us = 300000;
+	m->write_size = RTLMP_WRITE_SIZE;
+	m->verify_span = 1;
+}
+
+static int est_load(struct est_job *job, const char *fw, const char *mp)
+{
+	FILE *fp;
+
+	fp = fopen(fw, "rb");
+	if (fp == NULL) {
+		return -1;
+	}
+	job->fw_size = rtlbt_cacl_download_size(fp);
+	fclose(fp);
+
+	fp = fopen(mp, "rb");
+	if (fp == NULL) {
+		return -1;
+	}
+	job->nr = rtlimg_regions(fp, job->r, ARRAY_SIZE(job->r));
+	fclose(fp);
+
+	return job->nr < 0 ? -1 : 0;
+}
+
+/* One command of @out bytes answered with @in bytes, at @baud */
+static void est_xfer(const struct rtlmptool_estimate_model *m, struct rtlmptool_estimate *e,
+	int stage, unsigned baud, unsigned out, unsigned in)
+{
+	unsigned trips = 1;
+	struct mcu_framing f;
+
+	/* Through a bridge every packet each way is a round trip of its own */
+	if (m->report) {
+		f.version = m->report > MCU_V1_PACKET ? 2 : 1;
+		f.packet = m->report;
+		trips = EST_DIV_UP(out, mcu_payload_max(&f)) +
+			MAX(EST_DIV_UP(in, mcu_payload_max(&f)), 1);
+	}
+
+	e->us[stage] += trips * m->rtt_us + (out + in) * m->bits_per_byte * 1e6 / baud;
+	e->round_trips += trips;
+	e->bytes += out + in;
+}
+
+static void est_device(struct rtlmptool_estimate *e, int stage, double us)
+{
+	e->us[stage] += us;
+	e->device_us += us;
+}
+
+static void est_patch(const struct rtlmptool_estimate_model *m, const struct est_job *job,
+	struct rtlmptool_estimate *e)
+{
+	unsigned n, off;
+
+	/* Chip type and vendor setup go out together */
+	est_xfer(m, e, RTLMPTOOL_ESTIMATE_PATCH, m->boot_baud,
+		EST_HCI_CMD_SIZE(5) + EST_HCI_CMD_SIZE(9), EST_HCI_EVT_SIZE(5) + EST_HCI_EVT_SIZE(1));
+
+	off = 0;
+	do {
+		n = MIN(job->fw_size - off, EST_HCI_FRAGMENT);
+		est_xfer(m, e, RTLMPTOOL_ESTIMATE_PATCH, m->boot_baud,
+			EST_HCI_CMD_SIZE(n + 1), EST_HCI_EVT_SIZE(2));
+		off += n;
+	} while (off < job->fw_size);
+
+	est_xfer(m, e, RTLMPTOOL_ESTIMATE_PATCH, m->boot_baud,
+		EST_HCI_CMD_SIZE(9), EST_HCI_EVT_SIZE(1));
+}
+
+/* MP firmware boot, handshakes around the baud change, and the final reset */
+static void est_boot(const struct rtlmptool_estimate_model *m, struct rtlmptool_estimate *e)
+{
+	est_device(e, RTLMPTOOL_ESTIMATE_BOOT, m->boot_us);
+	est_xfer(m, e, RTLMPTOOL_ESTIMATE_BOOT, m->boot_baud, EST_MP_BAUD_SIZE, EST_MP_RSP_SIZE);
+	est_xfer(m, e, RTLMPTOOL_ESTIMATE_BOOT, m->boot_baud, EST_MP_BAUD_SIZE, EST_MP_RSP_SIZE);
+	if (m->report) {
+		/* SET_BAUDRATE to the bridge, acked without touching the chip */
+		e->us[RTLMPTOOL_ESTIMATE_BOOT] += m->rtt_us;
+		e->round_trips++;
+	}
+	est_xfer(m, e, RTLMPTOOL_ESTIMATE_BOOT, m->baud, EST_MP_BAUD_SIZE, EST_MP_RSP_SIZE);
+	est_xfer(m, e, RTLMPTOOL_ESTIMATE_BOOT, m->baud, EST_MP_RESET_SIZE, EST_MP_RSP_SIZE);
+}
+
+static void est_verify(const struct rtlmptool_estimate_model *m, struct rtlmptool_estimate *e,
+	uint32_t size)
+{
+	est_xfer(m, e, RTLMPTOOL_ESTIMATE_VERIFY, m->baud, EST_MP_VERIFY_SIZE, EST_MP_RSP_SIZE);
+	est_device(e, RTLMPTOOL_ESTIMATE_VERIFY, size / 1024.0 * m->crc_us_per_kb);
+}
+
+static void est_region(const struct rtlmptool_estimate_model *m, const struct rtlimg_region *r,
+	int verify, struct rtlmptool_estimate *e)
+{
+	unsigned i, frames, span = MAX(m->verify_span, 1);
+	unsigned ws = MAX(m->write_size, 1);
+
+	for (i = 0; i < r->units; i++) {
+		est_xfer(m, e, RTLMPTOOL_ESTIMATE_ERASE, m->baud, EST_MP_FLASH_SIZE, EST_MP_RSP_SIZE);
+		est_device(e, RTLMPTOOL_ESTIMATE_ERASE, m->erase_us);
+	}
+
+	/* The write size divides the erase unit, so frames don't straddle units */
+	frames = EST_DIV_UP(r->written, ws);
+	for (i = 0; i < frames; i++) {
+		unsigned n = MIN(ws, r->written - i * ws);
+
+		est_xfer(m, e, RTLMPTOOL_ESTIMATE_WRITE, m->baud,
+			RTLMP_WRITE_FRAME_SIZE(n), EST_MP_RSP_SIZE);
+	}
+
+	if (verify != RTLMPTOOL_VERIFY_CHUNK) {
+		est_verify(m, e, r->size);
+		return;
+	}
+
+	for (i = 0; i < r->units; i += span) {
+		est_verify(m, e, MIN(span, r->units - i) * (uint32_t)RTLMP_ERASE_SIZE);
+	}
+}
+
+static void est_run(const struct rtlmptool_estimate_model *m, const struct est_job *job,
+	int verify, struct rtlmptool_estimate *e)
+{
+	int i;
+
+	memset(e, 0, sizeof(*e));
+	est_patch(m, job, e);
+	est_boot(m, e);
+	for (i = 0; i < job->nr; i++) {
+		est_region(m, &job->r[i], verify, e);
+	}
+
+	for (i = 0; i < RTLMPTOOL_ESTIMATE_STAGES; i++) {
+		e->total_us += e->us[i];
+	}
+}
+
+int rtlmptool_estimate(const struct rtlmptool_estimate_model *m,
+	const char *fw, const char *mp, int verify, struct rtlmptool_estimate *e)
+{
+	struct est_job job;
+
+	if (m->baud == 0 || m->boot_baud == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (est_load(&job, fw, mp)) {
+		return -1;
+	}
+
+	est_run(m, &job, verify, e);
+	return 0;
+}
+
+/* The counters of one transport_stats_export() file */
+static int est_trace_load(const char *path, struct est_trace *t)
+{
+	FILE *fp;
+	char line[256], name[128];
+	double v, rd = -1, wr = -1, in = 0, out = 0, rt = 0;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#' || sscanf(line, "mptool_transport_%127[a-z_]{%*[^}]} %lf", name, &v) != 2)
+			continue;
+
+		if (!strcmp(name, "read_latency_seconds_sum"))
+			rd = v;
+		else if (!strcmp(name, "write_latency_seconds_sum"))
+			wr = v;
+		else if (!strcmp(name, "bytes_in_total"))
+			in = v;
+		else if (!strcmp(name, "bytes_out_total"))
+			out = v;
+		else if (!strcmp(name, "round_trips_total"))
+			rt = v;
+	}
+	fclose(fp);
+
+	if (rd < 0 || wr < 0) {
+		pr_err("%s: no read/write latency, not a metrics file\n", path);
+		errno = EINVAL;
+		return -1;
+	}
+
+	t->io_us = (rd + wr) * 1e6;
+	t->bytes = in + out;
+	t->round_trips = rt;
+	return 0;
+}
+
+/*
+ * Each trace gives io = rtt * trips + bits * wire + device, where wire
+ * is the time per bit of its bytes at the speeds they went out at. The
+ * device part is the model's own, what is left is fitted by least
+ * squares, both unknowns if the traces tell them apart, rtt alone if not.
+ */
+int rtlmptool_estimate_calibrate(struct rtlmptool_estimate_model *m,
+	const char *fw, const char *mp, int verify,
+	const char *const *traces, const unsigned *bauds, unsigned n)
+{
+	unsigned i;
+	struct est_job job;
+	struct est_trace t;
+	struct rtlmptool_estimate e, w;
+	struct rtlmptool_estimate_model probe;
+	double x1, x2, y, det, rtt, bits;
+	double s11 = 0, s12 = 0, s22 = 0, s1y = 0, s2y = 0;
+
+	if (n == 0 || est_load(&job, fw, mp)) {
+		if (n == 0)
+			errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (bauds[i] == 0 || est_trace_load(traces[i], &t)) {
+			if (bauds[i] == 0)
+				errno = EINVAL;
+			return -1;
+		}
+
+		probe = *m;
+		probe.baud = bauds[i];
+		est_run(&probe, &job, verify, &e);
+
+		/* Unit rtt, no device time: the wire time of one bit per byte */
+		probe.rtt_us = 0;
+		probe.bits_per_byte = 1;
+		est_run(&probe, &job, verify, &w);
+		w.total_us -= w.device_us;
+
+		/* Retries show up as more trips and bytes than the model's */
+		x1 = t.round_trips ? t.round_trips : e.round_trips;
+		x2 = t.bytes ? w.total_us * t.bytes / w.bytes : w.total_us;
+		y = t.io_us - e.device_us;
+		pr_info("Trace %s @%u: %.0f ms io, %.0f trips, %llu bytes\n",
+			traces[i], bauds[i], t.io_us / 1000, x1, t.bytes ? t.bytes : w.bytes);
+
+		s11 += x1 * x1;
+		s12 += x1 * x2;
+		s22 += x2 * x2;
+		s1y += x1 * y;
+		s2y += x2 * y;
+	}
+
+	det = s11 * s22 - s12 * s12;
+	if (n > 1 && det > 1e-6 * s11 * s22) {
+		rtt = (s1y * s22 - s2y * s12) / det;
+		bits = (s2y * s11 - s1y * s12) / det;
+		if (rtt >= 0 && bits >= EST_BITS_MIN && bits <= EST_BITS_MAX) {
+			m->rtt_us = rtt;
+			m->bits_per_byte = bits;
+			pr_info("Calibrated: rtt %.0f us, %.2f bits per byte\n", rtt, bits);
+			return 0;
+		}
+	}
+
+	/* Keep bits_per_byte, what is left of io goes to the round trips */
+	m->rtt_us = MAX((s1y - m->bits_per_byte * s12) / s11, 0);
+	pr_info("Calibrated: rtt %.0f us at %.2f bits per byte\n", m->rtt_us, m->bits_per_byte);
+
+	return 0;
+}
@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ *
+ * SPDX-License-Identifier:
+ */
+
+#include "defs.h"
+#include "hci.h"
+#include "transport.h"
+#include "log.h"
+#include <errno.h>
+#include <string.h>
+
+/* Noise bytes one poll reads through before it looks at timeouts again */
+#define HCI_SKIP_MAX		256
+
+void hci_init(struct hci *hci, struct transport *trans)
+{
+	memset(hci, 0, sizeof(*hci));
+	hci->trans = trans;
+	/* Until the controller says otherwise */
+	hci->credits = 1;
+}
+
+void hci_discard(struct hci *hci)
+{
+	hci->have = 0;
+}
+
+/* Take command @i off the list and hand @ev, or the failure in errno, to its owner */
+static void hci_complete(struct hci *hci, unsigned i, const struct hci_event *ev)
+{
+	int err = errno;
+	hci_complete_cb cb = hci->cmd[i].cb;
+	void *arg = hci->cmd[i].arg;
+
+	hci->ncmds--;
+	memmove(&hci->cmd[i], &hci->cmd[i + 1], (hci->ncmds - i) * sizeof(struct hci_cmd));
+
+	if (cb) {
+		errno = err;
+		cb(hci, ev, arg);
+	}
+}
+
+static void hci_fail_all(struct hci *hci, int err)
+{
+	while (hci->ncmds) {
+		errno = err;
+		hci_complete(hci, 0, NULL);
+	}
+	errno = err;
+}
+
+/* Send queued commands in order, as far as the credits go */
+static void hci_send_queued(struct hci *hci)
+{
+	unsigned i;
+	uint8_t pkt[4 + HCI_MAX_PARAM_SIZE];
+
+	for (i = 0; i < hci->ncmds && hci->credits; ) {
+		struct hci_cmd *cmd = &hci->cmd[i];
+
+		if (cmd->sent) {
+			i++;
+			continue;
+		}
+
+		pkt[0] = HCI_COMMAND_PKT;
+		pkt[1] = cmd->opcode & 0xff;
+		pkt[2] = (cmd->opcode >> 8) & 0xff;
+		pkt[3] = cmd->size;
+		memcpy(pkt + 4, cmd->params, cmd->size);
+
+		if ((4 + cmd->size) != transport_write(hci->trans, pkt, 4 + cmd->size)) {
+			pr_err("HCI send %04x: %s\n", cmd->opcode, strerror(errno));
+			errno = EIO;
+			hci_complete(hci, i, NULL);
+			continue;
+		}
+
+		cmd->sent = true;
+		cmd->deadline = transport_now_us() + HCI_CMD_TIMEOUT * 1000ULL;
+		hci->credits--;
+		i++;
+	}
+}
+
+static void hci_queue_event(struct hci *hci, const struct hci_event *ev)
+{
+	if (hci->nqueued == HCI_EVENT_QUEUE) {
+		hci->queue_head = (hci->queue_head + 1) % HCI_EVENT_QUEUE;
+		hci->nqueued--;
+		hci->dropped++;
+	}
+
+	hci->queue[(hci->queue_head + hci->nqueued++) % HCI_EVENT_QUEUE] = *ev;
+}
+
+static void hci_dispatch(struct hci *hci, const struct hci_event *ev)
+{
+	unsigned i;
+	uint16_t opcode;
+
+	if (ev->code == HCI_EV_CMD_COMPLETE && ev->len >= 3) {
+		hci->credits = ev->params[0];
+		opcode = ev->params[1] | ev->params[2] << 8;
+	} else if (ev->code == HCI_EV_CMD_STATUS && ev->len >= 4) {
+		hci->credits = ev->params[1];
+		opcode = ev->params[2] | ev->params[3] << 8;
+	} else {
+		hci_queue_event(hci, ev);
+		return;
+	}
+
+	/* Opcode 0 only hands out credits */
+	if (opcode == 0)
+		return;
+
+	for (i = 0; i < hci->ncmds; i++) {
+		if (hci->cmd[i].sent && hci->cmd[i].opcode == opcode) {
+			hci_complete(hci, i, ev);
+			return;
+		}
+	}
+
+	/* Late answer to a command that already timed out */
+	pr_debug("HCI event %02x for %04x, no command waiting\n", ev->code, opcode);
+	hci_queue_event(hci, ev);
+}
+
+/* Read towards the next event, returns 1 once one was dispatched */
+static int hci_receive(struct hci *hci)
+{
+	int rz;
+	unsigned need, skipped = 0;
+	struct hci_event ev;
+
+	for (;;) {
+		if (hci->have < 3) {
+			need = hci->have ? 3 : 1;
+		} else {
+			need = 3 + hci->rx[2];
+		}
+
+		if (hci->have < need) {
+			rz = transport_read(hci->trans, hci->rx + hci->have, need - hci->have);
+			if (rz <= 0) {
+				return rz;
+			}
+
+			if (hci->have == 0 && hci->rx[0] != HCI_EVENT_PKT) {
+				if (++skipped == HCI_SKIP_MAX)
+					return 0;
+				continue;
+			}
+			hci->have += rz;
+			continue;
+		}
+
+		ev.code = hci->rx[1];
+		ev.len = hci->rx[2];
+		memcpy(ev.params, hci->rx + 3, ev.len);
+		hci->have = 0;
+
+		hci_dispatch(hci, &ev);
+		return 1;
+	}
+}
+
+static void hci_expire(struct hci *hci)
+{
+	unsigned i;
+	unsigned long long now = transport_now_us();
+
+	for (i = 0; i < hci->ncmds; ) {
+		if (!hci->cmd[i].sent || now < hci->cmd[i].deadline) {
+			i++;
+			continue;
+		}
+
+		pr_debug("HCI %04x: no answer\n", hci->cmd[i].opcode);
+		hci->trans->stats.timeouts++;
+		/* Whatever it was, the controller isn't holding our credit now */
+		if (hci->credits == 0)
+			hci->credits = 1;
+
+		errno = ETIMEDOUT;
+		hci_complete(hci, i, NULL);
+	}
+}
+
+int hci_poll(struct hci *hci)
+{
+	int rc;
+
+	if (transport_check(hci->trans)) {
+		hci_fail_all(hci, errno);
+		return -1;
+	}
+
+	hci_send_queued(hci);
+
+	rc = hci_receive(hci);
+	if (rc < 0) {
+		hci_fail_all(hci, errno);
+		return -1;
+	}
+
+	hci_expire(hci);
+	/* Credits may have come back with the event */
+	hci_send_queued(hci);
+
+	return rc;
+}
+
+int hci_submit(struct hci *hci, uint16_t opcode, const void *params, uint8_t size,
+	hci_complete_cb cb, void *arg)
+{
+	struct hci_cmd *cmd;
+
+	while (hci->ncmds == HCI_MAX_PENDING) {
+		if (hci_poll(hci) < 0) {
+			return -1;
+		}
+	}
+
+	cmd = &hci->cmd[hci->ncmds++];
+	cmd->opcode = opcode;
+	cmd->sent = false;
+	cmd->cb = cb;
+	cmd->arg = arg;
+	cmd->size = size;
+	if (params && size) {
+		memcpy(cmd->params, params, size);
+	}
+
+	hci_send_queued(hci);
+
+	return 0;
+}
+
+int hci_drain(struct hci *hci)
+{
+	while (hci->ncmds) {
+		if (hci_poll(hci) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int hci_next_event(struct hci *hci, struct hci_event *ev)
+{
+	if (hci->nqueued == 0)
+		return 0;
+
+	*ev = hci->queue[hci->queue_head];
+	hci->queue_head = (hci->queue_head + 1) % HCI_EVENT_QUEUE;
+	hci->nqueued--;
+
+	return 1;
+}
+
+struct hci_wait {
+	bool done;
+	int err;
+	struct hci_event ev;
+};
+
+static void hci_wait_cb(struct hci *hci, const struct hci_event *ev, void *arg)
+{
+	struct hci_wait *w = arg;
+
+	w->done = true;
+	if (ev) {
+		w->ev = *ev;
+	} else {
+		w->err = errno;
+	}
+}
+
+int hci_cmd_sync(struct hci *hci, uint16_t opcode, const void *params, uint8_t size,
+	void *rsp, uint16_t rsp_size)
+{
+	struct hci_wait w = { .done = false };
+
+	if (hci_submit(hci, opcode, params, size, hci_wait_cb, &w)) {
+		return -1;
+	}
+
+	/* A failed poll fails every command, this one included */
+	while (!w.done) {
+		hci_poll(hci);
+	}
+
+	if (w.err) {
+		errno = w.err;
+		return -1;
+	}
+
+	if (rsp == NULL || rsp_size == 0) {
+		return 0;
+	}
+
+	/* Rejected outright, the status is all there is */
+	if (w.ev.code == HCI_EV_CMD_STATUS) {
+		memset(rsp, 0, rsp_size);
+		((uint8_t *)rsp)[0] = w.ev.params[0];
+		return 0;
+	}
+
+	if (w.ev.len - 3 < rsp_size) {
+		pr_err("HCI %04x: %u return bytes, expected %u\n", opcode, w.ev.len - 3, rsp_size);
+		errno = EPROTO;
+		return -1;
+	}
+	memcpy(rsp, w.ev.params + 3, rsp_size);
+
+	return 0;
+}
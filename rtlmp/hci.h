@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ *
+ * SPDX-License-Identifier:
+ */
+
+
+#ifndef __HCI_H__
+#define __HCI_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct transport;
+
+#define HCI_COMMAND_PKT		0x01
+#define HCI_EVENT_PKT		0x04
+
+#define HCI_EV_CMD_COMPLETE	0x0e
+#define HCI_EV_CMD_STATUS	0x0f
+
+#define HCI_MAX_PARAM_SIZE	255
+
+/* How long one response may take, on top of the session deadline */
+#define HCI_CMD_TIMEOUT		2000
+
+/* Commands queued or in flight, and unsolicited events kept */
+#define HCI_MAX_PENDING		8
+#define HCI_EVENT_QUEUE		16
+
+struct hci_event {
+	uint8_t code;
+	uint8_t len;
+	uint8_t params[HCI_MAX_PARAM_SIZE];
+};
+
+struct hci;
+
+/*
+ * Called from hci_poll() with the Command Complete or Command Status
+ * event of the command, or with NULL and errno set when it failed.
+ */
+typedef void (*hci_complete_cb)(struct hci *hci, const struct hci_event *ev, void *arg);
+
+struct hci_cmd {
+	uint16_t opcode;
+	bool sent;
+	unsigned long long deadline;
+	hci_complete_cb cb;
+	void *arg;
+	uint8_t size;
+	uint8_t params[HCI_MAX_PARAM_SIZE];
+};
+
+/*
+ * Command/event layer over one transport. Commands are sent as the
+ * controller hands out credits, several may be in flight, and each
+ * Command Complete/Status goes to the oldest outstanding command with
+ * its opcode. Any other event is queued for hci_next_event().
+ */
+struct hci {
+	struct transport *trans;
+	unsigned credits;
+	/* Commands in submission order */
+	struct hci_cmd cmd[HCI_MAX_PENDING];
+	unsigned cmd_head, ncmds;
+	/* Unsolicited events, the oldest are dropped when full */
+	struct hci_event queue[HCI_EVENT_QUEUE];
+	unsigned queue_head, nqueued;
+	unsigned dropped;
+	/* Event being parsed, read exactly so nothing past it is consumed */
+	uint8_t rx[3 + HCI_MAX_PARAM_SIZE];
+	unsigned have;
+};
+
+void hci_init(struct hci *hci, struct transport *trans);
+/* Queue a command, @cb runs from a later hci_poll() */
+int hci_submit(struct hci *hci, uint16_t opcode, const void *params, uint8_t size,
+	hci_complete_cb cb, void *arg);
+/* Send what the credits allow, read and dispatch what arrived, expire late commands */
+int hci_poll(struct hci *hci);
+/* Poll until no command is outstanding */
+int hci_drain(struct hci *hci);
+/* Pop the oldest unsolicited event, returns 0 if there is none */
+int hci_next_event(struct hci *hci, struct hci_event *ev);
+/* Forget a partly read event, after the input was flushed */
+void hci_discard(struct hci *hci);
+
+/* Send and wait, @rsp gets the first @rsp_size return parameters */
+int hci_cmd_sync(struct hci *hci, uint16_t opcode, const void *params, uint8_t size,
+	void *rsp, uint16_t rsp_size);
+
+#endif /* __HCI_H__*/
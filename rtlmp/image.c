@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ * 
+ * SPDX-License-Identifier: 
+ */
+
+#include "image.h"
+#include "rtlimg.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+struct rtlmptool_image *rtlmptool_image_load(const char *path, int type)
+{
+	FILE *fp, *img_fp;
+	long size;
+	struct rtlmptool_image *img;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		return NULL;
+	}
+
+	if (fseek(fp, 0, SEEK_END) || (size = ftell(fp)) <= 0 || fseek(fp, 0, SEEK_SET)) {
+		fclose(fp);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	img = malloc(sizeof(*img) + size);
+	if (img == NULL) {
+		fclose(fp);
+		return NULL;
+	}
+
+	atomic_init(&img->ref, 1);
+	img->type = type;
+	img->plan = NULL;
+	img->size = size;
+	if (size != fread(img->data, 1, size, fp)) {
+		fclose(fp);
+		free(img);
+		errno = EIO;
+		return NULL;
+	}
+	fclose(fp);
+
+	/*
+	 * Catch a truncated or half written MP image before anyone uses it,
+	 * and take the unit CRCs every session flashing it would otherwise
+	 * compute again.
+	 */
+	if (type == RTLMPTOOL_IMAGE_MP) {
+		img_fp = image_open(img);
+		if (img_fp == NULL || rtlimg_calc_download_size(img_fp) < 0 ||
+			(img->plan = rtlimg_plan_create(img_fp)) == NULL) {
+			pr_err("%s: not a valid MP image\n", path);
+			if (img_fp) {
+				fclose(img_fp);
+			}
+			free(img);
+			errno = EINVAL;
+			return NULL;
+		}
+		fclose(img_fp);
+	}
+
+	return img;
+}
+
+struct rtlmptool_image *rtlmptool_image_get(struct rtlmptool_image *img)
+{
+	atomic_fetch_add(&img->ref, 1);
+	return img;
+}
+
+void rtlmptool_image_put(struct rtlmptool_image *img)
+{
+	if (img && atomic_fetch_sub(&img->ref, 1) == 1) {
+		rtlimg_plan_destroy(img->plan);
+		free(img);
+	}
+}
+
+unsigned rtlmptool_image_size(struct rtlmptool_image *img)
+{
+	return img->size;
+}
+
+FILE *image_open(struct rtlmptool_image *img)
+{
+#if defined(__WIN32__)
+	FILE *fp = tmpfile();
+
+	if (fp == NULL) {
+		return NULL;
+	}
+
+	if (img->size != fwrite(img->data, 1, img->size, fp)) {
+		fclose(fp);
+		return NULL;
+	}
+	rewind(fp);
+
+	return fp;
+#else
+	return fmemopen(img->data, img->size, "rb");
+#endif
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ * 
+ * SPDX-License-Identifier: 
+ */
+
+
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "rtlmptool.h"
+
+struct rtlimg_plan;
+
+/* Immutable once loaded, shared by every session that holds a reference */
+struct rtlmptool_image {
+	atomic_int ref;
+	int type;
+	struct rtlimg_plan *plan;	/* MP images only */
+	uint32_t size;
+	uint8_t data[];
+};
+
+/* A private read stream over the cached bytes */
+FILE *image_open(struct rtlmptool_image *img);
+
+#endif /* __IMAGE_H__*/
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ * 
+ * SPDX-License-Identifier: 
+ */
+
+#include "journal.h"
+#include "log.h"
+#include <string.h>
+#include <errno.h>
+
+/* FNV-1a 64 over the whole image file */
+static uint64_t image_hash(FILE *image)
+{
+	int i, rz;
+	uint8_t buf[4096];
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	fseek(image, 0, SEEK_SET);
+	while ((rz = fread(buf, 1, sizeof(buf), image)) > 0) {
+		for (i = 0; i < rz; i++) {
+			hash ^= buf[i];
+			hash *= 0x100000001b3ULL;
+		}
+	}
+
+	return hash;
+}
+
+static void journal_set(struct journal *j, uint32_t addr, uint32_t done)
+{
+	unsigned i;
+
+	for (i = 0; i < j->nr; i++) {
+		if (j->entry[i].addr == addr) {
+			j->entry[i].done = done;
+			return;
+		}
+	}
+
+	if (j->nr < sizeof(j->entry) / sizeof(j->entry[0])) {
+		j->entry[j->nr].addr = addr;
+		j->entry[j->nr].done = done;
+		j->nr++;
+	}
+}
+
+int journal_open(struct journal *j, const char *dir, const char *device, FILE *image)
+{
+	char *p;
+	char name[128];
+	uint32_t addr, done;
+
+	memset(j, 0, sizeof(*j));
+
+	snprintf(name, sizeof(name), "%s", device);
+	for (p = name; *p; p++) {
+		if (*p == '/' || *p == '\\' || *p == ':')
+			*p = '_';
+	}
+
+	snprintf(j->path, sizeof(j->path), "%s/%s-%016llx.journal",
+		dir, name, (unsigned long long)image_hash(image));
+
+	j->fp = fopen(j->path, "a+");
+	if (j->fp == NULL) {
+		pr_err("journal %s: %s\n", j->path, strerror(errno));
+		return -1;
+	}
+
+	fseek(j->fp, 0, SEEK_SET);
+	while (2 == fscanf(j->fp, "%x %x\n", &addr, &done)) {
+		journal_set(j, addr, done);
+	}
+
+	if (j->nr) {
+		pr_info("Resume from journal %s\n", j->path);
+	}
+
+	return 0;
+}
+
+uint32_t journal_done(struct journal *j, uint32_t addr)
+{
+	unsigned i;
+
+	for (i = 0; j && i < j->nr; i++) {
+		if (j->entry[i].addr == addr)
+			return j->entry[i].done;
+	}
+
+	return 0;
+}
+
+int journal_commit(struct journal *j, uint32_t addr, uint32_t done)
+{
+	if (j == NULL || j->fp == NULL)
+		return 0;
+
+	journal_set(j, addr, done);
+	fprintf(j->fp, "%08x %08x\n", addr, done);
+
+	return fflush(j->fp);
+}
+
+void journal_close(struct journal *j, bool finished)
+{
+	if (j->fp == NULL)
+		return;
+
+	fclose(j->fp);
+	j->fp = NULL;
+
+	if (finished) {
+		remove(j->path);
+	}
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ * 
+ * SPDX-License-Identifier: 
+ */
+
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Per-device download journal, keyed by device identity and image hash.
+ * Every verified prefix of a sub-image is appended as "<addr> <bytes>",
+ * the last record for an address wins.
+ */
+struct journal {
+	FILE *fp;
+	char path[512];
+	unsigned nr;
+	struct {
+		uint32_t addr;
+		uint32_t done;
+	} entry[32];
+};
+
+int journal_open(struct journal *j, const char *dir, const char *device, FILE *image);
+uint32_t journal_done(struct journal *j, uint32_t addr);
+int journal_commit(struct journal *j, uint32_t addr, uint32_t done);
+void journal_close(struct journal *j, bool finished);
+
+#endif /* __JOURNAL_H__*/
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ *
+ * SPDX-License-Identifier:
+ */
+
+#include "defs.h"
+#include "crc16.h"
+#include "patch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* Difference worked on at a time */
+#define PATCH_DIFF_SIZE		256
+
+struct rtlmptool_patch *rtlmptool_patch_create(void)
+{
+	return calloc(1, sizeof(struct rtlmptool_patch));
+}
+
+void rtlmptool_patch_clear(struct rtlmptool_patch *p)
+{
+	unsigned i;
+
+	for (i = 0; i < p->nfields; i++) {
+		free(p->field[i].value);
+	}
+	p->nfields = 0;
+}
+
+void rtlmptool_patch_destroy(struct rtlmptool_patch *p)
+{
+	if (p) {
+		rtlmptool_patch_clear(p);
+		free(p);
+	}
+}
+
+int rtlmptool_patch_add(struct rtlmptool_patch *p, uint32_t addr, uint32_t offset,
+	const void *value, uint32_t size)
+{
+	struct patch_field *f;
+
+	if (size == 0 || offset + size < offset) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (p->nfields == PATCH_FIELDS_MAX) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	f = &p->field[p->nfields];
+	f->value = malloc(size);
+	if (f->value == NULL) {
+		return -1;
+	}
+
+	memcpy(f->value, value, size);
+	f->addr = addr;
+	f->off = offset;
+	f->size = size;
+	p->nfields++;
+
+	return 0;
+}
+
+uint16_t patch_apply(const struct rtlmptool_patch *p, uint32_t addr, uint32_t off,
+	uint8_t *dat, uint32_t size, uint16_t crc)
+{
+	unsigned i;
+	uint32_t lo, hi, j;
+	uint8_t diff[PATCH_DIFF_SIZE];
+
+	if (p == NULL)
+		return crc;
+
+	for (i = 0; i < p->nfields; i++) {
+		const struct patch_field *f = &p->field[i];
+
+		if (f->addr != addr)
+			continue;
+
+		lo = MAX(off, f->off);
+		hi = MIN(off + size, f->off + f->size);
+		if (lo >= hi)
+			continue;
+
+		/*
+		 * CRC(read ^ diff) = CRC(read) ^ CRC(diff), and diff is zero
+		 * outside the field, so only its bytes and the distance to the
+		 * end of @dat matter.
+		 */
+		while (lo < hi) {
+			uint32_t n = MIN(hi - lo, sizeof(diff));
+
+			for (j = 0; j < n; j++) {
+				diff[j] = dat[lo - off + j] ^ f->value[lo - f->off + j];
+			}
+			memcpy(dat + lo - off, f->value + lo - f->off, n);
+
+			crc ^= crc16_shift(crc16_check(diff, n, 0), off + size - lo - n);
+			lo += n;
+		}
+	}
+
+	return crc;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ *
+ * SPDX-License-Identifier:
+ */
+
+
+#ifndef __PATCH_H__
+#define __PATCH_H__
+
+#include <stdint.h>
+#include "rtlmptool.h"
+
+#define PATCH_FIELDS_MAX	16
+
+struct patch_field {
+	uint32_t addr;		/* sub-image download address */
+	uint32_t off;		/* within the sub-image */
+	uint32_t size;
+	uint8_t *value;
+};
+
+struct rtlmptool_patch {
+	unsigned nfields;
+	struct patch_field field[PATCH_FIELDS_MAX];
+};
+
+/*
+ * Overlay the fields on @dat, @size bytes at @off of the sub-image at
+ * @addr, and carry @crc, the CRC16 of @dat as read, over to the patched
+ * bytes from their difference alone. NULL @p leaves both as they are.
+ */
+uint16_t patch_apply(const struct rtlmptool_patch *p, uint32_t addr, uint32_t off,
+	uint8_t *dat, uint32_t size, uint16_t crc);
+
+#endif /* __PATCH_H__*/
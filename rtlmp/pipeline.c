@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ * 
+ * SPDX-License-Identifier: 
+ */
+
+#include "defs.h"
+#include "crc16.h"
+#include "pipeline.h"
+#include "patch.h"
+#include <errno.h>
+
+static bool is_blank(const uint8_t *dat, uint32_t size)
+{
+	uint32_t i;
+
+	for (i = 0; i < size; i++) {
+		if (dat[i] != 0xff)
+			return false;
+	}
+
+	return true;
+}
+
+static int chunk_prepare(struct pipeline *p, struct pipeline_chunk *c, uint32_t pos)
+{
+	uint32_t wn, ws = RTLMP_WRITE_SIZE;
+	uint16_t crc;
+	uint8_t dat[RTLMP_ERASE_SIZE];
+	uint8_t *frame = c->buf;
+
+	c->addr = p->addr + pos;
+	c->size = MIN(sizeof(dat), p->size - pos);
+	if (c->size != fread(dat, 1, c->size, p->fd)) {
+		return -EIO;
+	}
+
+	if (p->tuner) {
+		ws = atomic_load(&p->tuner->write_size);
+	}
+
+	if (p->span_left == 0) {
+		p->span_left = p->tuner ? atomic_load(&p->tuner->verify_span) : 1;
+		p->span_addr = c->addr;
+		p->span_size = 0;
+		p->span_crc = 0;
+	}
+
+	/* The unit's own CRC, chained on to the region and the span */
+	if (p->unit_crc) {
+		crc = patch_apply(p->patch, p->region, c->addr - p->region, dat, c->size,
+			p->unit_crc[(c->addr - p->region) / RTLMP_ERASE_SIZE]);
+	} else {
+		patch_apply(p->patch, p->region, c->addr - p->region, dat, c->size, 0);
+		crc = crc16_check(dat, c->size, 0);
+	}
+	p->crc = crc16_combine(p->crc, crc, c->size);
+	p->span_crc = crc16_combine(p->span_crc, crc, c->size);
+	p->span_size += c->size;
+	p->span_left--;
+	if (pos + c->size == p->size)
+		p->span_left = 0;
+
+	c->span_end = p->span_left == 0;
+	c->span_addr = p->span_addr;
+	c->span_size = p->span_size;
+	c->span_crc = p->span_crc;
+
+	c->blank = is_blank(dat, c->size);
+	c->nframes = 0;
+	if (c->blank)
+		return 0;
+
+	for (wn = 0; wn < c->size; wn += ws) {
+		c->frame[c->nframes] = frame;
+		c->frame_len[c->nframes] = rtlmp_write_flash_frame(frame,
+			c->addr + wn, MIN(ws, c->size - wn), dat + wn);
+		frame += c->frame_len[c->nframes];
+		c->nframes++;
+	}
+
+	return 0;
+}
+
+static void *pipeline_producer(void *arg)
+{
+	int rc = 0;
+	uint32_t pos = 0;
+	struct pipeline *p = arg;
+
+	if (fseek(p->fd, p->off, SEEK_SET)) {
+		rc = -EIO;
+	}
+
+	while (rc == 0 && pos < p->size) {
+		bool abort;
+		struct pipeline_chunk *c;
+
+		pthread_mutex_lock(&p->lock);
+		while (!p->abort && p->head - p->tail == PIPELINE_DEPTH)
+			pthread_cond_wait(&p->cond, &p->lock);
+		abort = p->abort;
+		pthread_mutex_unlock(&p->lock);
+
+		if (abort)
+			break;
+
+		/* The slot is ours until head moves past it */
+		c = &p->chunk[p->head % PIPELINE_DEPTH];
+		rc = chunk_prepare(p, c, pos);
+		if (rc == 0)
+			pos += c->size;
+
+		pthread_mutex_lock(&p->lock);
+		if (rc == 0)
+			p->head++;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+	}
+
+	pthread_mutex_lock(&p->lock);
+	p->error = rc;
+	p->done = true;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+int pipeline_start(struct pipeline *p, FILE *fd, long off,
+	uint32_t addr, uint32_t size, uint16_t crc, struct tuner *tuner,
+	uint32_t region, const uint16_t *unit_crc, const struct rtlmptool_patch *patch)
+{
+	p->fd = fd;
+	p->off = off;
+	p->addr = addr;
+	p->size = size;
+	p->crc = crc;
+	p->tuner = tuner;
+	p->region = region;
+	p->unit_crc = unit_crc;
+	p->patch = patch;
+	p->span_left = 0;
+	p->error = 0;
+	p->done = p->abort = false;
+	p->head = p->tail = 0;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+
+	if (pthread_create(&p->tid, NULL, pipeline_producer, p)) {
+		pthread_cond_destroy(&p->cond);
+		pthread_mutex_destroy(&p->lock);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Next prepared chunk, NULL once the region is exhausted or on error */
+struct pipeline_chunk *pipeline_get(struct pipeline *p)
+{
+	struct pipeline_chunk *c = NULL;
+
+	pthread_mutex_lock(&p->lock);
+	while (p->head == p->tail && !p->done)
+		pthread_cond_wait(&p->cond, &p->lock);
+
+	if (p->head != p->tail)
+		c = &p->chunk[p->tail % PIPELINE_DEPTH];
+	pthread_mutex_unlock(&p->lock);
+
+	return c;
+}
+
+/* Hand the chunk returned by pipeline_get() back to the producer */
+void pipeline_put(struct pipeline *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->tail++;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* Stop the producer, returns its error if it failed */
+int pipeline_stop(struct pipeline *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->abort = true;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	pthread_join(p->tid, NULL);
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+
+	if (p->error) {
+		errno = -p->error;
+		return -1;
+	}
+
+	return 0;
+}
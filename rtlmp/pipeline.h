@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ * 
+ * SPDX-License-Identifier: 
+ */
+
+
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "rtlmp.h"
+#include "tuner.h"
+
+struct rtlmptool_patch;
+
+/* Chunks prepared ahead of the one being sent */
+#define PIPELINE_DEPTH		4
+#define PIPELINE_FRAMES		(RTLMP_ERASE_SIZE / TUNER_WRITE_MIN)
+
+/* One erase unit, ready to go on the wire */
+struct pipeline_chunk {
+	uint32_t addr;
+	uint32_t size;
+	bool blank;			/* all 0xff, nothing to write after the erase */
+	/* Verify span this chunk belongs to, checked after its last chunk */
+	bool span_end;
+	uint32_t span_addr;
+	uint32_t span_size;
+	uint16_t span_crc;
+	unsigned nframes;
+	uint8_t *frame[PIPELINE_FRAMES];
+	uint32_t frame_len[PIPELINE_FRAMES];
+	uint8_t buf[RTLMP_ERASE_SIZE + PIPELINE_FRAMES * RTLMP_WRITE_FRAME_SIZE(0)];
+};
+
+/*
+ * A producer thread reads, CRCs and serializes the chunks of one flash
+ * region into a fixed ring while the caller sends the previous ones.
+ */
+struct pipeline {
+	FILE *fd;
+	long off;
+	uint32_t addr;
+	uint32_t size;
+	uint16_t crc;		/* running CRC16 over the region */
+	struct tuner *tuner;	/* write size and verify span, may be NULL */
+	uint32_t region;	/* sub-image download address */
+	const uint16_t *unit_crc;	/* its precomputed unit CRCs, may be NULL */
+	const struct rtlmptool_patch *patch;	/* may be NULL */
+	unsigned span_left;
+	uint32_t span_addr;
+	uint32_t span_size;
+	uint16_t span_crc;
+	int error;
+	bool done, abort;
+	unsigned head, tail;
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct pipeline_chunk chunk[PIPELINE_DEPTH];
+};
+
+/*
+ * Region [@addr, @addr + @size) of the sub-image at @region, read from
+ * @off in @fd. @unit_crc, indexed by erase unit from @region, saves
+ * running the CRC over every chunk.
+ */
+int pipeline_start(struct pipeline *p, FILE *fd, long off,
+	uint32_t addr, uint32_t size, uint16_t crc, struct tuner *tuner,
+	uint32_t region, const uint16_t *unit_crc, const struct rtlmptool_patch *patch);
+struct pipeline_chunk *pipeline_get(struct pipeline *p);
+void pipeline_put(struct pipeline *p);
+int pipeline_stop(struct pipeline *p);
+
+#endif /* __PIPELINE_H__*/
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ * 
+ * SPDX-License-Identifier: 
+ */
+
+#include "progress.h"
+#include "transport.h"
+#include <string.h>
+
+/* Minimum interval the throughput is sampled over */
+#define PROGRESS_RATE_INTERVAL_US	100000
+
+static void progress_notify(struct progress *p)
+{
+	if (p->cb) {
+		p->cb(&p->info, p->arg);
+	}
+}
+
+void progress_init(struct progress *p, unsigned total,
+	rtlmptool_progress_cb cb, void *arg)
+{
+	memset(p, 0, sizeof(*p));
+	p->info.total = total;
+	p->cb = cb;
+	p->arg = arg;
+	p->last_us = transport_now_us();
+}
+
+void progress_stage(struct progress *p, int stage)
+{
+	p->info.stage = stage;
+	p->info.throughput = 0;
+	p->last_us = transport_now_us();
+	p->last_done = p->info.done;
+	progress_notify(p);
+}
+
+void progress_advance(struct progress *p, unsigned bytes)
+{
+	unsigned long long now = transport_now_us();
+	unsigned long long elapsed = now - p->last_us;
+
+	p->info.done += bytes;
+
+	/* Exponentially smoothed, so one slow round trip doesn't make it jump */
+	if (elapsed >= PROGRESS_RATE_INTERVAL_US) {
+		double rate = (p->info.done - p->last_done) * 1e6 / elapsed;
+
+		if (p->info.throughput == 0)
+			p->info.throughput = rate;
+		else
+			p->info.throughput = p->info.throughput * 0.7 + rate * 0.3;
+
+		p->last_us = now;
+		p->last_done = p->info.done;
+	}
+
+	progress_notify(p);
+}
+
+/* Back to @done bytes, for a stage that starts over */
+void progress_rewind(struct progress *p, unsigned done)
+{
+	p->info.done = done;
+	p->last_done = done;
+	p->last_us = transport_now_us();
+	progress_notify(p);
+}
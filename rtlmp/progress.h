@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ * 
+ * SPDX-License-Identifier: 
+ */
+
+
+#ifndef __PROGRESS_H__
+#define __PROGRESS_H__
+
+#include "rtlmptool.h"
+
+struct progress {
+	struct rtlmptool_progress info;
+	rtlmptool_progress_cb cb;
+	void *arg;
+	unsigned long long last_us;
+	unsigned last_done;
+};
+
+void progress_init(struct progress *p, unsigned total,
+	rtlmptool_progress_cb cb, void *arg);
+void progress_stage(struct progress *p, int stage);
+void progress_advance(struct progress *p, unsigned bytes);
+void progress_rewind(struct progress *p, unsigned done);
+
+#endif /* __PROGRESS_H__*/
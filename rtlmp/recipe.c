@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ *
+ * SPDX-License-Identifier:
+ */
+
+#include "defs.h"
+#include "recipe.h"
+#include "image.h"
+#include "log.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *step_names[] = {
+	[RTLMPTOOL_STEP_CHIP] = "chip",
+	[RTLMPTOOL_STEP_PATCH] = "patch",
+	[RTLMPTOOL_STEP_FLASH] = "flash",
+	[RTLMPTOOL_STEP_VERIFY] = "verify",
+	[RTLMPTOOL_STEP_RESET] = "reset",
+	[RTLMPTOOL_STEP_TONE] = "tone",
+};
+
+const char *recipe_step_name(int type)
+{
+	if (type < 0 || type >= ARRAY_SIZE(step_names))
+		return "unknown";
+
+	return step_names[type];
+}
+
+struct rtlmptool_recipe *rtlmptool_recipe_create(void)
+{
+	return calloc(1, sizeof(struct rtlmptool_recipe));
+}
+
+void rtlmptool_recipe_destroy(struct rtlmptool_recipe *r)
+{
+	int i;
+
+	if (r == NULL)
+		return;
+
+	for (i = 0; i < r->nsteps; i++) {
+		rtlmptool_image_put(r->step[i].img);
+	}
+	free(r);
+}
+
+static struct recipe_step *recipe_add(struct rtlmptool_recipe *r, int type)
+{
+	struct recipe_step *step;
+
+	if (r->nsteps == RECIPE_MAX_STEPS) {
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	step = &r->step[r->nsteps++];
+	memset(step, 0, sizeof(*step));
+	step->type = type;
+	step->result.type = type;
+
+	return step;
+}
+
+static int recipe_add_image(struct rtlmptool_recipe *r, int type,
+	struct rtlmptool_image *img, int img_type)
+{
+	struct recipe_step *step;
+
+	if (img == NULL || img->type != img_type) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	step = recipe_add(r, type);
+	if (step == NULL) {
+		return -1;
+	}
+	step->img = rtlmptool_image_get(img);
+
+	return 0;
+}
+
+int rtlmptool_recipe_add_chip(struct rtlmptool_recipe *r, uint32_t value, uint32_t mask)
+{
+	struct recipe_step *step = recipe_add(r, RTLMPTOOL_STEP_CHIP);
+
+	if (step == NULL) {
+		return -1;
+	}
+	step->value = value;
+	step->mask = mask;
+
+	return 0;
+}
+
+int rtlmptool_recipe_add_patch(struct rtlmptool_recipe *r, struct rtlmptool_image *fw)
+{
+	return recipe_add_image(r, RTLMPTOOL_STEP_PATCH, fw, RTLMPTOOL_IMAGE_PATCH);
+}
+
+int rtlmptool_recipe_add_flash(struct rtlmptool_recipe *r, struct rtlmptool_image *mp, int verify)
+{
+	if (recipe_add_image(r, RTLMPTOOL_STEP_FLASH, mp, RTLMPTOOL_IMAGE_MP)) {
+		return -1;
+	}
+	r->step[r->nsteps - 1].verify = verify;
+
+	return 0;
+}
+
+int rtlmptool_recipe_add_verify(struct rtlmptool_recipe *r, struct rtlmptool_image *mp)
+{
+	return recipe_add_image(r, RTLMPTOOL_STEP_VERIFY, mp, RTLMPTOOL_IMAGE_MP);
+}
+
+int rtlmptool_recipe_add_reset(struct rtlmptool_recipe *r)
+{
+	return recipe_add(r, RTLMPTOOL_STEP_RESET) ? 0 : -1;
+}
+
+int rtlmptool_recipe_add_tone(struct rtlmptool_recipe *r,
+	const unsigned char *channels, unsigned n, unsigned dwell_ms)
+{
+	int i;
+	struct recipe_step *step;
+
+	if (n == 0 || n > RECIPE_MAX_CHANNELS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (channels[i] >= RECIPE_MAX_CHANNELS) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	step = recipe_add(r, RTLMPTOOL_STEP_TONE);
+	if (step == NULL) {
+		return -1;
+	}
+	memcpy(step->channels, channels, n);
+	step->nchannels = n;
+	step->dwell = dwell_ms;
+
+	return 0;
+}
+
+unsigned rtlmptool_recipe_steps(struct rtlmptool_recipe *r)
+{
+	return r->nsteps;
+}
+
+const struct rtlmptool_step_result *rtlmptool_recipe_result(
+	struct rtlmptool_recipe *r, unsigned i)
+{
+	if (i >= r->nsteps) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return &r->step[i].result;
+}
+
+const struct rtlmptool_tone_mark *rtlmptool_recipe_tones(
+	struct rtlmptool_recipe *r, unsigned i, unsigned *n)
+{
+	if (i >= r->nsteps || r->step[i].type != RTLMPTOOL_STEP_TONE) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	*n = r->step[i].nmarks;
+	return r->step[i].marks;
+}
+
+int recipe_check(struct rtlmptool_recipe *r)
+{
+	int i;
+	bool mp = false;
+
+	if (r->nsteps == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < r->nsteps; i++) {
+		int type = r->step[i].type;
+		bool needs_mp = type == RTLMPTOOL_STEP_FLASH ||
+			type == RTLMPTOOL_STEP_VERIFY || type == RTLMPTOOL_STEP_RESET;
+
+		if (needs_mp != mp) {
+			pr_err("Recipe step %d (%s) needs %s mode\n",
+				i, recipe_step_name(type), needs_mp ? "MP" : "HCI");
+			errno = EINVAL;
+			return -1;
+		}
+
+		if (type == RTLMPTOOL_STEP_PATCH) {
+			mp = true;
+		} else if (type == RTLMPTOOL_STEP_RESET) {
+			mp = false;
+		}
+	}
+
+	return 0;
+}
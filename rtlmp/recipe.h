@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ *
+ * SPDX-License-Identifier:
+ */
+
+
+#ifndef __RECIPE_H__
+#define __RECIPE_H__
+
+#include <stdint.h>
+#include "rtlmptool.h"
+
+#define RECIPE_MAX_STEPS	32
+/* Bluetooth RF channels 0 - 78 */
+#define RECIPE_MAX_CHANNELS	79
+
+struct recipe_step {
+	int type;
+	struct rtlmptool_image *img;
+	int verify;
+	uint32_t value, mask;
+	unsigned char channels[RECIPE_MAX_CHANNELS];
+	unsigned nchannels;
+	unsigned dwell;		/* ms per channel */
+	struct rtlmptool_tone_mark marks[RECIPE_MAX_CHANNELS];
+	unsigned nmarks;
+	struct rtlmptool_step_result result;
+};
+
+struct rtlmptool_recipe {
+	unsigned nsteps;
+	struct recipe_step step[RECIPE_MAX_STEPS];
+};
+
+/* Check the HCI and MP steps come in an order the chip can follow */
+int recipe_check(struct rtlmptool_recipe *r);
+const char *recipe_step_name(int type);
+
+#endif /* __RECIPE_H__*/
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ * 
+ * SPDX-License-Identifier: 
+ */
+
+#include "defs.h"
+#include "rtlmp.h"
+#include "retry.h"
+#include "transport.h"
+#include "log.h"
+#include <errno.h>
+#include <string.h>
+
+/* Speeds both the chip and rtlbt_baudrate() know, fastest first */
+static const unsigned retry_speeds[] = {
+	4000000, 3500000, 3000000, 2500000, 2000000,
+	1500000, 1000000, 921600, 230400, 115200,
+};
+
+void retry_init(struct retry *r, struct transport *trans)
+{
+	memset(r, 0, sizeof(*r));
+	r->trans = trans;
+	r->budget = RETRY_BUDGET;
+}
+
+void retry_set_speed(struct retry *r, unsigned speed)
+{
+	r->speed = speed;
+}
+
+/* Record an error, returns 1 when the last RETRY_CLUSTER came close together */
+static int retry_clustered(struct retry *r)
+{
+	unsigned long long now = transport_now_us();
+	unsigned long long oldest;
+
+	r->errors[r->nerrors++ % RETRY_CLUSTER] = now;
+	if (r->nerrors < RETRY_CLUSTER)
+		return 0;
+
+	oldest = r->errors[r->nerrors % RETRY_CLUSTER];
+	return now - oldest <= RETRY_CLUSTER_WINDOW * 1000ULL;
+}
+
+/* Returns -1 once the link answers at no speed at all */
+static int retry_slowdown(struct retry *r)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(retry_speeds); i++) {
+		if (retry_speeds[i] < r->speed)
+			break;
+	}
+
+	if (i == ARRAY_SIZE(retry_speeds))
+		return 0;
+
+	pr_warn("Errors clustering at %u, drop to %u\n", r->speed, retry_speeds[i]);
+	if (rtlmp_slowdown(r->trans, r->speed, retry_speeds[i])) {
+		pr_warn("Baudrate change failed: %s\n", strerror(errno));
+		/* Neither speed answers, no retry can get through */
+		return errno == ENOLINK ? -1 : 0;
+	}
+
+	r->speed = retry_speeds[i];
+	r->slowdowns++;
+	/* Start counting again at the new speed */
+	r->nerrors = 0;
+	return 0;
+}
+
+int retry_again(struct retry *r, unsigned attempt, const char *op, uint32_t addr)
+{
+	int err = errno;
+
+	/* Cancelled or past the deadline, retrying can't help */
+	if (rtlmp_check(r->trans))
+		return 0;
+
+	if (attempt + 1 >= RETRY_ATTEMPTS || r->budget == 0) {
+		pr_err("%s failure: %x, %s, giving up after %u tries\n",
+			op, addr, strerror(err), attempt + 1);
+		errno = err;
+		return 0;
+	}
+
+	pr_warn("%s failure: %x, %s, retry %u\n", op, addr, strerror(err), attempt + 1);
+	r->budget--;
+	r->retries++;
+
+	if (rtlmp_resync(r->trans, MIN(RETRY_BACKOFF_MIN << attempt, RETRY_BACKOFF_MAX)))
+		return 0;
+
+	if (r->speed && retry_clustered(r) && retry_slowdown(r))
+		return 0;
+
+	return 1;
+}
+
+void retry_report(struct retry *r)
+{
+	if (r->retries == 0)
+		return;
+
+	pr_info("Retry: %u retries, %u left, %u baudrate drops\n",
+		r->retries, r->budget, r->slowdowns);
+}
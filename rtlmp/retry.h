@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ * 
+ * SPDX-License-Identifier: 
+ */
+
+
+#ifndef __RETRY_H__
+#define __RETRY_H__
+
+#include <stdint.h>
+
+struct transport;
+
+/* Tries per frame or chunk, and retries for a whole session */
+#define RETRY_ATTEMPTS		4
+#define RETRY_BUDGET		64
+
+/* Backoff doubles from MIN to MAX ms between tries */
+#define RETRY_BACKOFF_MIN	10
+#define RETRY_BACKOFF_MAX	500
+
+/* This many errors within WINDOW ms drop the link to the next lower baud */
+#define RETRY_CLUSTER		4
+#define RETRY_CLUSTER_WINDOW	2000
+
+/*
+ * Retry policy shared by the patch and the flash stages. A failed frame
+ * or chunk is retried after a backoff and an input flush, until either
+ * its own tries or the session budget run out.
+ */
+struct retry {
+	struct transport *trans;
+	unsigned budget;
+	unsigned speed;		/* MP link speed, 0 while it can't be changed */
+	unsigned long long errors[RETRY_CLUSTER];	/* ring of error times, us */
+	unsigned nerrors;
+	unsigned retries;
+	unsigned slowdowns;
+};
+
+void retry_init(struct retry *r, struct transport *trans);
+void retry_set_speed(struct retry *r, unsigned speed);
+/* Returns 1 when the @attempt th try of @op at @addr may be repeated */
+int retry_again(struct retry *r, unsigned attempt, const char *op, uint32_t addr);
+void retry_report(struct retry *r);
+
+#endif /* __RETRY_H__*/
@@ -4,6 +4,13 @@
 #include <stddef.h>
 #include <string.h>
 #include <errno.h>
+#include "rtlbt.h"
+#include "hci.h"
+#include "log.h"
+#include "progress.h"
+
+#define OGF_HOST_CTL					0x03
+#define HCI_OP_RESET					0x03
 
 #define OGF_VENDOR_CMD					0x3f
 #define HCI_VENDOR_CHANGE_BAUD			0x17
@@ -19,9 +26,6 @@
 #define cmd_opcode_ogf(op)		(op >> 10)
 #define cmd_opcode_ocf(op)		(op & 0x03ff)
 
-extern void hci_send_cmd(uint16_t opcode, const void *params, uint8_t size);
-extern int hci_send_cmd_sync(uint16_t opcode, const void *params, uint8_t size,
-	void *rsp, uint16_t rsp_size);
 
 static uint32_t rtlbt_baudrate(uint32_t baudrate)
 {
@@ -42,45 +46,87 @@ static uint32_t rtlbt_baudrate(uint32_t baudrate)
 	return 0x0252C014;
 }
 
-int rtlbt_read_chip_type(void)
+/* The HCI status, with the chip type register in @type unless NULL */
+int rtlbt_read_chip_type(struct hci *hci, uint32_t *type)
 {
+	int res;
 	uint8_t rsp[5];
 	const uint8_t params[5] = {0x20, 0xa8, 0x02, 0x00, 0x40};
-	return hci_send_cmd_sync(cmd_opcode_pack(OGF_VENDOR_CMD, HCI_VENDOR_READ_CHIP_TYPE),
+
+	res = hci_cmd_sync(hci, cmd_opcode_pack(OGF_VENDOR_CMD, HCI_VENDOR_READ_CHIP_TYPE),
 		params, sizeof(params), rsp, 5);
+	if (res) {
+		return res;
+	}
+
+	if (type) {
+		*type = rsp[1] | rsp[2] << 8 | rsp[3] << 16 | (uint32_t)rsp[4] << 24;
+	}
+
+	return rsp[0];
 }
 
-int rtlbt_single_tone(unsigned char ch)
+int rtlbt_single_tone(struct hci *hci, unsigned char ch)
 {
 	int res;
 	uint8_t rsp;
 	const uint8_t params[4] = {0x01, 0x00, ch, 0x01};
 
-	res = hci_send_cmd_sync(cmd_opcode_pack(OGF_VENDOR_CMD, HCI_VENDOR_SINGLE_TONE),
+	res = hci_cmd_sync(hci, cmd_opcode_pack(OGF_VENDOR_CMD, HCI_VENDOR_SINGLE_TONE),
 		params, sizeof(params), &rsp, 1);
 
 	return res ? res : rsp;
 }
 
-int rtlbt_vendor_cmd62(const unsigned char dat[9])
+static void rtlbt_setup_done(struct hci *hci, const struct hci_event *ev, void *arg)
+{
+	const char *what = arg;
+
+	if (ev == NULL) {
+		pr_warn("%s: %s\n", what, strerror(errno));
+	} else if (ev->len > 3 && ev->params[3] != 0) {
+		pr_warn("%s: status %d\n", what, ev->params[3]);
+	}
+}
+
+/*
+ * Read the chip type and write the pre-patch register at once. Neither
+ * depends on the other, so both are in flight when the controller
+ * allows it, and neither stops the bring-up if it fails.
+ */
+int rtlbt_setup(struct hci *hci, const unsigned char dat[9])
+{
+	const uint8_t params[5] = {0x20, 0xa8, 0x02, 0x00, 0x40};
+
+	if (hci_submit(hci, cmd_opcode_pack(OGF_VENDOR_CMD, HCI_VENDOR_READ_CHIP_TYPE),
+			params, sizeof(params), rtlbt_setup_done, "Read chip type") ||
+		hci_submit(hci, cmd_opcode_pack(OGF_VENDOR_CMD, HCI_VENDOR_x62),
+			dat, 9, rtlbt_setup_done, "Vendor setup")) {
+		return -1;
+	}
+
+	return hci_drain(hci);
+}
+
+int rtlbt_vendor_cmd62(struct hci *hci, const unsigned char dat[9])
 {
 	int rs;
 	uint8_t status;
 
-	rs = hci_send_cmd_sync(cmd_opcode_pack(OGF_VENDOR_CMD, HCI_VENDOR_x62),
+	rs = hci_cmd_sync(hci, cmd_opcode_pack(OGF_VENDOR_CMD, HCI_VENDOR_x62),
 		dat, 9, &status, 1);
 
 	return rs ? rs : status;
 }
 
-int rtlbt_change_baudrate(unsigned baudrate)
+int rtlbt_change_baudrate(struct hci *hci, unsigned baudrate)
 {
 	int rs;
 	uint8_t status;
 	uint32_t rtlbaudrate;
 
 	rtlbaudrate = rtlbt_baudrate(baudrate);
-	rs = hci_send_cmd_sync(cmd_opcode_pack(OGF_VENDOR_CMD, HCI_VENDOR_CHANGE_BAUD),
+	rs = hci_cmd_sync(hci, cmd_opcode_pack(OGF_VENDOR_CMD, HCI_VENDOR_CHANGE_BAUD),
 		&rtlbaudrate, sizeof(rtlbaudrate), &status, 1);
 
 	return rs ? rs : status;
@@ -97,8 +143,28 @@ int rtlbt_cacl_download_size(FILE *fd)
 	return total;
 }
 
-int rtlbt_fw_download(FILE *fd, int total, int dwsized, int *progress)
+/* Drops a partial patch download, the ROM starts over from fragment 0 */
+int rtlbt_reset(struct hci *hci)
 {
+	int rs;
+	uint8_t status;
+
+	rs = hci_cmd_sync(hci, cmd_opcode_pack(OGF_HOST_CTL, HCI_OP_RESET), NULL, 0, &status, 1);
+
+	return rs ? rs : status;
+}
+
+/*
+ * The ROM appends fragments in the order they arrive and only echoes
+ * the index, it neither rejects nor skips a duplicate. So a fragment
+ * whose ack was lost or bad may or may not have been taken, and sending
+ * it again would leave the patch either short or with a fragment twice.
+ * The first such ack fails the download, the caller resets the ROM and
+ * starts over from fragment 0.
+ */
+int rtlbt_fw_download(struct hci *hci, FILE *fd, struct progress *progress)
+{
+	int rs;
 	bool cmpl = false;
 	uint8_t rsp[2];
 	uint8_t buf[256];
@@ -117,15 +183,20 @@ int rtlbt_fw_download(FILE *fd, int total, int dwsized, int *progress)
 			//buf[0] |= 0x80;
 		}
 
-		hci_send_cmd_sync(opcode, buf, rz + 1, rsp, 2);
-		if (rsp[0] != 0 || rsp[1] != (off & 0x7f)) {
+		rs = hci_cmd_sync(hci, opcode, buf, rz + 1, rsp, 2);
+		if (rs == 0 && (rsp[0] != 0 || rsp[1] != (off & 0x7f))) {
+			pr_warn("Patch fragment %u: status %d, index %u\n", off, rsp[0], rsp[1]);
 			errno = EIO;
+			rs = -1;
+		}
+
+		if (rs != 0) {
 			return -1;
 		}
 		off++;
 
 		if (progress) {
-			*progress = (count  + dwsized) * 100 / total;
+			progress_advance(progress, rz);
 		}
 	} while (!cmpl);
 
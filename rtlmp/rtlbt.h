@@ -9,13 +9,20 @@
 #define __RTLBT_H__
 
 #include <stdio.h>
+#include <stdint.h>
 
-int rtlbt_single_tone(unsigned char ch);
+struct hci;
+struct progress;
+
+int rtlbt_single_tone(struct hci *hci, unsigned char ch);
 int rtlbt_cacl_download_size(FILE *fd);
-int rtlbt_change_baudrate(unsigned baudrate);
-int rtlbt_vendor_cmd62(const unsigned char dat[9]);
-int rtlbt_read_chip_type(void);
-int rtlbt_fw_download(FILE *fd, int total, int dwsized, int *progress);
+int rtlbt_change_baudrate(struct hci *hci, unsigned baudrate);
+int rtlbt_vendor_cmd62(struct hci *hci, const unsigned char dat[9]);
+/* Chip type read and vendor register write @dat, overlapped */
+int rtlbt_setup(struct hci *hci, const unsigned char dat[9]);
+int rtlbt_read_chip_type(struct hci *hci, uint32_t *type);
+int rtlbt_reset(struct hci *hci);
+int rtlbt_fw_download(struct hci *hci, FILE *fd, struct progress *progress);
 
 #endif /* __RTLBT_H__*/
 
@@ -7,15 +7,47 @@
 #include "defs.h"
 #include "rtlmp.h"
 #include "rtlimg.h"
+#include "rtlmptool.h"
+#include "progress.h"
+#include "journal.h"
+#include "pipeline.h"
+#include "tuner.h"
+#include "retry.h"
+#include "patch.h"
+#include "crc16.h"
+#include "transport.h"
+#include "log.h"
 #include <stdio.h>
 #include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* Erase and verify unit */
+#define FLASH_CHUNK_SIZE	RTLMP_ERASE_SIZE
+
+/* Readback frame size and number of frames kept in flight */
+#define READ_FRAME_SIZE		2048
+#define READ_WINDOW			4
 
 struct dwhdr {
 	uint32_t dw_addr;
 	uint32_t dw_size;
+	long dw_off;		/* data offset in the image file */
+	uint16_t dw_crc;	/* CRC16 over the whole dw_size range */
+	const uint16_t *unit_crc;	/* from the image plan, may be NULL */
+	const struct rtlmptool_patch *patch;	/* may be NULL */
+};
+
+struct rtlimg_ctx {
+	struct transport *trans;
+	int verify;
+	struct journal *journal;
+	struct progress *progress;
+	struct retry *retry;
+	struct tuner tuner;
 };
 
-uint16_t crc16_check(uint8_t *buf, uint16_t len, uint16_t value);
 static void parse_mp(struct mphdr *hdr, struct dwhdr *dw)
 {
 	uint8_t *buf = (uint8_t *)(hdr + 1);
@@ -36,14 +68,14 @@ static void parse_mp(struct mphdr *hdr, struct dwhdr *dw)
 	}
 }
 
-static int slice_download(uint32_t addr, uint8_t *buf, uint32_t size)
+static int slice_download(struct transport *trans, uint32_t addr, uint8_t *buf, uint32_t size)
 {
 	int rs = 0;
 	uint32_t wn = 0;
 
 	while (wn < size)  {
-		int c = MIN(2048, size - wn);
-		rs = rtlmp_write_flash(addr + wn, c, buf + wn);
+		int c = MIN(RTLMP_WRITE_SIZE, size - wn);
+		rs = rtlmp_write_flash(trans, addr + wn, c, buf + wn);
 		if (rs < 0)
 			break;
 		wn += c;
@@ -52,38 +84,255 @@ static int slice_download(uint32_t addr, uint8_t *buf, uint32_t size)
 	return rs;
 }
 
-static int do_download(FILE *fd, struct dwhdr *dw, int total, int *dwsized, int *progress)
+static int chunk_download(struct transport *trans, uint32_t addr, uint8_t *dat, uint32_t size)
+{
+	int rs;
+
+	rs = rtlmp_erase_flash(trans, addr, FLASH_CHUNK_SIZE);
+	if (rs < 0)
+		return rs;
+
+	return slice_download(trans, addr, dat, size);
+}
+
+/* Host side CRC16 of @size bytes at @off within the sub-image */
+static int region_crc(FILE *fd, struct dwhdr *dw, uint32_t off, uint32_t size, uint16_t *crc)
+{
+	uint8_t dat[FLASH_CHUNK_SIZE];
+	uint32_t rn = 0;
+
+	*crc = 0;
+	if (fseek(fd, dw->dw_off + off, SEEK_SET))
+		return -1;
+
+	while (rn < size) {
+		int rz = fread(dat, 1, MIN(sizeof(dat), size - rn), fd);
+		if (rz <= 0) {
+			errno = EIO;
+			return -1;
+		}
+
+		patch_apply(dw->patch, dw->dw_addr, off + rn, dat, rz, 0);
+		*crc = crc16_check(dat, rz, *crc);
+		rn += rz;
+	}
+
+	return 0;
+}
+
+static int chunk_rewrite(struct transport *trans, FILE *fd, struct dwhdr *dw,
+	uint32_t off, uint32_t size, struct retry *retry)
+{
+	int rs;
+	unsigned attempt;
+	uint16_t crc;
+	uint8_t dat[FLASH_CHUNK_SIZE];
+
+	if (fseek(fd, dw->dw_off + off, SEEK_SET) || size != fread(dat, 1, size, fd)) {
+		errno = EIO;
+		return -1;
+	}
+	patch_apply(dw->patch, dw->dw_addr, off, dat, size, 0);
+	crc = crc16_check(dat, size, 0);
+
+	for (attempt = 0;; attempt++) {
+		pr_warn("Rewrite: %x, %x\n", dw->dw_addr + off, size);
+		rs = chunk_download(trans, dw->dw_addr + off, dat, size);
+		if (rs == 0)
+			rs = rtlmp_verify_flash(trans, dw->dw_addr + off, size, crc);
+
+		if (rs == 0 || !retry_again(retry, attempt, "Rewrite", dw->dw_addr + off))
+			return rs;
+	}
+}
+
+/*
+ * Verify [off, off + size) and, if it fails, bisect down to the bad
+ * chunks and rewrite only those. @failed is set when the caller
+ * already knows the whole range is bad. Ranges are settled front to
+ * back, and @good, unless NULL, is moved past each one that ends up
+ * right on the device while all before it are.
+ */
+static int region_repair(struct transport *trans, FILE *fd, struct dwhdr *dw,
+	uint32_t off, uint32_t size, bool failed, struct retry *retry, uint32_t *good)
+{
+	int rs;
+	uint16_t crc;
+	uint32_t half;
+
+	if (!failed) {
+		if (region_crc(fd, dw, off, size, &crc))
+			return -1;
+
+		if (rtlmp_verify_flash(trans, dw->dw_addr + off, size, crc) == 0) {
+			rs = 0;
+			goto settled;
+		}
+	}
+
+	if (size <= FLASH_CHUNK_SIZE) {
+		rs = chunk_rewrite(trans, fd, dw, off, size, retry);
+		goto settled;
+	}
+
+	half = (size + FLASH_CHUNK_SIZE - 1) / FLASH_CHUNK_SIZE / 2 * FLASH_CHUNK_SIZE;
+	rs = region_repair(trans, fd, dw, off, half, false, retry, good);
+	if (rs < 0)
+		return rs;
+
+	return region_repair(trans, fd, dw, off + half, size - half, false, retry, good);
+
+settled:
+	if (rs == 0 && good && *good == off)
+		*good = off + size;
+	return rs;
+}
+
+/*
+ * Verify a whole sub-image and repair it if needed. What ends up
+ * verified goes to @journal: all of it, or the prefix that was right
+ * before the repair gave up, so a later run resumes from there.
+ */
+static int region_verify(struct transport *trans, FILE *fd, struct dwhdr *dw,
+	struct retry *retry, struct journal *journal)
+{
+	int rs;
+	uint32_t good = 0;
+
+	if (rtlmp_verify_flash(trans, dw->dw_addr, dw->dw_size, dw->dw_crc) == 0) {
+		journal_commit(journal, dw->dw_addr, dw->dw_size);
+		return 0;
+	}
+
+	pr_warn("Verify failure: %x, %x, bisecting\n", dw->dw_addr, dw->dw_size);
+	rs = region_repair(trans, fd, dw, 0, dw->dw_size, true, retry, &good);
+	if (good) {
+		journal_commit(journal, dw->dw_addr, good);
+	}
+
+	return rs;
+}
+
+/*
+ * Skip what the journal recorded as verified for this sub-image, after
+ * one device CRC over that prefix confirms it is still there.
+ */
+static uint32_t resume_offset(struct transport *trans, FILE *fd, struct dwhdr *dw,
+	struct journal *journal)
+{
+	uint16_t crc;
+	uint32_t done = journal_done(journal, dw->dw_addr);
+
+	done = MIN(done / FLASH_CHUNK_SIZE * FLASH_CHUNK_SIZE, dw->dw_size);
+	if (done == 0)
+		return 0;
+
+	if (region_crc(fd, dw, 0, done, &crc) ||
+		rtlmp_verify_flash(trans, dw->dw_addr, done, crc) != 0) {
+		pr_warn("Journal mismatch: %x, restart\n", dw->dw_addr);
+		return 0;
+	}
+
+	pr_info("Resume: %x, skip %x\n", dw->dw_addr, done);
+	dw->dw_crc = crc;
+	return done;
+}
+
+static int do_download(FILE *fd, struct dwhdr *dw, struct rtlimg_ctx *ctx)
 {
-	int rs = -1;
-	uint8_t dat[4096];
-	uint16_t crc16;
-	uint32_t dwsz = 0;
+	struct transport *trans = ctx->trans;
+	int rs = 0;
+	bool repair;
+	unsigned i, attempt;
+	uint32_t dwsz, span_off = 0, span_size = 0;
+	unsigned long long start, t0;
+	struct pipeline pipe;
+	struct pipeline_chunk *c;
+
+	dw->dw_crc = 0;
+	dwsz = resume_offset(trans, fd, dw, ctx->journal);
+	if (ctx->progress && dwsz) {
+		progress_advance(ctx->progress, dwsz);
+	}
 
 	while (dwsz < dw->dw_size) {
-		int rz = fread(dat, 1, MIN(sizeof(dat), dw->dw_size - dwsz), fd);
-		if (rz <= 0)
-			break;
+		if (pipeline_start(&pipe, fd, dw->dw_off + dwsz, dw->dw_addr + dwsz,
+				dw->dw_size - dwsz, dw->dw_crc, &ctx->tuner,
+				dw->dw_addr, dw->unit_crc, dw->patch)) {
+			return -1;
+		}
 
-		rs = rtlmp_erase_flash(dw->dw_addr + dwsz, sizeof(dat));
-		if (rs < 0)
-			break;
+		/* The next chunks are read and serialized while this one is on the wire */
+		repair = false;
+		while (rs == 0 && !repair && (c = pipeline_get(&pipe)) != NULL) {
+			start = transport_now_us();
+			rs = rtlmp_check(trans);
+			for (attempt = 0; rs == 0 && rtlmp_erase_flash(trans, c->addr, FLASH_CHUNK_SIZE); attempt++) {
+				if (!retry_again(ctx->retry, attempt, "Erase", c->addr))
+					rs = -1;
+			}
 
-		crc16 = crc16_check(dat, rz, 0);
+			/* Only the frame that failed is sent again */
+			for (i = 0; rs == 0 && i < c->nframes; i++) {
+				for (attempt = 0;; attempt++) {
+					t0 = transport_now_us();
+					if (rtlmp_write_flash_raw(trans, c->frame[i], c->frame_len[i]) == 0) {
+						tuner_write(&ctx->tuner, c->frame_len[i], transport_now_us() - t0);
+						break;
+					}
+
+					tuner_write_error(&ctx->tuner, c->frame_len[i]);
+					if (!retry_again(ctx->retry, attempt, "Write", c->addr)) {
+						rs = -1;
+						break;
+					}
+				}
+			}
 
-		rs = slice_download(dw->dw_addr + dwsz, dat, rz);
-		if (progress) {
-			*dwsized += rz;
-			*progress = (*dwsized * 100) / total;
+			if (rs == 0 && !c->blank)
+				tuner_chunk(&ctx->tuner, transport_now_us() - start);
+
+			if (ctx->progress) {
+				progress_advance(ctx->progress, c->size);
+			}
+			dwsz += c->size;
+
+			if (rs == 0 && ctx->verify == RTLMPTOOL_VERIFY_CHUNK && c->span_end) {
+				t0 = transport_now_us();
+				if (rtlmp_verify_flash(trans, c->span_addr, c->span_size, c->span_crc) == 0) {
+					tuner_verify(&ctx->tuner, transport_now_us() - t0);
+					journal_commit(ctx->journal, dw->dw_addr, dwsz);
+				} else {
+					tuner_verify_error(&ctx->tuner);
+					span_off = c->span_addr - dw->dw_addr;
+					span_size = c->span_size;
+					repair = true;
+				}
+			}
+
+			pipeline_put(&pipe);
 		}
 
-		if (rs < 0)
-			break;
+		if (pipeline_stop(&pipe) || rs != 0) {
+			return -1;
+		}
 
-		rs = rtlmp_verify_flash(dw->dw_addr + dwsz, rz, crc16);
-		if (rs < 0)
+		if (!repair) {
+			dw->dw_crc = pipe.crc;
 			break;
+		}
+
+		/* Chunks already prepared past the span are dropped and redone */
+		pr_warn("Verify failure: %x, %x\n", dw->dw_addr + span_off, span_size);
+		rs = region_repair(trans, fd, dw, span_off, span_size, true, ctx->retry, NULL);
+		if (rs != 0 || region_crc(fd, dw, 0, dwsz, &dw->dw_crc)) {
+			return -1;
+		}
+		journal_commit(ctx->journal, dw->dw_addr, dwsz);
+	}
 
-		dwsz += rz;
+	if (ctx->verify == RTLMPTOOL_VERIFY_IMAGE) {
+		rs = region_verify(trans, fd, dw, ctx->retry, ctx->journal);
 	}
 
 	return rs;
@@ -100,7 +349,9 @@ static int rtlimg_calc_download_dw(FILE *fd, uint32_t off, uint32_t addr, struct
 		return -1;
 	}
 
+	memset(dw, 0, sizeof(*dw));
 	dw->dw_addr = addr;
+	dw->dw_off = off + sizeof(buf);
 	for (i = 0; i < sizeof(buf);) {
 		hdr = (struct mphdr*)(buf + i);
 
@@ -171,15 +422,21 @@ int rtlimg_calc_download_size(FILE *fd)
 	return total;
 }
 
-int rtlimg_download(FILE *fd, int total, int dwsized, int *progress)
+/* Parse the sub-image headers into @dw, returns the number of sub-images */
+static int rtlimg_layout(FILE *fd, struct dwhdr dw[32])
 {
-	int i;
-	unsigned nr;
+	int i, nr, dwnr = 0;
 	uint32_t off;
-	struct dwhdr dw;
 	struct subhdr sub[32];
 
+	/* No CRC or unit field is left over from the stack for callers */
+	memset(dw, 0, 32 * sizeof(struct dwhdr));
+
 	nr = rtlimg_calc_download_number(fd);
+	if (nr < 0) {
+		return -1;
+	}
+
 	for (i = 0;i < nr; i++) {
 		if (sizeof(struct subhdr) != fread(&sub[i], 1, sizeof(struct subhdr), fd)) {
 			errno = EINVAL;
@@ -189,16 +446,465 @@ int rtlimg_download(FILE *fd, int total, int dwsized, int *progress)
 
 	off = sizeof(struct imghdr) + nr * sizeof(struct subhdr);
 	for (i = 0; i < nr; i++) {
-		if (!rtlimg_calc_download_dw(fd, off, sub[i].downloadAddr, &dw)) {
-			printf("Download: %x, %x\n", dw.dw_addr, dw.dw_size);
-			if (do_download(fd, &dw, total, &dwsized, progress)) {
-				printf("Download failure: offset = %x, addresss %x\n", off, sub[i].downloadAddr);
+		if (!rtlimg_calc_download_dw(fd, off, sub[i].downloadAddr, &dw[dwnr])) {
+			dwnr++;
+		}
+
+		off += sub[i].size;
+	}
+
+	return dwnr;
+}
+
+int rtlimg_regions(FILE *fd, struct rtlimg_region *r, int max)
+{
+	int i, dwnr;
+	uint32_t pos, j, c;
+	struct dwhdr dw[32];
+	uint8_t dat[FLASH_CHUNK_SIZE];
+
+	dwnr = rtlimg_layout(fd, dw);
+	if (dwnr < 0) {
+		return -1;
+	}
+
+	dwnr = MIN(dwnr, max);
+	for (i = 0; i < dwnr; i++) {
+		r[i].addr = dw[i].dw_addr;
+		r[i].size = dw[i].dw_size;
+		r[i].units = 0;
+		r[i].blank = 0;
+		r[i].written = 0;
+
+		if (fseek(fd, dw[i].dw_off, SEEK_SET))
+			return -1;
+
+		/* Same chunking as the pipeline, so blank units match what it skips */
+		for (pos = 0; pos < dw[i].dw_size; pos += c) {
+			c = MIN(sizeof(dat), dw[i].dw_size - pos);
+			if (c != fread(dat, 1, c, fd)) {
+				errno = EIO;
 				return -1;
 			}
+
+			for (j = 0; j < c && dat[j] == 0xff; j++)
+				;
+			r[i].units++;
+			if (j == c) {
+				r[i].blank++;
+			} else {
+				r[i].written += c;
+			}
 		}
+	}
 
-		off += sub[i].size;
+	return dwnr;
+}
+
+struct rtlimg_plan *rtlimg_plan_create(FILE *fd)
+{
+	int i, dwnr;
+	uint32_t pos, c;
+	struct dwhdr dw[32];
+	struct rtlimg_plan *plan;
+	uint8_t dat[FLASH_CHUNK_SIZE];
+
+	dwnr = rtlimg_layout(fd, dw);
+	if (dwnr < 0) {
+		return NULL;
+	}
+
+	plan = calloc(1, sizeof(*plan));
+	if (plan == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < dwnr; i++) {
+		uint16_t *crc = malloc((dw[i].dw_size / FLASH_CHUNK_SIZE + 1) * sizeof(*crc));
+
+		if (crc == NULL) {
+			goto err;
+		}
+		plan->region[i].addr = dw[i].dw_addr;
+		plan->region[i].size = dw[i].dw_size;
+		plan->region[i].crc = crc;
+		plan->nr++;
+
+		if (fseek(fd, dw[i].dw_off, SEEK_SET)) {
+			goto err;
+		}
+
+		for (pos = 0; pos < dw[i].dw_size; pos += c) {
+			c = MIN(sizeof(dat), dw[i].dw_size - pos);
+			if (c != fread(dat, 1, c, fd)) {
+				errno = EIO;
+				goto err;
+			}
+			*crc++ = crc16_check(dat, c, 0);
+		}
+	}
+
+	return plan;
+err:
+	rtlimg_plan_destroy(plan);
+	return NULL;
+}
+
+void rtlimg_plan_destroy(struct rtlimg_plan *plan)
+{
+	int i;
+
+	if (plan == NULL) {
+		return;
+	}
+
+	for (i = 0; i < plan->nr; i++) {
+		free(plan->region[i].crc);
+	}
+	free(plan);
+}
+
+/* Hang @plan and @patch on the sub-images, every field must land in one */
+static int rtlimg_attach(struct dwhdr *dw, int dwnr, const struct rtlimg_plan *plan,
+	const struct rtlmptool_patch *patch)
+{
+	int i, j;
+	unsigned k;
+
+	for (i = 0; i < dwnr; i++) {
+		dw[i].patch = patch;
+		for (j = 0; plan && j < plan->nr; j++) {
+			if (plan->region[j].addr == dw[i].dw_addr &&
+				plan->region[j].size == dw[i].dw_size) {
+				dw[i].unit_crc = plan->region[j].crc;
+				break;
+			}
+		}
+	}
+
+	for (k = 0; patch && k < patch->nfields; k++) {
+		const struct patch_field *f = &patch->field[k];
+
+		for (i = 0; i < dwnr; i++) {
+			if (f->addr == dw[i].dw_addr && f->off + f->size <= dw[i].dw_size)
+				break;
+		}
+
+		if (i == dwnr) {
+			pr_err("Patch outside the image: %x + %x\n", f->addr, f->off);
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int rtlimg_download(struct transport *trans, FILE *fd, const struct rtlimg_plan *plan,
+	const struct rtlmptool_patch *patch, int verify, struct journal *journal,
+	struct progress *progress, struct retry *retry)
+{
+	int i, dwnr;
+	struct dwhdr dw[32];
+	struct rtlimg_ctx ctx;
+
+	dwnr = rtlimg_layout(fd, dw);
+	if (dwnr < 0 || rtlimg_attach(dw, dwnr, plan, patch)) {
+		return -1;
+	}
+
+	if (journal && verify == RTLMPTOOL_VERIFY_END) {
+		pr_warn("Journal: verify at the end, nothing resumes before the final pass\n");
+	}
+
+	ctx.trans = trans;
+	ctx.verify = verify;
+	ctx.journal = journal;
+	ctx.progress = progress;
+	ctx.retry = retry;
+	tuner_init(&ctx.tuner);
+
+	for (i = 0; i < dwnr; i++) {
+		if (rtlmp_check(trans)) {
+			return -1;
+		}
+
+		pr_info("Download: %x, %x\n", dw[i].dw_addr, dw[i].dw_size);
+		if (do_download(fd, &dw[i], &ctx)) {
+			pr_err("Download failure: offset = %lx, addresss %x\n", dw[i].dw_off, dw[i].dw_addr);
+			tuner_report(&ctx.tuner);
+			return -1;
+		}
+	}
+	tuner_report(&ctx.tuner);
+
+	if (verify == RTLMPTOOL_VERIFY_END) {
+		for (i = 0; i < dwnr; i++) {
+			if (region_verify(trans, fd, &dw[i], retry, journal)) {
+				pr_err("Verify failure: addresss %x\n", dw[i].dw_addr);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Erase unit at @addr as flashing @fd leaves it: the sub-image bytes
+ * over 0xff. Returns whether any sub-image touches the unit.
+ */
+static int flash_unit(FILE *fd, struct dwhdr *dw, int dwnr, uint32_t addr, uint8_t *dat)
+{
+	int i, touched = 0;
+	uint32_t lo, hi;
+
+	memset(dat, 0xff, FLASH_CHUNK_SIZE);
+	for (i = 0; i < dwnr; i++) {
+		lo = MAX(addr, dw[i].dw_addr);
+		hi = MIN(addr + FLASH_CHUNK_SIZE, dw[i].dw_addr + dw[i].dw_size);
+		if (lo >= hi)
+			continue;
+
+		if (fseek(fd, dw[i].dw_off + lo - dw[i].dw_addr, SEEK_SET) ||
+			hi - lo != fread(dat + lo - addr, 1, hi - lo, fd)) {
+			errno = EIO;
+			return -1;
+		}
+		patch_apply(dw[i].patch, dw[i].dw_addr, lo - dw[i].dw_addr, dat + lo - addr, hi - lo, 0);
+		touched = 1;
+	}
+
+	return touched;
+}
+
+/*
+ * Flash @fd over a device that holds @old. Only erase units whose
+ * contents differ are erased and written, nothing is read back; each
+ * sub-image is then confirmed with one device CRC, and repaired like a
+ * failed verify if the device did not hold @old after all.
+ */
+int rtlimg_download_delta(struct transport *trans, FILE *old, FILE *fd,
+	const struct rtlmptool_patch *patch, struct progress *progress, struct retry *retry)
+{
+	int i, rs, odwnr, dwnr;
+	unsigned attempt, changed = 0, units = 0;
+	uint32_t off, c, j;
+	struct dwhdr odw[32], dw[32];
+	uint8_t dat[FLASH_CHUNK_SIZE], prev[FLASH_CHUNK_SIZE];
+
+	odwnr = rtlimg_layout(old, odw);
+	dwnr = rtlimg_layout(fd, dw);
+	if (odwnr < 0 || dwnr < 0) {
+		return -1;
+	}
+
+	/* The fields differ per device, so they are laid over both images */
+	if (rtlimg_attach(dw, dwnr, NULL, patch)) {
+		return -1;
+	}
+	for (i = 0; i < odwnr; i++) {
+		odw[i].patch = patch;
+	}
+
+	for (i = 0; i < dwnr; i++) {
+		for (off = 0; off < dw[i].dw_size; off += c) {
+			uint32_t addr = dw[i].dw_addr + off;
+
+			c = MIN(FLASH_CHUNK_SIZE, dw[i].dw_size - off);
+			if (rtlmp_check(trans)) {
+				return -1;
+			}
+
+			/* A full flash erases the whole unit, so compare it padded */
+			rs = flash_unit(old, odw, odwnr, addr, prev);
+			if (rs < 0 || flash_unit(fd, dw, dwnr, addr, dat) < 0) {
+				return -1;
+			}
+
+			units++;
+			if (rs == 0 || memcmp(prev, dat, FLASH_CHUNK_SIZE)) {
+				changed++;
+				for (j = 0; j < c && dat[j] == 0xff; j++)
+					;
+
+				/* Erased is all a blank unit needs */
+				for (attempt = 0;; attempt++) {
+					rs = j == c ? rtlmp_erase_flash(trans, addr, FLASH_CHUNK_SIZE) :
+						chunk_download(trans, addr, dat, c);
+					if (rs == 0 || !retry_again(retry, attempt, "Delta", addr))
+						break;
+				}
+
+				if (rs != 0) {
+					pr_err("Delta failure: %x\n", addr);
+					return -1;
+				}
+			}
+
+			if (progress) {
+				progress_advance(progress, c);
+			}
+		}
+	}
+	pr_info("Delta: %u of %u erase units rewritten\n", changed, units);
+
+	for (i = 0; i < dwnr; i++) {
+		if (region_crc(fd, &dw[i], 0, dw[i].dw_size, &dw[i].dw_crc) ||
+			region_verify(trans, fd, &dw[i], retry, NULL)) {
+			pr_err("Verify failure: addresss %x\n", dw[i].dw_addr);
+			return -1;
+		}
 	}
 
 	return 0;
 }
+
+int rtlimg_verify(struct transport *trans, FILE *fd, const struct rtlmptool_patch *patch)
+{
+	int i, dwnr;
+	struct dwhdr dw[32];
+
+	dwnr = rtlimg_layout(fd, dw);
+	if (dwnr < 0 || rtlimg_attach(dw, dwnr, NULL, patch)) {
+		return -1;
+	}
+
+	/* The layout leaves dw_crc zero, the expected CRC is the image's own */
+	for (i = 0; i < dwnr; i++) {
+		if (region_crc(fd, &dw[i], 0, dw[i].dw_size, &dw[i].dw_crc)) {
+			return -1;
+		}
+	}
+
+	for (i = 0; i < dwnr; i++) {
+		if (rtlmp_check(trans)) {
+			return -1;
+		}
+
+		if (rtlmp_verify_flash(trans, dw[i].dw_addr, dw[i].dw_size, dw[i].dw_crc)) {
+			pr_err("Verify failure: addresss %x\n", dw[i].dw_addr);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Responses carry no address, so the ones still in flight behind a
+ * failed frame are read and thrown away before anything is asked again,
+ * else they would be taken for answers to the new requests.
+ */
+static void readback_drain(struct transport *trans, uint32_t sent, uint32_t recv)
+{
+	uint32_t c;
+	uint8_t dat[READ_FRAME_SIZE];
+
+	for (recv += READ_FRAME_SIZE; recv < sent; recv += c) {
+		c = MIN(READ_FRAME_SIZE, sent - recv);
+		if (rtlmp_read_flash_response(trans, c, dat) < 0 && errno == ETIMEDOUT)
+			break;
+	}
+}
+
+int rtlimg_readback(struct transport *trans, uint32_t addr, uint32_t size,
+	uint8_t *dat, struct progress *progress, struct retry *retry)
+{
+	unsigned attempt = 0, window = READ_WINDOW;
+	uint32_t sent = 0, recv = 0;
+
+	while (recv < size) {
+		uint32_t c;
+
+		if (rtlmp_check(trans))
+			return -1;
+
+		while (sent < size && sent - recv < window * READ_FRAME_SIZE) {
+			c = MIN(READ_FRAME_SIZE, size - sent);
+			if (rtlmp_read_flash_request(trans, addr + sent, c) < 0)
+				return -1;
+			sent += c;
+		}
+
+		c = MIN(READ_FRAME_SIZE, size - recv);
+		if (rtlmp_read_flash_response(trans, c, dat + recv) < 0) {
+			readback_drain(trans, sent, recv);
+			if (!retry_again(retry, attempt++, "Read", addr + recv))
+				return -1;
+
+			/* One frame at a time until one comes back clean */
+			sent = recv;
+			window = 1;
+			continue;
+		}
+		recv += c;
+		attempt = 0;
+		window = READ_WINDOW;
+
+		if (progress) {
+			progress_advance(progress, c);
+		}
+	}
+
+	return 0;
+}
+
+static void report_diff(uint32_t start, uint32_t end)
+{
+	pr_info("Differ: %08x - %08x (%u bytes)\n", start, end, end - start);
+}
+
+int rtlimg_compare(FILE *fd, uint32_t addr, const uint8_t *dat, uint32_t size)
+{
+	int i, dwnr, diffs = 0;
+	struct dwhdr dw[32];
+	uint8_t buf[FLASH_CHUNK_SIZE];
+
+	dwnr = rtlimg_layout(fd, dw);
+	if (dwnr < 0) {
+		return -1;
+	}
+
+	for (i = 0; i < dwnr; i++) {
+		bool open = false;
+		uint32_t start = 0, pos;
+		uint32_t lo = MAX(addr, dw[i].dw_addr);
+		uint32_t hi = MIN(addr + size, dw[i].dw_addr + dw[i].dw_size);
+
+		if (lo >= hi)
+			continue;
+
+		if (fseek(fd, dw[i].dw_off + lo - dw[i].dw_addr, SEEK_SET))
+			return -1;
+
+		for (pos = lo; pos < hi;) {
+			uint32_t j, c = MIN(sizeof(buf), hi - pos);
+
+			if (c != fread(buf, 1, c, fd)) {
+				errno = EIO;
+				return -1;
+			}
+
+			for (j = 0; j < c; j++, pos++) {
+				bool differ = buf[j] != dat[pos - addr];
+
+				if (differ && !open) {
+					start = pos;
+					open = true;
+				} else if (!differ && open) {
+					report_diff(start, pos);
+					open = false;
+					diffs++;
+				}
+			}
+		}
+
+		if (open) {
+			report_diff(start, hi);
+			diffs++;
+		}
+	}
+
+	return diffs;
+}
@@ -11,6 +11,12 @@
 #include <stdint.h>
 #include <stdio.h>
 
+struct transport;
+struct progress;
+struct journal;
+struct retry;
+struct rtlmptool_patch;
+
 struct imghdr {
 	uint16_t sign;
 	uint32_t sizeOfMergedFile;
@@ -31,8 +37,43 @@ struct mphdr {
 	uint8_t length;
 } __attribute__((packed));
 
+/* One sub-image as it lands in flash */
+struct rtlimg_region {
+	uint32_t addr;
+	uint32_t size;
+	unsigned units;		/* erase units */
+	unsigned blank;		/* of which all 0xff, erased but not written */
+	uint32_t written;	/* bytes in the other units */
+};
+
+/* CRC16 of every erase unit of every sub-image, as read from the image */
+struct rtlimg_plan {
+	int nr;
+	struct {
+		uint32_t addr;
+		uint32_t size;
+		uint16_t *crc;
+	} region[32];
+};
+
 int rtlimg_calc_download_size(FILE *fd);
-int rtlimg_download(FILE *fd, int total, int dwsized, int *progress);
+/* The sub-images of @fd, up to @max, returns their number */
+int rtlimg_regions(FILE *fd, struct rtlimg_region *r, int max);
+struct rtlimg_plan *rtlimg_plan_create(FILE *fd);
+void rtlimg_plan_destroy(struct rtlimg_plan *plan);
+/* @plan and @patch may be NULL */
+int rtlimg_download(struct transport *trans, FILE *fd, const struct rtlimg_plan *plan,
+	const struct rtlmptool_patch *patch, int verify, struct journal *journal,
+	struct progress *progress, struct retry *retry);
+/* Only the erase units that differ from @old, the image the device holds */
+int rtlimg_download_delta(struct transport *trans, FILE *old, FILE *fd,
+	const struct rtlmptool_patch *patch, struct progress *progress, struct retry *retry);
+/* Device CRC of every sub-image, nothing is rewritten */
+int rtlimg_verify(struct transport *trans, FILE *fd, const struct rtlmptool_patch *patch);
+int rtlimg_readback(struct transport *trans, uint32_t addr, uint32_t size,
+	uint8_t *dat, struct progress *progress, struct retry *retry);
+/* Report the ranges of @dat that differ from the image, returns their number */
+int rtlimg_compare(FILE *fd, uint32_t addr, const uint8_t *dat, uint32_t size);
 
 #endif /* __RTLIMG_H__*/
 
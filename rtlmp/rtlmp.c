@@ -8,10 +8,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
-
-int rtlmp_read(void *mp, uint32_t size);
-int rtlmp_write(const void *mp, uint32_t size);
-int rtlmp_send_sync(const void *mp, uint32_t size, void *rsp, uint32_t rsp_size);
+#include <errno.h>
+
+int rtlmp_read(struct transport *trans, uint16_t command, void *mp, uint32_t size);
+int rtlmp_write(struct transport *trans, const void *mp, uint32_t size);
+int rtlmp_send_sync(struct transport *trans, const void *mp, uint32_t size,
+	void *rsp, uint32_t rsp_size);
+int rtlmp_send_frame_sync(struct transport *trans, const void *frame, uint32_t size,
+	void *rsp, uint32_t rsp_size);
+int rtlmp_probe_sync(struct transport *trans, const void *mp, uint32_t size,
+	void *rsp, uint32_t rsp_size);
 uint16_t crc16_check(uint8_t *buf, uint16_t len, uint16_t value);
 
 struct mpbaudrate_cp {
@@ -41,7 +47,7 @@ struct mpcommon_rp {
   uint32_t length;
 } __attribute__((packed));
 
-int rtlmp_reset(uint8_t mode)
+int rtlmp_reset(struct transport *trans, uint8_t mode)
 {
 	struct mpreset_cp cp;
 	struct mpcommon_rp rp;
@@ -49,10 +55,27 @@ int rtlmp_reset(uint8_t mode)
 	cp.magic = 0x87;
 	cp.command = 0x1041;
 	cp.mode = mode;
-	return rtlmp_send_sync(&cp, sizeof(cp), &rp, sizeof(rp));
+	return rtlmp_send_sync(trans, &cp, sizeof(cp), &rp, sizeof(rp));
+}
+
+int rtlmp_change_baudrate(struct transport *trans, uint32_t baudrate)
+{
+	struct mpcommon_rp rp;
+	struct mpbaudrate_cp cp;
+
+	cp.magic = 0x87;
+	cp.command = 0x1010;
+	cp.baudrate = baudrate;
+	cp.padding = 0xff;
+
+	return rtlmp_send_sync(trans, &cp, sizeof(cp), &rp, sizeof(rp));
 }
 
-int rtlmp_change_baudrate(uint32_t baudrate)
+/*
+ * Re-announce the current speed. The firmware acks it without changing
+ * anything, which makes it a safe readiness probe.
+ */
+int rtlmp_probe(struct transport *trans, uint32_t baudrate)
 {
 	struct mpcommon_rp rp;
 	struct mpbaudrate_cp cp;
@@ -62,10 +85,19 @@ int rtlmp_change_baudrate(uint32_t baudrate)
 	cp.baudrate = baudrate;
 	cp.padding = 0xff;
 
-	return rtlmp_send_sync(&cp, sizeof(cp), &rp, sizeof(rp));
+	if (rtlmp_probe_sync(trans, &cp, sizeof(cp), &rp, sizeof(rp))) {
+		return -1;
+	}
+
+	if (rp.magic != 0x87 || rp.command != 0x1010) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	return 0;
 }
 
-int rtlmp_erase_flash(uint32_t addr, uint32_t size)
+int rtlmp_erase_flash(struct transport *trans, uint32_t addr, uint32_t size)
 {
 	struct mpflash_cp cp;
 	struct mpcommon_rp rp;
@@ -75,45 +107,87 @@ int rtlmp_erase_flash(uint32_t addr, uint32_t size)
 	cp.addr = addr;
 	cp.size = size;
 
-	return rtlmp_send_sync(&cp, sizeof(cp), &rp, sizeof(rp));
+	return rtlmp_send_sync(trans, &cp, sizeof(cp), &rp, sizeof(rp));
 }
 
-int rtlmp_write_flash(uint32_t addr, uint32_t size, const void *dat)
+_Static_assert(RTLMP_RSP_SIZE == sizeof(struct mpcommon_rp),
+	"RTLMP_RSP_SIZE out of sync with struct mpcommon_rp");
+
+_Static_assert(RTLMP_WRITE_FRAME_SIZE(0) == sizeof(struct mpflash_cp) + 2,
+	"RTLMP_WRITE_FRAME_SIZE out of sync with struct mpflash_cp");
+
+uint32_t rtlmp_write_flash_frame(void *frame, uint32_t addr, uint32_t size, const void *dat)
 {
-	int rs;
-	struct mpflash_cp *cp = malloc(sizeof(*cp) + size);
-	struct mpcommon_rp rp;
+	uint16_t crc;
+	struct mpflash_cp *cp = frame;
 
 	cp->magic = 0x87;
 	cp->command = 0x1032;
 	cp->addr = addr;
 	cp->size = size;
-	memcpy(((void*)cp) + sizeof(*cp), dat, size);
+	memcpy(frame + sizeof(*cp), dat, size);
 
-	rs = rtlmp_send_sync(cp, sizeof(*cp) + size, &rp, sizeof(rp));
-	free(cp);
+	crc = crc16_check(frame, sizeof(*cp) + size, 0);
+	memcpy(frame + sizeof(*cp) + size, &crc, 2);
 
-	return rs;
+	return sizeof(*cp) + size + 2;
 }
 
-int rtlmp_read_flash(uint32_t addr, uint32_t size, void *dat)
+int rtlmp_write_flash_raw(struct transport *trans, const void *frame, uint32_t len)
+{
+	struct mpcommon_rp rp;
+
+	return rtlmp_send_frame_sync(trans, frame, len, &rp, sizeof(rp));
+}
+
+int rtlmp_write_flash(struct transport *trans, uint32_t addr, uint32_t size, const void *dat)
+{
+	uint8_t frame[RTLMP_WRITE_FRAME_SIZE(size)];
+
+	return rtlmp_write_flash_raw(trans, frame, rtlmp_write_flash_frame(frame, addr, size, dat));
+}
+
+int rtlmp_read_flash_request(struct transport *trans, uint32_t addr, uint32_t size)
 {
-	int rs;
 	struct mpflash_cp cp;
-	struct mpcommon_rp *rp = malloc(sizeof(*rp) + size);
 
 	cp.magic = 0x87;
-	cp.command = 0x1032;
+	cp.command = 0x1031;
 	cp.addr = addr;
 	cp.size = size;
 
-	rs = rtlmp_send_sync(&cp, sizeof(cp), rp, sizeof(*rp) + size);
-	free(rp);
+	return rtlmp_write(trans, &cp, sizeof(cp));
+}
 
-	return rs;
+int rtlmp_read_flash_response(struct transport *trans, uint32_t size, void *dat)
+{
+	uint8_t buf[sizeof(struct mpcommon_rp) + size];
+	struct mpcommon_rp *rp = (struct mpcommon_rp *)buf;
+
+	if (rtlmp_read(trans, 0x1031, buf, sizeof(buf))) {
+		return -1;
+	}
+
+	/* A late answer to a request of another size */
+	if (rp->length != size) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	memcpy(dat, buf + sizeof(*rp), size);
+
+	return 0;
+}
+
+int rtlmp_read_flash(struct transport *trans, uint32_t addr, uint32_t size, void *dat)
+{
+	if (rtlmp_read_flash_request(trans, addr, size))
+		return -1;
+
+	return rtlmp_read_flash_response(trans, size, dat);
 }
 
-int rtlmp_verify_flash(uint32_t addr, uint32_t size, uint16_t crc)
+int rtlmp_verify_flash(struct transport *trans, uint32_t addr, uint32_t size, uint16_t crc)
 {
 	int rs;
 	struct mpflash_cp *cp = malloc(sizeof(*cp) + 2);
@@ -125,7 +199,7 @@ int rtlmp_verify_flash(uint32_t addr, uint32_t size, uint16_t crc)
 	cp->size = size;
 	memcpy(((void*)cp) + sizeof(*cp), &crc, 2);
 
-	rs = rtlmp_send_sync(cp, sizeof(*cp) + 2, &rp, sizeof(rp));
+	rs = rtlmp_send_sync(trans, cp, sizeof(*cp) + 2, &rp, sizeof(rp));
 	free(cp);
 
 	return rs;
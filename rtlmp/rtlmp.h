@@ -10,11 +10,37 @@
 
 #include <stdint.h>
 
-int rtlmp_reset(uint8_t mode);
-int rtlmp_change_baudrate(uint32_t baudrate);
-int rtlmp_erase_flash(uint32_t addr, uint32_t size);
-int rtlmp_write_flash(uint32_t addr, uint32_t size, const void *dat);
-int rtlmp_verify_flash(uint32_t addr, uint32_t size, uint16_t crc16);
+struct transport;
+
+/* Every frame starts with the magic, responses with an 8 byte header */
+#define RTLMP_MAGIC		0x87
+#define RTLMP_RSP_SIZE		8
+
+/* Flash erase unit and the largest payload of one write frame */
+#define RTLMP_ERASE_SIZE	4096
+#define RTLMP_WRITE_SIZE	2048
+
+/* Write frame on the wire: 11 byte header, payload, CRC16 */
+#define RTLMP_WRITE_FRAME_SIZE(size)	(11 + (size) + 2)
+
+int rtlmp_check(struct transport *trans);
+int rtlmp_resync(struct transport *trans, unsigned wait_ms);
+int rtlmp_slowdown(struct transport *trans, unsigned from, unsigned speed);
+int rtlmp_reset(struct transport *trans, uint8_t mode);
+int rtlmp_change_baudrate(struct transport *trans, uint32_t baudrate);
+int rtlmp_probe(struct transport *trans, uint32_t baudrate);
+int rtlmp_erase_flash(struct transport *trans, uint32_t addr, uint32_t size);
+int rtlmp_write_flash(struct transport *trans, uint32_t addr, uint32_t size, const void *dat);
+int rtlmp_verify_flash(struct transport *trans, uint32_t addr, uint32_t size, uint16_t crc16);
+int rtlmp_read_flash(struct transport *trans, uint32_t addr, uint32_t size, void *dat);
+
+/* Serialize a write frame into @frame, so it can be sent later as is */
+uint32_t rtlmp_write_flash_frame(void *frame, uint32_t addr, uint32_t size, const void *dat);
+int rtlmp_write_flash_raw(struct transport *trans, const void *frame, uint32_t len);
+
+/* Split read, so several frames can be in flight */
+int rtlmp_read_flash_request(struct transport *trans, uint32_t addr, uint32_t size);
+int rtlmp_read_flash_response(struct transport *trans, uint32_t size, void *dat);
 
 #endif /* __RTLMP_H__*/
 
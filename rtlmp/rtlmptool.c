@@ -4,39 +4,51 @@
  * SPDX-License-Identifier: 
  */
 
+#include "defs.h"
 #include "crc16.h"
 #include "rtlmp.h"
 #include "rtlbt.h"
+#include "hci.h"
 #include "rtlimg.h"
 #include "rtlmptool.h"
+#include "progress.h"
+#include "journal.h"
+#include "retry.h"
+#include "image.h"
+#include "recipe.h"
 #include "transport.h"
+#include "log.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#if !defined(__WIN32__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#define READ_TIMEOUT		2000
+
+/* Speed the bridge and the chip start at */
+#define BOOT_BAUDRATE		115200
+
+/* Wait for one probe ack, and for the target to answer at all */
+#define PROBE_TIMEOUT		50
+#define HANDSHAKE_TIMEOUT	2000
+/* Most bytes of noise one probe reads through looking for its ack */
+#define PROBE_SKIP_MAX		1024
+/* Wait for a reset chip to answer HCI again, and for one answer */
+#define RESET_TIMEOUT		3000
+#define RESET_PROBE_TIMEOUT	200
 
-#define HCI_COMMAND_PKT     0x01
-#define HCI_ACLDATA_PKT     0x02
-#define HCI_SCODATA_PKT     0x03
-#define HCI_EVENT_PKT       0x04
-#define HCI_DIAG_PKT        0xf0
-#define HCI_VENDOR_PKT      0xff
-
-#define HCI_COMMAND_HDR_SIZE 3
-#define HCI_EVENT_HDR_SIZE   2
-#define HCI_ACL_HDR_SIZE     4
-#define HCI_SCO_HDR_SIZE     3
-
-#define HCI_MAX_ACL_SIZE    1024
-#define HCI_MAX_SCO_SIZE    255
-#define HCI_MAX_COMMAND_SIZE 260
-#define HCI_MAX_EVENT_SIZE   260
-#define HCI_MAX_FRAME_SIZE  (HCI_MAX_ACL_SIZE + 4)
-
-static struct transport *trans;
 int usleep(unsigned int usec);
-static int read_bytes(void *buf, uint16_t size)
+static int read_bytes_timeout(struct transport *trans, void *buf, uint16_t size,
+	unsigned ms)
 {
 	int reqsz;
-	int retry = 3;
+	unsigned long long deadline = transport_now_us() + ms * 1000ULL;
 
 	for (reqsz = 0; reqsz < size; ) {
 		int rz = transport_read(trans, buf + reqsz, size - reqsz);
@@ -45,9 +57,12 @@ static int read_bytes(void *buf, uint16_t size)
 		}
 
 		if (rz == 0) {
-			if (retry-- == 0) {
+			if (transport_now_us() >= deadline) {
+				trans->stats.timeouts++;
+				errno = ETIMEDOUT;
 				return reqsz;
 			}
+			trans->stats.retries++;
 		}
 		reqsz += rz;
 	}
@@ -55,139 +70,377 @@ static int read_bytes(void *buf, uint16_t size)
 	return reqsz;
 }
 
-int hci_read(void *buf, uint16_t size)
+int rtlmp_write(struct transport *trans, const void *mp, uint32_t size)
 {
-	uint8_t ev[256 + 3];
+	uint16_t crc;
+	uint8_t buf[size + 2];
 
-	if (size < 3) {
+	crc = crc16_check((uint8_t *)mp, size, 0);
+	memcpy(buf, mp, size);
+	memcpy(buf + size, &crc, 2);
+
+	if (size + 2 != transport_write(trans, buf, size + 2)) {
 		return -1;
 	}
 
-	do {
-		if (1 != read_bytes(ev, 1)) {
+	return 0;
+}
+
+/* Commands answered with the bare response header */
+static bool rtlmp_short_response(uint16_t command)
+{
+	switch (command) {
+	case 0x1010:
+	case 0x1030:
+	case 0x1032:
+	case 0x1041:
+	case 0x1050:
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Read the @size byte response to @command and its CRC16. The stream is
+ * hunted for the magic byte; a frame that fails its CRC, a whole late
+ * response to another command, or noise is dropped and the hunt goes on
+ * right behind it, so a stray or corrupted byte costs one frame and not
+ * the session. Fails with ETIMEDOUT when nothing usable arrived in time,
+ * with EBADMSG when a corrupted response did, and with EPROTO when only
+ * noise or other commands' responses did.
+ */
+static int rtlmp_recv(struct transport *trans, uint16_t command, void *mp,
+	uint32_t size, unsigned ms)
+{
+	int rz, err = 0;
+	uint8_t buf[size + 2];
+	uint32_t off, have = 0, skipped = 0;
+	uint16_t cmd, crc;
+
+	for (;;) {
+		if (have < size + 2) {
+			rz = read_bytes_timeout(trans, buf + have, size + 2 - have, ms);
+			if (rz < 0) {
+				return -1;
+			}
+
+			have += rz;
+			if (have < size + 2) {
+				/* Most likely cut short by what was dropped before */
+				errno = err ? err : ETIMEDOUT;
+				return -1;
+			}
+		}
+
+		off = 1;
+		if (buf[0] == RTLMP_MAGIC) {
+			cmd = buf[1] | buf[2] << 8;
+			crc = buf[size] | buf[size + 1] << 8;
+
+			if (cmd == command && crc == crc16_check(buf, size, 0)) {
+				if (skipped) {
+					pr_debug("Skipped %u bytes before %04x response\n", skipped, command);
+				}
+				memcpy(mp, buf, size);
+				return 0;
+			}
+
+			trans->stats.frame_errors++;
+			if (cmd == command) {
+				err = EBADMSG;
+			} else if (rtlmp_short_response(cmd) &&
+				(buf[RTLMP_RSP_SIZE] | buf[RTLMP_RSP_SIZE + 1] << 8) ==
+				crc16_check(buf, RTLMP_RSP_SIZE, 0)) {
+				/* Late answer to an earlier try, skip all of it */
+				off = RTLMP_RSP_SIZE + 2;
+				err = err ? err : EPROTO;
+			} else {
+				err = err ? err : EPROTO;
+			}
+		} else {
+			err = err ? err : EPROTO;
+		}
+
+		while (off < have && buf[off] != RTLMP_MAGIC)
+			off++;
+
+		skipped += off;
+		if (skipped > PROBE_SKIP_MAX) {
+			errno = err;
 			return -1;
 		}
-	} while (ev[0] != 0x04);
 
-	if (2 != read_bytes(ev + 1, 2))  {
+		memmove(buf, buf + off, have - off);
+		have -= off;
+	}
+}
+
+int rtlmp_read(struct transport *trans, uint16_t command, void *mp, uint32_t size)
+{
+	return rtlmp_recv(trans, command, mp, size, READ_TIMEOUT);
+}
+
+/* Session cancelled or past its deadline */
+int rtlmp_check(struct transport *trans)
+{
+	return transport_check(trans);
+}
+
+/* Let a late response arrive for @wait_ms, then drop it */
+int rtlmp_resync(struct transport *trans, unsigned wait_ms)
+{
+	usleep(transport_wait_ms(trans, wait_ms) * 1000);
+	if (transport_check(trans)) {
 		return -1;
 	}
 
-	if (ev[2] != read_bytes(ev + 3, ev[2])) {
+	return transport_flush(trans) < 0 ? -1 : 0;
+}
+
+/* @frame already carries its CRC16 */
+int rtlmp_send_frame_sync(struct transport *trans, const void *frame, uint32_t size,
+	void *rsp, uint32_t rsp_size)
+{
+	const uint8_t *cp = frame;
+
+	if (size != transport_write(trans, frame, size)) {
 		return -1;
 	}
 
-	memcpy(buf, ev, size);
+	return rtlmp_read(trans, cp[1] | cp[2] << 8, rsp, rsp_size);
+}
+
+int rtlmp_send_sync(struct transport *trans, const void *mp, uint32_t size,
+	void *rsp, uint32_t rsp_size)
+{
+	const uint8_t *cp = mp;
 
-	return size;
+	if (transport_check(trans) || rtlmp_write(trans, mp, size)) {
+		return -1;
+	}
+
+	return rtlmp_read(trans, cp[1] | cp[2] << 8, rsp, rsp_size);
 }
 
-void hci_send_cmd(uint16_t opcode, const void *params, uint8_t size)
+/*
+ * Send @mp and look for its ack, skipping whatever the target printed
+ * before it (boot output, bytes from before a baud switch). The probe
+ * runs under its own PROBE_TIMEOUT deadline, so backends that wait out
+ * a whole transfer timeout, like the bridges, give up on it in time too.
+ */
+int rtlmp_probe_sync(struct transport *trans, const void *mp, uint32_t size,
+	void *rsp, uint32_t rsp_size)
 {
-	uint8_t hdr[260];
+	int rc;
+	const uint8_t *cp = mp;
+	struct transport_cancel probe, *host = trans->cancel;
 
-	hdr[0] = 0x01;
-	hdr[1] = opcode & 0xff;
-	hdr[2] = (opcode >> 8) & 0xff;
-	hdr[3] = size;
+	transport_cancel_init(&probe, PROBE_TIMEOUT);
+	probe.parent = host;
+	transport_set_cancel(trans, &probe);
 
-	if (params && size) {
-		memcpy(hdr + 4, params, size);
+	rc = rtlmp_write(trans, mp, size);
+	if (rc == 0) {
+		rc = rtlmp_recv(trans, cp[1] | cp[2] << 8, rsp, rsp_size, PROBE_TIMEOUT);
 	}
 
-	if ((4 + size) != transport_write(trans, hdr, 4 + size)) {
-	}
+	transport_set_cancel(trans, host);
+	return rc;
 }
 
-int hci_send_cmd_sync(uint16_t opcode, const void *params, uint8_t size,
-	void *rsp, uint16_t rsp_size)
+/*
+ * Probe until the MP firmware acks at @speed. Returns as soon as the
+ * target is up instead of sleeping or counting its boot output.
+ */
+static int rtlmp_handshake(struct transport *trans, unsigned speed)
 {
-	int sz;
-	uint8_t ev[256 + 3];
-	hci_send_cmd(opcode, params, size);
+	unsigned probes = 0;
+	unsigned long long start = transport_now_us();
 
 	do {
-		sz = hci_read(ev, rsp_size + 6);
-		if (sz < 0) {
+		if (transport_check(trans)) {
 			return -1;
 		}
-		//printf("sz: %d, %02x %02x %02x %02x %02x %02x\n", sz, ev[0], ev[1], ev[2], ev[3], ev[4], ev[5]);
-	} while (ev[0] != 0x04 || ev[1] != 0x0e || opcode != (ev[4] | ev[5] << 8));
 
-	if (rsp && rsp_size) {
-		memcpy(rsp, ev + 6, rsp_size);
-	}
+		probes++;
+		if (rtlmp_probe(trans, speed) == 0) {
+			pr_debug("Handshake at %u: %u probes, %llu us\n",
+				speed, probes, transport_now_us() - start);
 
-	return 0;
+			/* Acks to earlier probes may still be on the way */
+			return probes > 1 ? rtlmp_resync(trans, PROBE_TIMEOUT) : 0;
+		}
+	} while (transport_now_us() - start < HANDSHAKE_TIMEOUT * 1000ULL);
+
+	trans->stats.timeouts++;
+	pr_err("No handshake at %u after %u probes\n", speed, probes);
+	errno = ETIMEDOUT;
+	return -1;
 }
 
-int rtlmp_write(const void *mp, uint32_t size)
+/*
+ * Move both ends of the MP link from @from to @speed. The ack to the
+ * change is not trusted either way: it is lost most often exactly when
+ * errors cluster, and the chip may have switched without it getting
+ * through. So the host follows and handshakes at @speed, and failing
+ * that goes back and handshakes at @from. Returns 0 at @speed, -1 with
+ * the link still up at @from, or -1 with ENOLINK when neither answers.
+ */
+int rtlmp_slowdown(struct transport *trans, unsigned from, unsigned speed)
 {
-	uint16_t crc;
-	uint8_t buf[size + 2];
+	int err;
 
-	crc = crc16_check((uint8_t *)mp, size, 0);
-	memcpy(buf, mp, size);
-	memcpy(buf + size, &crc, 2);
+	if (rtlmp_change_baudrate(trans, speed) && transport_check(trans)) {
+		return -1;
+	}
 
-	transport_write(trans, buf, size + 2);
-	return 0;
+	if (!transport_set_baudrate(trans, speed) && !rtlmp_handshake(trans, speed)) {
+		return 0;
+	}
+	err = errno;
+
+	if (transport_check(trans)) {
+		return -1;
+	}
+
+	pr_warn("No answer at %u, back to %u\n", speed, from);
+	if (!transport_set_baudrate(trans, from) && !rtlmp_handshake(trans, from)) {
+		errno = err;
+		return -1;
+	}
+
+	if (!transport_check(trans)) {
+		pr_err("Link lost, no answer at %u or %u\n", speed, from);
+		errno = ENOLINK;
+	}
+	return -1;
 }
 
-int rtlmp_read(void *mp, uint32_t size)
+/* Download the HCI patch and switch the chip to MP mode at @speed */
+static int rtlmptool_enter_mp(struct hci *hci, FILE *fpw, int speed,
+	struct progress *progress, struct retry *retry)
 {
-	uint16_t crc;
-	uint8_t buf[size + 2];
+	int rc;
+	unsigned attempt, done;
+	struct transport *trans = hci->trans;
 
-	read_bytes(buf, size + 2);
-	memcpy(mp, buf, size);
+	progress_stage(progress, RTLMPTOOL_STAGE_PATCH);
+	done = progress->info.done;
 
-	crc = buf[size] | (buf[size + 1] << 8);
+	/* A fragment can't be sent again, a failed patch starts over from a reset ROM */
+	for (attempt = 0;; attempt++) {
+		rc = rtlbt_setup(hci, (uint8_t[]){0x20, 0xa8, 0x02, 0x00, 0x40,
+			0x04, 0x02, 0x00, 0x01});
+		if (rc == 0) {
+			rc = rtlbt_fw_download(hci, fpw, progress);
+		}
 
-	return crc == crc16_check(mp, size, 0);
-}
+		if (rc == 0 || !retry_again(retry, attempt, "Patch", 0)) {
+			break;
+		}
 
-int rtlmp_send_sync(const void *mp, uint32_t size, void *rsp, uint32_t rsp_size)
-{
-	rtlmp_write(mp, size);
-	return rtlmp_read(rsp, rsp_size) ? 0 : -1;
-}
+		/* The input was flushed under any half read event */
+		hci_init(hci, trans);
+		if (rtlbt_reset(hci)) {
+			pr_err("HCI reset failure: %s\n", strerror(errno));
+			return -1;
+		}
+		progress_rewind(progress, done);
+	}
 
-static int rtlmp_read_x00(void)
-{
-	int rc;
-	uint8_t buf[70];
-	rc = read_bytes(buf, sizeof(buf));
-	if (rc != sizeof(buf)) {
-		printf( "> %d\n", rc);
-		errno = EIO;
+	if (rc != 0) {
+		return rc;
+	}
+
+	rtlbt_vendor_cmd62(hci, (uint8_t[]){0x20, 0x34, 0x12, 0x20, 0x00,
+		0x31, 0x38, 0x20, 0x00});
+
+	/* The MP firmware boots and answers at the boot speed first */
+	rc = rtlmp_handshake(trans, BOOT_BAUDRATE);
+	if (rc != 0) {
+		return rc;
+	}
+
+	rc = rtlmp_change_baudrate(trans, speed);
+	if (rc != 0) {
+		return rc;
+	}
+
+	if (transport_set_baudrate(trans, speed)) {
 		return -1;
 	}
 
+	rc = rtlmp_handshake(trans, speed);
+	if (rc != 0) {
+		return rc;
+	}
+	retry_set_speed(retry, speed);
+
 	return 0;
 }
 
-void rtlmptoo_set_tranport(void *trns)
+
+enum {
+	SESSION_JOB_NONE,
+	SESSION_JOB_DOWNLOAD,
+	SESSION_JOB_DUMP,
+	SESSION_JOB_RECIPE,
+};
+
+struct rtlmptool_session {
+	struct transport *trans;
+	struct transport_cancel cancel;
+	int speed;
+	int verify;
+	unsigned timeout;	/* ms, 0 = none */
+	char *journal_dir, *journal_device;
+	rtlmptool_progress_cb cb;
+	void *arg;
+
+	int job;
+	char *fw, *mp, *out, *cmp;
+	char *base;		/* image the device holds, for a delta download */
+	const struct rtlmptool_patch *patch;
+	struct rtlmptool_image *fw_img, *mp_img;
+	uint32_t addr, size;
+	struct rtlmptool_recipe *recipe;
+
+	/* Shared with the worker thread of rtlmptool_session_start() */
+	pthread_mutex_t lock;
+	pthread_t thread;
+	bool joinable;
+	int state;
+	int rc, err;
+	bool progress_pending;
+	struct rtlmptool_progress progress;
+	int notify[2];
+};
+
+/* The cached image if there is one, the file otherwise */
+static FILE *session_open(const char *path, struct rtlmptool_image *img)
 {
-	trans = trns;
+	return img ? image_open(img) : fopen(path, "rb");
 }
 
-int rtlmptool_download_firmware(void *trns, int speed,
-	const char *fw, const char *mp, int *progress)
+static int session_download(struct rtlmptool_session *s, rtlmptool_progress_cb cb, void *arg)
 {
 	int rc, fw_size = 0, mp_size = 0;
-	FILE *fpw, *fpm;
+	FILE *fpw, *fpm, *fpo = NULL;
+	struct progress progress;
+	struct retry retry;
+	struct journal journal, *jp = NULL;
+	struct transport *trans = s->trans;
+	struct hci hci;
 
-	trans = trns;
-
-	fpw = fopen(fw, "rb");
+	fpw = session_open(s->fw, s->fw_img);
 	if (fpw == NULL) {
 		return -1;
 	}
 
 	fw_size = rtlbt_cacl_download_size(fpw);
 
-	fpm = fopen(mp, "rb");
+	fpm = session_open(s->mp, s->mp_img);
 	if (fpm == NULL) {
 		fclose(fpw);
 		return -1;
@@ -195,43 +448,862 @@ int rtlmptool_download_firmware(void *trns, int speed,
 
 	mp_size = rtlimg_calc_download_size(fpm);
 	if (mp_size < 0) {
+		fclose(fpm);
 		fclose(fpw);
 		return -1;
 	}
 
-	rtlbt_read_chip_type();
-	rtlbt_vendor_cmd62((uint8_t[]){0x20, 0xa8, 0x02, 0x00, 0x40,
-		0x04, 0x02, 0x00, 0x01});
+	if (s->base) {
+		fpo = fopen(s->base, "rb");
+		if (fpo == NULL) {
+			fclose(fpm);
+			fclose(fpw);
+			return -1;
+		}
+	}
 
-	rc = rtlbt_fw_download(fpw, fw_size + mp_size, 0, progress);
+	progress_init(&progress, fw_size + mp_size, cb, arg);
+	retry_init(&retry, trans);
+	hci_init(&hci, trans);
+	rc = rtlmptool_enter_mp(&hci, fpw, s->speed, &progress, &retry);
 	if (rc != 0) {
 		goto _quit;
 	}
 
-	rtlbt_vendor_cmd62((uint8_t[]){0x20, 0x34, 0x12, 0x20, 0x00,
-		0x31, 0x38, 0x20, 0x00});
+	/* A delta skips whole units, the journal's verified prefix doesn't apply */
+	if (fpo == NULL && s->journal_dir && s->journal_device &&
+		!journal_open(&journal, s->journal_dir, s->journal_device, fpm)) {
+		jp = &journal;
+	}
 
-	rc = rtlmp_read_x00();
+	progress_stage(&progress, RTLMPTOOL_STAGE_FLASH);
+	if (fpo) {
+		rc = rtlimg_download_delta(trans, fpo, fpm, s->patch, &progress, &retry);
+	} else {
+		rc = rtlimg_download(trans, fpm, s->mp_img ? s->mp_img->plan : NULL,
+			s->patch, s->verify, jp, &progress, &retry);
+	}
+	if (jp) {
+		journal_close(jp, rc == 0);
+	}
 	if (rc != 0) {
 		goto _quit;
 	}
+	rtlmp_reset(trans, 0x01);
+	progress_stage(&progress, RTLMPTOOL_STAGE_DONE);
 
-	rc = rtlmp_change_baudrate(speed);
-	if (rc != 0) {
-		goto _quit;
+_quit:
+	retry_report(&retry);
+	if (fpo) {
+		fclose(fpo);
+	}
+	fclose(fpm);
+	fclose(fpw);
+	return rc;
+}
+
+
+#if defined(__WIN32__)
+static uint8_t *dump_map(const char *out, uint32_t size)
+{
+	return malloc(size);
+}
+
+static int dump_unmap(const char *out, uint8_t *dat, uint32_t size, int rc)
+{
+	FILE *fp;
+
+	if (rc == 0) {
+		fp = fopen(out, "wb");
+		if (fp == NULL || size != fwrite(dat, 1, size, fp)) {
+			rc = -1;
+		}
+		if (fp && fclose(fp)) {
+			rc = -1;
+		}
 	}
 
-	transport_set_baudrate(trans, speed);
-	usleep(10000);
-	rc = rtlimg_download(fpm, fw_size + mp_size, fw_size, progress);
-	if (rc != 0) {
+	free(dat);
+	return rc;
+}
+#else
+/* Frames are read straight into the mapped output file */
+static uint8_t *dump_map(const char *out, uint32_t size)
+{
+	int fd;
+	void *dat;
+
+	fd = open(out, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	if (ftruncate(fd, size)) {
+		close(fd);
+		return NULL;
+	}
+
+	dat = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	return dat == MAP_FAILED ? NULL : dat;
+}
+
+static int dump_unmap(const char *out, uint8_t *dat, uint32_t size, int rc)
+{
+	if (msync(dat, size, MS_SYNC)) {
+		rc = -1;
+	}
+	munmap(dat, size);
+
+	return rc;
+}
+#endif
+
+static int session_dump(struct rtlmptool_session *s, rtlmptool_progress_cb cb, void *arg)
+{
+	int rc, diffs;
+	FILE *fpw, *fpc = NULL;
+	uint8_t *dat;
+	struct progress progress;
+	struct retry retry;
+	struct transport *trans = s->trans;
+	struct hci hci;
+
+	fpw = fopen(s->fw, "rb");
+	if (fpw == NULL) {
+		return -1;
+	}
+
+	if (s->cmp) {
+		fpc = fopen(s->cmp, "rb");
+		if (fpc == NULL) {
+			fclose(fpw);
+			return -1;
+		}
+	}
+
+	dat = dump_map(s->out, s->size);
+	if (dat == NULL) {
+		rc = -1;
 		goto _quit;
 	}
-	rtlmp_reset(0x01);
+
+	progress_init(&progress, rtlbt_cacl_download_size(fpw) + s->size, cb, arg);
+	retry_init(&retry, trans);
+	hci_init(&hci, trans);
+	rc = rtlmptool_enter_mp(&hci, fpw, s->speed, &progress, &retry);
+	if (rc == 0) {
+		progress_stage(&progress, RTLMPTOOL_STAGE_READBACK);
+		rc = rtlimg_readback(trans, s->addr, s->size, dat, &progress, &retry);
+		retry_report(&retry);
+	}
+
+	if (rc == 0 && fpc) {
+		diffs = rtlimg_compare(fpc, s->addr, dat, s->size);
+		if (diffs < 0) {
+			rc = -1;
+		} else {
+			pr_info("Compare %s: %d differing ranges\n", s->cmp, diffs);
+			rc = diffs ? 1 : 0;
+		}
+	}
+
+	if (rc >= 0) {
+		rtlmp_reset(trans, 0x01);
+		progress_stage(&progress, RTLMPTOOL_STAGE_DONE);
+	}
+
+	rc = dump_unmap(s->out, dat, s->size, rc);
 
 _quit:
-	fclose(fpm);
+	if (fpc) {
+		fclose(fpc);
+	}
 	fclose(fpw);
 	return rc;
 }
 
+/* Sleep until transport_now_us() reaches @end, a cancel or the deadline cuts it short */
+static int session_sleep_until(struct transport *trans, unsigned long long end)
+{
+	unsigned long long now;
+
+	while ((now = transport_now_us()) < end) {
+		if (transport_check(trans)) {
+			return -1;
+		}
+
+		usleep(transport_wait_ms(trans, MIN((end - now + 999) / 1000, PROBE_TIMEOUT)) * 1000);
+	}
+
+	return transport_check(trans);
+}
+
+static int recipe_chip(struct hci *hci, struct recipe_step *step)
+{
+	int rc;
+	uint32_t type;
+
+	rc = rtlbt_read_chip_type(hci, &type);
+	if (rc < 0) {
+		return -1;
+	}
+
+	if (rc != 0) {
+		pr_err("Read chip type: status %d\n", rc);
+		errno = EIO;
+		return -1;
+	}
+
+	pr_info("Chip type: %08x\n", type);
+	if ((type & step->mask) != step->value) {
+		pr_err("Chip type %08x, expected %08x/%08x\n", type, step->value, step->mask);
+		errno = ENODEV;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Each channel is held for the dwell from the moment its ack came back,
+ * and marked with wall clock times an instrument can line up with.
+ */
+static int recipe_tone(struct hci *hci, struct recipe_step *step)
+{
+	struct transport *trans = hci->trans;
+	int i, rc;
+	unsigned long long sent, acked;
+	struct rtlmptool_tone_mark *mark = NULL;
+
+	step->nmarks = 0;
+	for (i = 0; i < step->nchannels; i++) {
+		sent = transport_now_us();
+		rc = rtlbt_single_tone(hci, step->channels[i]);
+		acked = transport_now_us();
+		if (mark) {
+			mark->off_us = transport_wall_us(sent);
+		}
+		if (rc < 0) {
+			return -1;
+		}
+
+		/* The vendor command answers 1 once the tone is on */
+		if (rc != 1) {
+			pr_err("Single tone, channel %u: status %d\n", step->channels[i], rc);
+			errno = EIO;
+			return -1;
+		}
+
+		mark = &step->marks[step->nmarks++];
+		mark->channel = step->channels[i];
+		mark->on_us = transport_wall_us(acked);
+		mark->latency_us = acked - sent;
+		mark->off_us = 0;
+		pr_info("Tone: channel %u on at %llu.%06llu, +%u us\n", mark->channel,
+			mark->on_us / 1000000, mark->on_us % 1000000, mark->latency_us);
+
+		if (session_sleep_until(trans, acked + step->dwell * 1000ULL)) {
+			mark->off_us = transport_wall_us(transport_now_us());
+			return -1;
+		}
+	}
+
+	/* The last tone stays on until the chip is reset or closed */
+	if (mark) {
+		mark->off_us = transport_wall_us(transport_now_us());
+	}
+
+	return 0;
+}
+
+/*
+ * Read the chip type until the reset chip answers from ROM. Each try has
+ * its own RESET_PROBE_TIMEOUT deadline, so a chip still booting costs a
+ * short probe instead of a whole HCI_CMD_TIMEOUT.
+ */
+static int recipe_reset_wait(struct hci *hci)
+{
+	int rc;
+	unsigned probes = 0;
+	struct transport *trans = hci->trans;
+	struct transport_cancel probe, *host = trans->cancel;
+	unsigned long long start = transport_now_us();
+
+	do {
+		if (transport_check(trans)) {
+			return -1;
+		}
+
+		/* Drop what a failed try left behind, bytes and credits alike */
+		hci_init(hci, trans);
+		transport_cancel_init(&probe, RESET_PROBE_TIMEOUT);
+		probe.parent = host;
+		transport_set_cancel(trans, &probe);
+
+		probes++;
+		rc = rtlbt_read_chip_type(hci, NULL);
+		transport_set_cancel(trans, host);
+		if (rc == 0) {
+			pr_debug("HCI after reset: %u probes, %llu us\n",
+				probes, transport_now_us() - start);
+			return 0;
+		}
+	} while (transport_now_us() - start < RESET_TIMEOUT * 1000ULL);
+
+	trans->stats.timeouts++;
+	pr_err("No HCI after reset, %u probes\n", probes);
+	errno = ETIMEDOUT;
+	return -1;
+}
+
+static int recipe_step(struct rtlmptool_session *s, struct hci *hci,
+	struct recipe_step *step, struct progress *progress, struct retry *retry)
+{
+	int rc;
+	FILE *fp = NULL;
+	struct journal journal, *jp = NULL;
+	struct transport *trans = s->trans;
+
+	if (step->img) {
+		fp = image_open(step->img);
+		if (fp == NULL) {
+			return -1;
+		}
+	}
+
+	switch (step->type) {
+	case RTLMPTOOL_STEP_CHIP:
+		rc = recipe_chip(hci, step);
+	break;
+
+	case RTLMPTOOL_STEP_PATCH:
+		rc = rtlmptool_enter_mp(hci, fp, s->speed, progress, retry);
+	break;
+
+	case RTLMPTOOL_STEP_FLASH:
+		if (s->journal_dir && s->journal_device &&
+			!journal_open(&journal, s->journal_dir, s->journal_device, fp)) {
+			jp = &journal;
+		}
+
+		progress_stage(progress, RTLMPTOOL_STAGE_FLASH);
+		rc = rtlimg_download(trans, fp, step->img->plan, s->patch,
+			step->verify, jp, progress, retry);
+		if (jp) {
+			journal_close(jp, rc == 0);
+		}
+	break;
+
+	case RTLMPTOOL_STEP_VERIFY:
+		rc = rtlimg_verify(trans, fp, s->patch);
+	break;
+
+	case RTLMPTOOL_STEP_RESET:
+		/* The chip reboots into HCI at the boot speed */
+		rc = rtlmp_reset(trans, 0x01);
+		if (rc == 0) {
+			retry_set_speed(retry, 0);
+			rc = transport_set_baudrate(trans, BOOT_BAUDRATE);
+		}
+		if (rc == 0) {
+			rc = recipe_reset_wait(hci);
+		}
+	break;
+
+	case RTLMPTOOL_STEP_TONE:
+		rc = recipe_tone(hci, step);
+	break;
+
+	default:
+		errno = EINVAL;
+		rc = -1;
+	break;
+	}
+
+	if (fp) {
+		fclose(fp);
+	}
+
+	return rc;
+}
+
+static int session_recipe(struct rtlmptool_session *s, rtlmptool_progress_cb cb, void *arg)
+{
+	int i, rc = 0, total = 0;
+	unsigned long long start;
+	struct progress progress;
+	struct retry retry;
+	struct hci hci;
+	struct rtlmptool_recipe *r = s->recipe;
+
+	for (i = 0; i < r->nsteps; i++) {
+		memset(&r->step[i].result, 0, sizeof(struct rtlmptool_step_result));
+		r->step[i].result.type = r->step[i].type;
+
+		if (r->step[i].type == RTLMPTOOL_STEP_FLASH || r->step[i].type == RTLMPTOOL_STEP_PATCH)
+			total += rtlmptool_image_size(r->step[i].img);
+	}
+
+	progress_init(&progress, total, cb, arg);
+	retry_init(&retry, s->trans);
+	/* One HCI context for all steps, unsolicited events carry over */
+	hci_init(&hci, s->trans);
+
+	for (i = 0; i < r->nsteps && rc == 0; i++) {
+		struct rtlmptool_step_result *res = &r->step[i].result;
+
+		start = transport_now_us();
+		rc = recipe_step(s, &hci, &r->step[i], &progress, &retry);
+		res->run = 1;
+		res->rc = rc;
+		res->err = rc ? errno : 0;
+		res->us = transport_now_us() - start;
+
+		pr_info("Step %d %s: %s, %llu ms\n", i, recipe_step_name(res->type),
+			rc ? strerror(res->err) : "PASS", res->us / 1000);
+		errno = res->err;
+	}
+
+	retry_report(&retry);
+	if (rc == 0) {
+		progress_stage(&progress, RTLMPTOOL_STAGE_DONE);
+	}
+
+	return rc;
+}
+
+/*
+ * Run the configured job on the calling thread. The session token is
+ * chained in front of whatever token the host attached to the transport.
+ */
+static int session_exec(struct rtlmptool_session *s, rtlmptool_progress_cb cb, void *arg)
+{
+	int rc, err;
+	struct transport_cancel *host = s->trans->cancel;
+
+	s->cancel.deadline = s->timeout ? transport_now_us() + s->timeout * 1000ULL : 0;
+	s->cancel.parent = host;
+	transport_set_cancel(s->trans, &s->cancel);
+
+	switch (s->job) {
+	case SESSION_JOB_DOWNLOAD:
+		rc = session_download(s, cb, arg);
+	break;
+
+	case SESSION_JOB_DUMP:
+		rc = session_dump(s, cb, arg);
+	break;
+
+	case SESSION_JOB_RECIPE:
+		rc = session_recipe(s, cb, arg);
+	break;
+
+	default:
+		errno = EINVAL;
+		rc = -1;
+	break;
+	}
+
+	err = errno;
+	transport_set_cancel(s->trans, host);
+	errno = err;
+
+	return rc;
+}
+
+static void session_notify(struct rtlmptool_session *s)
+{
+#if !defined(__WIN32__)
+	if (write(s->notify[1], "", 1) < 0) {
+		/* Already readable, the pipe is full */
+	}
+#endif
+}
+
+/* Worker side progress, handed to the host at its next step */
+static void session_progress(const struct rtlmptool_progress *p, void *arg)
+{
+	struct rtlmptool_session *s = arg;
+
+	pthread_mutex_lock(&s->lock);
+	s->progress = *p;
+	if (!s->progress_pending) {
+		s->progress_pending = true;
+		session_notify(s);
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void *session_thread(void *arg)
+{
+	int rc, err;
+	struct rtlmptool_session *s = arg;
+
+	rc = session_exec(s, session_progress, s);
+	err = errno;
+
+	pthread_mutex_lock(&s->lock);
+	s->rc = rc;
+	s->err = err;
+	s->state = rc < 0 ? RTLMPTOOL_STATE_FAILED : RTLMPTOOL_STATE_DONE;
+	session_notify(s);
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+static char *session_strdup(const char *str)
+{
+	return str ? strdup(str) : NULL;
+}
+
+struct rtlmptool_session *rtlmptool_session_create(void *trns)
+{
+	struct rtlmptool_session *s;
+
+	s = calloc(1, sizeof(struct rtlmptool_session));
+	if (s == NULL) {
+		return NULL;
+	}
+
+	s->notify[0] = s->notify[1] = -1;
+#if !defined(__WIN32__)
+	if (pipe(s->notify)) {
+		free(s);
+		return NULL;
+	}
+	fcntl(s->notify[0], F_SETFL, O_NONBLOCK);
+	fcntl(s->notify[1], F_SETFL, O_NONBLOCK);
+	fcntl(s->notify[0], F_SETFD, FD_CLOEXEC);
+	fcntl(s->notify[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+	s->trans = trns;
+	s->speed = 115200;
+	s->verify = RTLMPTOOL_VERIFY_CHUNK;
+	s->state = RTLMPTOOL_STATE_IDLE;
+	transport_cancel_init(&s->cancel, 0);
+	pthread_mutex_init(&s->lock, NULL);
+
+	return s;
+}
+
+void rtlmptool_session_destroy(struct rtlmptool_session *s)
+{
+	if (s->joinable) {
+		transport_cancel(&s->cancel);
+		pthread_join(s->thread, NULL);
+	}
+
+#if !defined(__WIN32__)
+	close(s->notify[0]);
+	close(s->notify[1]);
+#endif
+	pthread_mutex_destroy(&s->lock);
+	free(s->journal_dir);
+	free(s->journal_device);
+	free(s->fw);
+	free(s->mp);
+	free(s->base);
+	free(s->out);
+	free(s->cmp);
+	rtlmptool_image_put(s->fw_img);
+	rtlmptool_image_put(s->mp_img);
+	free(s);
+}
+
+static int session_busy(struct rtlmptool_session *s)
+{
+	int state;
+
+	pthread_mutex_lock(&s->lock);
+	state = s->state;
+	pthread_mutex_unlock(&s->lock);
+
+	if (state == RTLMPTOOL_STATE_RUNNING) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	return 0;
+}
+
+void rtlmptool_session_set_speed(struct rtlmptool_session *s, int speed)
+{
+	s->speed = speed;
+}
+
+void rtlmptool_session_set_verify(struct rtlmptool_session *s, int verify)
+{
+	s->verify = verify;
+}
+
+void rtlmptool_session_set_timeout(struct rtlmptool_session *s, unsigned ms)
+{
+	s->timeout = ms;
+}
+
+void rtlmptool_session_set_progress(struct rtlmptool_session *s,
+	rtlmptool_progress_cb cb, void *arg)
+{
+	s->cb = cb;
+	s->arg = arg;
+}
+
+int rtlmptool_session_set_journal(struct rtlmptool_session *s,
+	const char *dir, const char *device)
+{
+	if (session_busy(s)) {
+		return -1;
+	}
+
+	free(s->journal_dir);
+	free(s->journal_device);
+	s->journal_dir = session_strdup(dir);
+	s->journal_device = session_strdup(device);
+
+	return 0;
+}
+
+int rtlmptool_session_set_base(struct rtlmptool_session *s, const char *old)
+{
+	if (session_busy(s)) {
+		return -1;
+	}
+
+	free(s->base);
+	s->base = session_strdup(old);
+
+	return 0;
+}
+
+int rtlmptool_session_set_patch(struct rtlmptool_session *s,
+	const struct rtlmptool_patch *p)
+{
+	if (session_busy(s)) {
+		return -1;
+	}
+
+	s->patch = p;
+
+	return 0;
+}
+
+int rtlmptool_session_download(struct rtlmptool_session *s,
+	const char *fw, const char *mp)
+{
+	if (session_busy(s)) {
+		return -1;
+	}
+
+	free(s->fw);
+	free(s->mp);
+	rtlmptool_image_put(s->fw_img);
+	rtlmptool_image_put(s->mp_img);
+	s->fw_img = s->mp_img = NULL;
+	s->fw = session_strdup(fw);
+	s->mp = session_strdup(mp);
+	s->job = SESSION_JOB_DOWNLOAD;
+
+	return 0;
+}
+
+int rtlmptool_session_download_image(struct rtlmptool_session *s,
+	struct rtlmptool_image *fw, struct rtlmptool_image *mp)
+{
+	if (session_busy(s)) {
+		return -1;
+	}
+
+	rtlmptool_image_put(s->fw_img);
+	rtlmptool_image_put(s->mp_img);
+	s->fw_img = rtlmptool_image_get(fw);
+	s->mp_img = rtlmptool_image_get(mp);
+	s->job = SESSION_JOB_DOWNLOAD;
+
+	return 0;
+}
+
+int rtlmptool_session_dump(struct rtlmptool_session *s, const char *fw,
+	uint32_t addr, uint32_t size, const char *out, const char *cmp)
+{
+	if (session_busy(s)) {
+		return -1;
+	}
+
+	free(s->fw);
+	free(s->out);
+	free(s->cmp);
+	s->fw = session_strdup(fw);
+	s->out = session_strdup(out);
+	s->cmp = session_strdup(cmp);
+	s->addr = addr;
+	s->size = size;
+	s->job = SESSION_JOB_DUMP;
+
+	return 0;
+}
+
+int rtlmptool_session_recipe(struct rtlmptool_session *s,
+	struct rtlmptool_recipe *r)
+{
+	if (session_busy(s) || recipe_check(r)) {
+		return -1;
+	}
+
+	s->recipe = r;
+	s->job = SESSION_JOB_RECIPE;
+
+	return 0;
+}
+
+int rtlmptool_session_run(struct rtlmptool_session *s)
+{
+	int rc;
+
+	if (session_busy(s)) {
+		return -1;
+	}
+
+	s->state = RTLMPTOOL_STATE_RUNNING;
+	rc = session_exec(s, s->cb, s->arg);
+	s->rc = rc;
+	s->err = errno;
+	s->state = rc < 0 ? RTLMPTOOL_STATE_FAILED : RTLMPTOOL_STATE_DONE;
+
+	return rc;
+}
+
+int rtlmptool_session_start(struct rtlmptool_session *s)
+{
+	int rc;
+
+	if (session_busy(s)) {
+		return -1;
+	}
+
+	if (s->joinable) {
+		pthread_join(s->thread, NULL);
+		s->joinable = false;
+	}
+
+	s->state = RTLMPTOOL_STATE_RUNNING;
+	s->progress_pending = false;
+	rc = pthread_create(&s->thread, NULL, session_thread, s);
+	if (rc != 0) {
+		s->state = RTLMPTOOL_STATE_IDLE;
+		errno = rc;
+		return -1;
+	}
+	s->joinable = true;
+
+	return 0;
+}
+
+int rtlmptool_session_fd(struct rtlmptool_session *s)
+{
+	return s->notify[0];
+}
+
+int rtlmptool_session_step(struct rtlmptool_session *s)
+{
+	int state;
+	bool pending;
+	struct rtlmptool_progress p;
+#if !defined(__WIN32__)
+	char buf[64];
+
+	while (read(s->notify[0], buf, sizeof(buf)) > 0)
+		;
+#endif
+
+	pthread_mutex_lock(&s->lock);
+	state = s->state;
+	pending = s->progress_pending;
+	p = s->progress;
+	s->progress_pending = false;
+	pthread_mutex_unlock(&s->lock);
+
+	if (pending && s->cb) {
+		s->cb(&p, s->arg);
+	}
+
+	if (state != RTLMPTOOL_STATE_RUNNING && s->joinable) {
+		pthread_join(s->thread, NULL);
+		s->joinable = false;
+	}
+
+	return state;
+}
+
+int rtlmptool_session_result(struct rtlmptool_session *s)
+{
+	errno = s->err;
+	return s->rc;
+}
+
+void rtlmptool_session_cancel(struct rtlmptool_session *s)
+{
+	transport_cancel(&s->cancel);
+}
+
+int rtlmptool_download_firmware(void *trns, int speed,
+	const char *fw, const char *mp, rtlmptool_progress_cb cb, void *arg)
+{
+	int rc, err;
+	struct rtlmptool_session *s;
+
+	s = rtlmptool_session_create(trns);
+	if (s == NULL) {
+		return -1;
+	}
+
+	rtlmptool_session_set_speed(s, speed);
+	rtlmptool_session_set_progress(s, cb, arg);
+	rc = rtlmptool_session_download(s, fw, mp);
+	if (rc == 0) {
+		rc = rtlmptool_session_run(s);
+	}
+
+	err = errno;
+	rtlmptool_session_destroy(s);
+	errno = err;
+
+	return rc;
+}
+
+int rtlmptool_dump_flash(void *trns, int speed, const char *fw,
+	uint32_t addr, uint32_t size, const char *out, const char *cmp,
+	rtlmptool_progress_cb cb, void *arg)
+{
+	int rc, err;
+	struct rtlmptool_session *s;
+
+	s = rtlmptool_session_create(trns);
+	if (s == NULL) {
+		return -1;
+	}
+
+	rtlmptool_session_set_speed(s, speed);
+	rtlmptool_session_set_progress(s, cb, arg);
+	rc = rtlmptool_session_dump(s, fw, addr, size, out, cmp);
+	if (rc == 0) {
+		rc = rtlmptool_session_run(s);
+	}
+
+	err = errno;
+	rtlmptool_session_destroy(s);
+	errno = err;
+
+	return rc;
+}
+
+int rtlmptool_single_tone(void *trns, unsigned char channel)
+{
+	struct hci hci;
+
+	hci_init(&hci, trns);
+	return rtlbt_single_tone(&hci, channel);
+}
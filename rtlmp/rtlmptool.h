@@ -8,13 +8,259 @@
 #ifndef __RTLMPTOOL_H__
 #define __RTLMPTOOL_H__
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-extern void rtlmptoo_set_tranport(void *trns);
+enum rtlmptool_stage {
+	RTLMPTOOL_STAGE_PATCH,
+	RTLMPTOOL_STAGE_FLASH,
+	RTLMPTOOL_STAGE_READBACK,
+	RTLMPTOOL_STAGE_DONE,
+};
+
+struct rtlmptool_progress {
+	int stage;
+	unsigned done, total;	/* bytes */
+	double throughput;		/* bytes per second */
+};
+
+enum rtlmptool_verify {
+	RTLMPTOOL_VERIFY_CHUNK,		/* after every erase unit */
+	RTLMPTOOL_VERIFY_IMAGE,		/* once per sub-image */
+	RTLMPTOOL_VERIFY_END,		/* all sub-images after the last write */
+};
+
+enum rtlmptool_state {
+	RTLMPTOOL_STATE_IDLE,
+	RTLMPTOOL_STATE_RUNNING,
+	RTLMPTOOL_STATE_DONE,
+	RTLMPTOOL_STATE_FAILED,
+};
+
+/*
+ * Called from the thread that runs the session: the caller of
+ * rtlmptool_session_run(), or of rtlmptool_session_step() for started
+ * sessions. It must not block.
+ */
+typedef void (*rtlmptool_progress_cb)(const struct rtlmptool_progress *progress, void *arg);
+
+enum rtlmptool_image_type {
+	RTLMPTOOL_IMAGE_PATCH,		/* HCI patch, firmware0.bin */
+	RTLMPTOOL_IMAGE_MP,			/* merged flash image, app.bin */
+};
+
+/*
+ * An image file loaded once into memory and shared by reference, so
+ * sessions started before a reload keep flashing the bytes they began
+ * with. MP images are checked when loaded.
+ */
+struct rtlmptool_image;
+
+extern struct rtlmptool_image *rtlmptool_image_load(const char *path, int type);
+extern struct rtlmptool_image *rtlmptool_image_get(struct rtlmptool_image *img);
+extern void rtlmptool_image_put(struct rtlmptool_image *img);
+extern unsigned rtlmptool_image_size(struct rtlmptool_image *img);
+
+enum rtlmptool_step_type {
+	RTLMPTOOL_STEP_CHIP,		/* read the chip type and check it */
+	RTLMPTOOL_STEP_PATCH,		/* download the HCI patch and enter MP mode */
+	RTLMPTOOL_STEP_FLASH,		/* write an MP image */
+	RTLMPTOOL_STEP_VERIFY,		/* compare an MP image with the flash, no writes */
+	RTLMPTOOL_STEP_RESET,		/* leave MP mode, passes once the ROM answers HCI */
+	RTLMPTOOL_STEP_TONE,		/* single tone on each channel in turn */
+};
+
+struct rtlmptool_step_result {
+	int type;
+	int run;		/* 0 when an earlier step failed */
+	int rc, err;
+	unsigned long long us;
+};
+
+/* One channel of a tone step, wall clock times in us since the epoch */
+struct rtlmptool_tone_mark {
+	unsigned char channel;
+	unsigned long long on_us;	/* the chip acked the tone */
+	unsigned latency_us;		/* from the command to the ack, the tone came on within it */
+	unsigned long long off_us;	/* retuned, or the step ended */
+};
+
+/*
+ * An ordered list of steps run over one transport in one session, so a
+ * device is opened and patched once for flashing and RF tests alike.
+ * HCI steps (chip, tone) must come before the patch or after a reset,
+ * MP steps (flash, verify, reset) after the patch. The first failing
+ * step ends the run.
+ */
+struct rtlmptool_recipe;
+
+extern struct rtlmptool_recipe *rtlmptool_recipe_create(void);
+extern void rtlmptool_recipe_destroy(struct rtlmptool_recipe *r);
+/* Fails with ENODEV unless (type & @mask) == @value */
+extern int rtlmptool_recipe_add_chip(struct rtlmptool_recipe *r, uint32_t value, uint32_t mask);
+extern int rtlmptool_recipe_add_patch(struct rtlmptool_recipe *r, struct rtlmptool_image *fw);
+extern int rtlmptool_recipe_add_flash(struct rtlmptool_recipe *r, struct rtlmptool_image *mp, int verify);
+extern int rtlmptool_recipe_add_verify(struct rtlmptool_recipe *r, struct rtlmptool_image *mp);
+extern int rtlmptool_recipe_add_reset(struct rtlmptool_recipe *r);
+/* Hold a tone for @dwell_ms on each of @channels */
+extern int rtlmptool_recipe_add_tone(struct rtlmptool_recipe *r,
+		const unsigned char *channels, unsigned n, unsigned dwell_ms);
+extern unsigned rtlmptool_recipe_steps(struct rtlmptool_recipe *r);
+/* Channel marks of tone step @i from the last run, @n of them */
+extern const struct rtlmptool_tone_mark *rtlmptool_recipe_tones(
+		struct rtlmptool_recipe *r, unsigned i, unsigned *n);
+/* Outcome of step @i of the last run */
+extern const struct rtlmptool_step_result *rtlmptool_recipe_result(
+		struct rtlmptool_recipe *r, unsigned i);
+
+/*
+ * Per device fields, such as a BD address or a serial number, overlaid
+ * on a shared MP image as it is flashed. The image is never copied, and
+ * only the CRC16s of the erase units a field lands in are recomputed.
+ */
+struct rtlmptool_patch;
+
+extern struct rtlmptool_patch *rtlmptool_patch_create(void);
+extern void rtlmptool_patch_destroy(struct rtlmptool_patch *p);
+/* @size bytes of @value at @offset in the sub-image flashed at @addr */
+extern int rtlmptool_patch_add(struct rtlmptool_patch *p, uint32_t addr,
+		uint32_t offset, const void *value, uint32_t size);
+/* Drop every field, to fill it in again for the next unit */
+extern void rtlmptool_patch_clear(struct rtlmptool_patch *p);
+
+/*
+ * One device behind one transport. Sessions share nothing, so any
+ * number of them can run in one process.
+ */
+struct rtlmptool_session;
+
+extern struct rtlmptool_session *rtlmptool_session_create(void *trns);
+/* Cancels a running session and waits for it */
+extern void rtlmptool_session_destroy(struct rtlmptool_session *s);
+
+extern void rtlmptool_session_set_speed(struct rtlmptool_session *s, int speed);
+extern void rtlmptool_session_set_verify(struct rtlmptool_session *s, int verify);
+/* Whole session deadline, 0 for none */
+extern void rtlmptool_session_set_timeout(struct rtlmptool_session *s, unsigned ms);
+extern void rtlmptool_session_set_progress(struct rtlmptool_session *s,
+		rtlmptool_progress_cb cb, void *arg);
+/*
+ * Keep a resumable journal per @device in @dir, NULL disables it. What
+ * is journalled is what was verified: every erase unit under
+ * RTLMPTOOL_VERIFY_CHUNK, but only sub-images that went through their
+ * verify under the other policies, so a run cut short before the final
+ * pass of RTLMPTOOL_VERIFY_END resumes nothing.
+ */
+extern int rtlmptool_session_set_journal(struct rtlmptool_session *s,
+		const char *dir, const char *device);
+/*
+ * Downloads flash only the erase units that differ from @old, the image
+ * the device already holds, and confirm each sub-image with a device
+ * CRC; NULL for a full flash.
+ */
+extern int rtlmptool_session_set_base(struct rtlmptool_session *s, const char *old);
+/*
+ * Overlay @p on the MP image of downloads and flash and verify steps,
+ * NULL for none. The session does not copy it, it must outlive the run.
+ */
+extern int rtlmptool_session_set_patch(struct rtlmptool_session *s,
+		const struct rtlmptool_patch *p);
+
+/* Pick the job the session runs */
+extern int rtlmptool_session_download(struct rtlmptool_session *s,
+		const char *fw, const char *mp);
+/* Same from cached images, the session holds a reference until destroyed */
+extern int rtlmptool_session_download_image(struct rtlmptool_session *s,
+		struct rtlmptool_image *fw, struct rtlmptool_image *mp);
+/* Run @r, which must outlive the job */
+extern int rtlmptool_session_recipe(struct rtlmptool_session *s,
+		struct rtlmptool_recipe *r);
+/*
+ * Read [addr, addr + size) back into @out. With @cmp, the data is also
+ * compared with that image; the result is 1 if they differ.
+ */
+extern int rtlmptool_session_dump(struct rtlmptool_session *s, const char *fw,
+		uint32_t addr, uint32_t size, const char *out, const char *cmp);
+
+/* Run the job on the calling thread */
+extern int rtlmptool_session_run(struct rtlmptool_session *s);
+/*
+ * Or run it in the background. rtlmptool_session_fd() becomes readable
+ * whenever rtlmptool_session_step() has progress or a result to hand
+ * over; step never blocks and returns the session state. The fd is -1
+ * on Windows, where the host steps on a timer.
+ */
+extern int rtlmptool_session_start(struct rtlmptool_session *s);
+extern int rtlmptool_session_fd(struct rtlmptool_session *s);
+extern int rtlmptool_session_step(struct rtlmptool_session *s);
+/* Job result once DONE or FAILED, with its errno */
+extern int rtlmptool_session_result(struct rtlmptool_session *s);
+/* May be called from any thread, a cancelled session stays cancelled */
+extern void rtlmptool_session_cancel(struct rtlmptool_session *s);
+
+/* Blocking one shot helpers over a session with default settings */
 extern int rtlmptool_download_firmware(void *trns, int speed,
-		const char *fw, const char *mp, int *progress);
+		const char *fw, const char *mp, rtlmptool_progress_cb cb, void *arg);
+extern int rtlmptool_dump_flash(void *trns, int speed, const char *fw,
+		uint32_t addr, uint32_t size, const char *out, const char *cmp,
+		rtlmptool_progress_cb cb, void *arg);
+
+/* Start a single tone on @channel, returns the HCI status */
+extern int rtlmptool_single_tone(void *trns, unsigned char channel);
+
+/*
+ * Flash time model of one device on one line setup. Each host round
+ * trip costs @rtt_us plus its bytes on the UART at @bits_per_byte; a
+ * bridge splits transfers into @report byte packets, a round trip each.
+ */
+struct rtlmptool_estimate_model {
+	unsigned boot_baud;		/* HCI patch download */
+	unsigned baud;			/* MP flashing */
+	unsigned report;		/* bridge packet size, 0 for a direct UART */
+	double rtt_us;			/* host turnaround of one round trip */
+	double bits_per_byte;	/* 10 for 8N1 without gaps */
+	double erase_us;		/* device time to erase one unit */
+	double crc_us_per_kb;	/* device time to CRC flash for a verify */
+	double boot_us;			/* MP firmware boot and handshakes */
+	unsigned write_size;	/* MP write frame payload */
+	unsigned verify_span;	/* erase units per chunk verify */
+};
+
+enum rtlmptool_estimate_stage {
+	RTLMPTOOL_ESTIMATE_PATCH,
+	RTLMPTOOL_ESTIMATE_BOOT,
+	RTLMPTOOL_ESTIMATE_ERASE,
+	RTLMPTOOL_ESTIMATE_WRITE,
+	RTLMPTOOL_ESTIMATE_VERIFY,
+	RTLMPTOOL_ESTIMATE_STAGES,
+};
+
+struct rtlmptool_estimate {
+	double us[RTLMPTOOL_ESTIMATE_STAGES];
+	double total_us;
+	/* Transport traffic, what a trace of the same job would show */
+	unsigned long long round_trips;
+	unsigned long long bytes;
+	/* Part of total_us spent waiting on the flash, not on the link */
+	double device_us;
+};
+
+/* Defaults for a direct UART at @baud */
+extern void rtlmptool_estimate_init(struct rtlmptool_estimate_model *m, unsigned baud);
+/* Predict flashing @mp after patching with @fw, at @verify */
+extern int rtlmptool_estimate(const struct rtlmptool_estimate_model *m,
+		const char *fw, const char *mp, int verify, struct rtlmptool_estimate *e);
+/*
+ * Fit rtt_us, and bits_per_byte when the traces differ enough to tell
+ * them apart, to @n metrics files exported (-M) by real runs of the same
+ * job, trace i taken at @bauds[i].
+ */
+extern int rtlmptool_estimate_calibrate(struct rtlmptool_estimate_model *m,
+		const char *fw, const char *mp, int verify,
+		const char *const *traces, const unsigned *bauds, unsigned n);
 
 #ifdef __cplusplus
 }
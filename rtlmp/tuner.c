@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ * 
+ * SPDX-License-Identifier: 
+ */
+
+#include "defs.h"
+#include "rtlmp.h"
+#include "tuner.h"
+#include "log.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Weight of older samples, so the model follows a changing link */
+#define TUNER_DECAY			0.98
+/* Decide every N write samples */
+#define TUNER_PERIOD		8
+/* Allowed verify overhead */
+#define TUNER_VERIFY_COST	0.05
+/* Weighted errors below which the link counts as clean */
+#define TUNER_LOSS_MIN		0.1
+
+static unsigned pow2_ceil(double v)
+{
+	unsigned n = 1;
+
+	while (n < v && n < 0x80000000u)
+		n <<= 1;
+
+	return n;
+}
+
+static unsigned clamp(unsigned v, unsigned lo, unsigned hi)
+{
+	return v < lo ? lo : v > hi ? hi : v;
+}
+
+void tuner_init(struct tuner *t)
+{
+	memset(t, 0, sizeof(*t));
+	atomic_init(&t->write_size, RTLMP_WRITE_SIZE);
+	atomic_init(&t->verify_span, 1);
+	snprintf(t->write_reason, sizeof(t->write_reason), "initial");
+	snprintf(t->verify_reason, sizeof(t->verify_reason), "initial");
+}
+
+static int tuner_fit(struct tuner *t)
+{
+	double det = t->n * t->sxx - t->sx * t->sx;
+	double slope;
+
+	/* Needs writes of different sizes to tell latency from bandwidth */
+	if (det <= 1e-9 * t->n * t->sxx)
+		return -1;
+
+	slope = (t->n * t->sxy - t->sx * t->sy) / det;
+	if (slope <= 0)
+		return -1;
+
+	t->bandwidth = 1 / slope;
+	t->latency = MAX((t->sy - slope * t->sx) / t->n, 0);
+
+	return 0;
+}
+
+/*
+ * Frame with the best expected throughput: a frame of s bytes gets
+ * through with (1 - loss)^s and costs latency + s / bandwidth a try.
+ */
+static unsigned tuner_best_write(struct tuner *t, double loss, double *rate)
+{
+	unsigned s, i, best = TUNER_WRITE_MIN;
+	double ok = 1, r;
+
+	for (i = 0; i < TUNER_WRITE_MIN; i++)
+		ok *= 1 - loss;
+
+	*rate = 0;
+	for (s = TUNER_WRITE_MIN; s <= RTLMP_WRITE_SIZE; s *= 2, ok *= ok) {
+		r = s * ok / (t->latency + s / t->bandwidth);
+		if (r > *rate) {
+			*rate = r;
+			best = s;
+		}
+	}
+
+	return best;
+}
+
+static void tuner_decide_write(struct tuner *t)
+{
+	unsigned cur = atomic_load(&t->write_size);
+	unsigned next;
+	double loss = t->bytes ? t->errors / t->bytes : 0;
+	double rate;
+
+	if (t->errors < TUNER_LOSS_MIN) {
+		/* Nothing lost lately, the largest frame is the fastest */
+		next = clamp(cur * 2, TUNER_WRITE_MIN, RTLMP_WRITE_SIZE);
+		snprintf(t->write_reason, sizeof(t->write_reason), "no loss%s",
+			next == RTLMP_WRITE_SIZE ? ", device limit" : ", growing");
+	} else if (tuner_fit(t)) {
+		/* Latency unknown, stay until the model has the spread it needs */
+		next = cur;
+		snprintf(t->write_reason, sizeof(t->write_reason),
+			"loss %.1e per byte, fitting", loss);
+	} else {
+		next = tuner_best_write(t, loss, &rate);
+		if (next > cur * 2)
+			next = cur * 2;
+		snprintf(t->write_reason, sizeof(t->write_reason),
+			"rtt %.0f us, %.1f KB/s, loss %.1e per byte, best %.1f KB/s",
+			t->latency, t->bandwidth * 1e3, loss, rate * 1e3);
+	}
+
+	atomic_store(&t->write_size, next);
+}
+
+static void tuner_decide_verify(struct tuner *t)
+{
+	unsigned cur = atomic_load(&t->verify_span);
+	unsigned next;
+
+	if (t->verify_us == 0 || t->chunk_us == 0)
+		return;
+
+	next = clamp(pow2_ceil(t->verify_us / (TUNER_VERIFY_COST * t->chunk_us)),
+		1, TUNER_VERIFY_MAX);
+	if (next > cur * 2)
+		next = cur * 2;
+
+	snprintf(t->verify_reason, sizeof(t->verify_reason),
+		"verify %.0f us per %u KiB written in %.0f us, %.0f%% overhead allowed%s",
+		t->verify_us, cur * RTLMP_ERASE_SIZE / 1024, cur * t->chunk_us,
+		TUNER_VERIFY_COST * 100, next == TUNER_VERIFY_MAX ? " (limit)" : "");
+
+	atomic_store(&t->verify_span, next);
+}
+
+static void tuner_count(struct tuner *t, unsigned bytes, unsigned errors)
+{
+	t->bytes = t->bytes * TUNER_DECAY + bytes;
+	t->errors = t->errors * TUNER_DECAY + errors;
+}
+
+void tuner_write(struct tuner *t, unsigned bytes, unsigned long long us)
+{
+	tuner_count(t, bytes, 0);
+	t->n = t->n * TUNER_DECAY + 1;
+	t->sx = t->sx * TUNER_DECAY + bytes;
+	t->sy = t->sy * TUNER_DECAY + us;
+	t->sxx = t->sxx * TUNER_DECAY + (double)bytes * bytes;
+	t->sxy = t->sxy * TUNER_DECAY + (double)bytes * us;
+
+	if (t->hold) {
+		t->hold--;
+		return;
+	}
+
+	if (++t->samples % TUNER_PERIOD == 0) {
+		tuner_decide_write(t);
+	}
+}
+
+void tuner_write_error(struct tuner *t, unsigned bytes)
+{
+	unsigned cur = atomic_load(&t->write_size);
+
+	tuner_count(t, bytes, 1);
+
+	/* Once the link is modelled the loss is weighed, not just reacted to */
+	if (tuner_fit(t) == 0) {
+		tuner_decide_write(t);
+		return;
+	}
+
+	atomic_store(&t->write_size, MAX(cur / 2, TUNER_WRITE_MIN));
+	t->hold = TUNER_PERIOD * 4;
+	snprintf(t->write_reason, sizeof(t->write_reason), "write error, halved");
+}
+
+void tuner_chunk(struct tuner *t, unsigned long long us)
+{
+	t->chunk_us = t->chunk_us ? t->chunk_us * 0.8 + us * 0.2 : us;
+}
+
+void tuner_verify(struct tuner *t, unsigned long long us)
+{
+	t->verify_us = t->verify_us ? t->verify_us * 0.8 + us * 0.2 : us;
+	if (!t->hold)
+		tuner_decide_verify(t);
+}
+
+void tuner_verify_error(struct tuner *t)
+{
+	atomic_store(&t->verify_span, 1);
+	t->hold = TUNER_PERIOD * 4;
+	snprintf(t->verify_reason, sizeof(t->verify_reason), "verify failed, back to one erase unit");
+}
+
+void tuner_report(struct tuner *t)
+{
+	pr_info("Tuner: write %u bytes, %s\n", atomic_load(&t->write_size), t->write_reason);
+	pr_info("Tuner: verify %u KiB, %s\n",
+		atomic_load(&t->verify_span) * RTLMP_ERASE_SIZE / 1024, t->verify_reason);
+}
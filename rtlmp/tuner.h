@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ * 
+ * SPDX-License-Identifier: 
+ */
+
+
+#ifndef __TUNER_H__
+#define __TUNER_H__
+
+#include <stdatomic.h>
+
+/* Bounds the tuner keeps the MP write size and verify span in */
+#define TUNER_WRITE_MIN		256
+#define TUNER_VERIFY_MAX	16	/* erase units */
+
+/*
+ * Writes start at the device's largest frame, which is the fastest on a
+ * clean link. Write errors shrink the frame; from then on round trips
+ * are fitted to time = latency + bytes / bandwidth and the frame picked
+ * is the one with the best expected throughput at the measured loss.
+ * The verify span is the one whose round trip is small next to the
+ * writes it covers, and verify failures shrink it again.
+ */
+struct tuner {
+	/* Exponentially weighted least squares over (bytes, us) */
+	double n, sx, sy, sxx, sxy;
+	/* Same weighting, bytes sent and frames that failed */
+	double bytes, errors;
+	double latency;		/* us */
+	double bandwidth;	/* bytes per us */
+	double verify_us;	/* mean verify round trip */
+	double chunk_us;	/* mean time to write one erase unit */
+	unsigned samples;
+	unsigned hold;		/* samples left before growing again */
+	atomic_uint write_size;
+	atomic_uint verify_span;
+	char write_reason[128];
+	char verify_reason[128];
+};
+
+void tuner_init(struct tuner *t);
+void tuner_write(struct tuner *t, unsigned bytes, unsigned long long us);
+void tuner_write_error(struct tuner *t, unsigned bytes);
+void tuner_chunk(struct tuner *t, unsigned long long us);
+void tuner_verify(struct tuner *t, unsigned long long us);
+void tuner_verify_error(struct tuner *t);
+void tuner_report(struct tuner *t);
+
+#endif /* __TUNER_H__*/
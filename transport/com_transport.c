@@ -8,6 +8,10 @@
 #include "transport.h"
 #include <windows.h>
 
+/* Longest a single read waits, callers loop up to their own timeout */
+#define COM_READ_TIMEOUT	100
+#define COM_WRITE_TIMEOUT	2000
+
 
 struct com_transport {
 	HANDLE hndl;
@@ -38,6 +42,13 @@ static int com_write(struct transport *trans, const void *buf, unsigned size)
 	return -1;
 }
 
+static int com_flush(struct transport *trans)
+{
+	struct com_transport *com = container_of(trans, struct com_transport, transport);
+
+	return PurgeComm(com->hndl, PURGE_RXABORT | PURGE_RXCLEAR) ? 0 : -1;
+}
+
 static void com_close(struct transport *trans)
 {
 	struct com_transport *com = container_of(trans, struct com_transport, transport);
@@ -53,16 +64,14 @@ static int com_set_baudrate(struct transport *trans, unsigned speed)
 
 	GetCommState(com->hndl, &dcb);
 	dcb.BaudRate = speed;
-	SetCommState(com->hndl, &dcb);
-
-	PurgeComm(com->hndl, PURGE_TXABORT | PURGE_RXABORT | PURGE_TXCLEAR | PURGE_RXCLEAR);
-
-	return 0;
+	/* Input is kept, the next handshake skips anything stale */
+	return SetCommState(com->hndl, &dcb) ? 0 : -1;
 }
 
 static const struct transport_ops com_ops = {
 	.read = com_read,
 	.write = com_write,
+	.flush = com_flush,
 	.set_baudrate = com_set_baudrate,
 	.close = com_close,
 };
@@ -71,6 +80,7 @@ struct transport *serial_transport_open(const char *dev, unsigned speed)
 {
 	DCB dcb;
 	HANDLE hndl;
+	COMMTIMEOUTS timeouts;
 	struct com_transport *com;
 
 	hndl = CreateFile(dev, GENERIC_READ | GENERIC_WRITE, 0, NULL,
@@ -94,11 +104,28 @@ struct transport *serial_transport_open(const char *dev, unsigned speed)
 		return NULL;
 	}
 
+	/* Return as soon as anything arrived, or after COM_READ_TIMEOUT */
+	timeouts.ReadIntervalTimeout = MAXDWORD;
+	timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+	timeouts.ReadTotalTimeoutConstant = COM_READ_TIMEOUT;
+	timeouts.WriteTotalTimeoutMultiplier = 0;
+	timeouts.WriteTotalTimeoutConstant = COM_WRITE_TIMEOUT;
+	SetCommTimeouts(hndl, &timeouts);
+
 	PurgeComm(hndl, PURGE_TXABORT | PURGE_RXABORT | PURGE_TXCLEAR | PURGE_RXCLEAR);
 
-	com = malloc(sizeof(struct com_transport));
+	com = calloc(1, sizeof(struct com_transport));
 	com->hndl = hndl;
 	com->transport.ops = &com_ops;
 
 	return &com->transport;
 }
+
+/*
+ * The COM driver buffers input on its own and ReadFile() already drains
+ * it in one call, so there is no reader thread here.
+ */
+struct transport *serial_transport_open_rx(const char *dev, unsigned speed, unsigned ring, int cpu)
+{
+	return serial_transport_open(dev, speed);
+}
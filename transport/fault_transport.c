@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ *
+ * SPDX-License-Identifier:
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include "transport.h"
+#include "fault_transport.h"
+#include "defs.h"
+#include "log.h"
+
+static const char *const fault_names[FAULT_TYPES] = {
+	"drop", "flip", "short", "delay", "stall", "disconnect",
+};
+
+struct fault_transport {
+	struct transport *lower;
+	struct fault_config cfg;
+	uint32_t rng;
+	unsigned long long pos[2];	/* FAULT_READ and FAULT_WRITE streams */
+	bool fired[FAULT_SCRIPT_MAX];
+	bool disconnected;
+	unsigned long long count[FAULT_TYPES];
+	/* Rest of a shortened read, handed out before the backend is read again */
+	uint8_t *pend;
+	unsigned pend_off, npend, pend_size;
+	/* Faulted copy of a write */
+	uint8_t *scratch;
+	unsigned scratch_size;
+	struct transport transport;
+};
+
+/* xorshift32, so a seed replays the same on every host */
+static uint32_t fault_rand(struct fault_transport *f)
+{
+	uint32_t x = f->rng;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	f->rng = x;
+
+	return x;
+}
+
+/* The first scripted @type fault not yet fired in [lo, hi) of @dir */
+static const struct fault_event *fault_script(struct fault_transport *f, int type, int dir,
+	unsigned long long lo, unsigned long long hi)
+{
+	unsigned i;
+	const struct fault_event *e;
+
+	for (i = 0; i < f->cfg.nscript; i++) {
+		e = &f->cfg.script[i];
+		if (!f->fired[i] && e->type == type && e->dir == dir && e->pos >= lo && e->pos < hi) {
+			f->fired[i] = true;
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+static void fault_count(struct fault_transport *f, int type, int dir, unsigned long long pos)
+{
+	f->count[type]++;
+	f->transport.stats.faults++;
+	pr_debug("Fault: %s, %s %llu\n", fault_names[type], dir == FAULT_READ ? "read" : "write", pos);
+}
+
+/* Whether a @type fault hits @pos of @dir, by rate or by script */
+static bool fault_hit(struct fault_transport *f, int type, int dir,
+	unsigned long long lo, unsigned long long hi)
+{
+	bool hit = f->cfg.rate[type] && fault_rand(f) % 1000000 < f->cfg.rate[type];
+
+	/* Checked either way, so an event is never skipped over */
+	if (fault_script(f, type, dir, lo, hi))
+		hit = true;
+
+	if (hit)
+		fault_count(f, type, dir, MAX(lo, f->pos[dir]));
+
+	return hit;
+}
+
+/*
+ * Faults that hit a whole call, before the backend is touched. Returns
+ * 1 if the call stalled, -1 once disconnected.
+ */
+static int fault_call(struct fault_transport *f, int dir)
+{
+	struct transport *trans = &f->transport;
+	unsigned long long pos = f->pos[dir];
+
+	if (!f->disconnected && fault_hit(f, FAULT_DISCONNECT, dir, 0, pos + 1)) {
+		pr_warn("Fault: disconnect at %s %llu\n", dir == FAULT_READ ? "read" : "write", pos);
+		f->disconnected = true;
+	}
+
+	if (f->disconnected) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	if (fault_hit(f, FAULT_DELAY, dir, 0, pos + 1) && f->cfg.delay_us) {
+		usleep(fault_rand(f) % f->cfg.delay_us + 1);
+	}
+
+	/* The backend follows the same deadline */
+	f->lower->cancel = trans->cancel;
+
+	if (fault_hit(f, FAULT_STALL, dir, 0, pos + 1)) {
+		usleep(transport_wait_ms(trans, f->cfg.stall_ms) * 1000);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Where to cut @n bytes from the stream position on, @n for no cut */
+static unsigned fault_cut(struct fault_transport *f, int dir, unsigned n)
+{
+	unsigned cut;
+	unsigned long long pos = f->pos[dir];
+	const struct fault_event *e = fault_script(f, FAULT_SHORT, dir, pos, pos + n);
+
+	if (e) {
+		cut = e->pos - pos;
+	} else if (n > 1 && f->cfg.rate[FAULT_SHORT] &&
+		fault_rand(f) % 1000000 < f->cfg.rate[FAULT_SHORT]) {
+		cut = 1 + fault_rand(f) % (n - 1);
+	} else {
+		return n;
+	}
+
+	fault_count(f, FAULT_SHORT, dir, pos + cut);
+	return cut;
+}
+
+/* Drop and flip the @n bytes at @pos of @dir in place, returns how many are left */
+static unsigned fault_bytes(struct fault_transport *f, int dir, unsigned long long pos,
+	uint8_t *dat, unsigned n)
+{
+	unsigned i, m = 0;
+
+	for (i = 0; i < n; i++) {
+		if (fault_hit(f, FAULT_DROP, dir, pos + i, pos + i + 1))
+			continue;
+
+		dat[m] = dat[i];
+		if (fault_hit(f, FAULT_FLIP, dir, pos + i, pos + i + 1))
+			dat[m] ^= 1 << (fault_rand(f) & 7);
+		m++;
+	}
+
+	return m;
+}
+
+static int fault_grow(uint8_t **buf, unsigned *size, unsigned need)
+{
+	uint8_t *p;
+
+	if (need <= *size)
+		return 0;
+
+	p = realloc(*buf, need);
+	if (p == NULL)
+		return -1;
+
+	*buf = p;
+	*size = need;
+	return 0;
+}
+
+static int fault_read(struct transport *trans, void *buf, unsigned size)
+{
+	int rc;
+	unsigned n, cut, m;
+	uint8_t *dat = buf;
+	struct fault_transport *f = container_of(trans, struct fault_transport, transport);
+
+	rc = fault_call(f, FAULT_READ);
+	if (rc != 0) {
+		return rc < 0 ? -1 : 0;
+	}
+
+	/* Already faulted when it was cut off */
+	if (f->npend) {
+		n = MIN(size, f->npend);
+		memcpy(dat, f->pend + f->pend_off, n);
+		f->pend_off += n;
+		f->npend -= n;
+		return n;
+	}
+
+	rc = transport_read(f->lower, dat, size);
+	if (rc <= 0) {
+		return rc;
+	}
+
+	n = rc;
+	cut = fault_cut(f, FAULT_READ, n);
+	m = fault_bytes(f, FAULT_READ, f->pos[FAULT_READ], dat, cut);
+	if (cut < n) {
+		f->npend = fault_bytes(f, FAULT_READ, f->pos[FAULT_READ] + cut, dat + cut, n - cut);
+		f->pend_off = 0;
+		if (fault_grow(&f->pend, &f->pend_size, f->npend)) {
+			f->npend = 0;
+			return -1;
+		}
+		memcpy(f->pend, dat + cut, f->npend);
+	}
+	f->pos[FAULT_READ] += n;
+
+	return m;
+}
+
+static int fault_write(struct transport *trans, const void *buf, unsigned size)
+{
+	int rc;
+	unsigned cut, m;
+	struct fault_transport *f = container_of(trans, struct fault_transport, transport);
+
+	if (fault_call(f, FAULT_WRITE) < 0) {
+		return -1;
+	}
+
+	if (fault_grow(&f->scratch, &f->scratch_size, size)) {
+		return -1;
+	}
+
+	cut = fault_cut(f, FAULT_WRITE, size);
+	memcpy(f->scratch, buf, cut);
+	m = fault_bytes(f, FAULT_WRITE, f->pos[FAULT_WRITE], f->scratch, cut);
+	f->pos[FAULT_WRITE] += cut;
+
+	if (m) {
+		rc = transport_write(f->lower, f->scratch, m);
+		if (rc != (int)m) {
+			return rc;
+		}
+	}
+
+	/* Dropped bytes count as sent, it is the far end that misses them */
+	return cut;
+}
+
+static int fault_flush(struct transport *trans)
+{
+	struct fault_transport *f = container_of(trans, struct fault_transport, transport);
+
+	f->npend = 0;
+	if (f->disconnected) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	f->lower->cancel = trans->cancel;
+	return transport_flush(f->lower);
+}
+
+static int fault_set_baudrate(struct transport *trans, unsigned speed)
+{
+	struct fault_transport *f = container_of(trans, struct fault_transport, transport);
+
+	if (f->disconnected) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	return transport_set_baudrate(f->lower, speed);
+}
+
+static void fault_close(struct transport *trans)
+{
+	int i;
+	struct fault_transport *f = container_of(trans, struct fault_transport, transport);
+
+	for (i = 0; i < FAULT_TYPES; i++) {
+		if (f->count[i]) {
+			pr_info("Fault: %s x %llu\n", fault_names[i], f->count[i]);
+		}
+	}
+
+	transport_close(f->lower);
+	free(f->pend);
+	free(f->scratch);
+	free(f);
+}
+
+static const struct transport_ops fault_transport_ops = {
+	.write = fault_write,
+	.read = fault_read,
+	.flush = fault_flush,
+	.close = fault_close,
+	.set_baudrate = fault_set_baudrate,
+};
+
+/* On failure @lower is left open */
+struct transport *fault_transport_open(struct transport *lower, const struct fault_config *cfg)
+{
+	struct fault_transport *f;
+
+	if (lower == NULL || cfg->nscript > FAULT_SCRIPT_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	f = calloc(1, sizeof(struct fault_transport));
+	if (f == NULL) {
+		return NULL;
+	}
+
+	f->lower = lower;
+	f->cfg = *cfg;
+	f->rng = cfg->seed ^ 0x9e3779b9;
+	if (f->rng == 0) {
+		f->rng = 1;
+	}
+	f->transport.ops = &fault_transport_ops;
+
+	return &f->transport;
+}
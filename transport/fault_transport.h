@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ *
+ * SPDX-License-Identifier:
+ */
+
+#ifndef __FAULT_TRANSPORT_H__
+#define __FAULT_TRANSPORT_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct transport;
+
+enum {
+	FAULT_DROP,		/* a byte is lost */
+	FAULT_FLIP,		/* one bit of a byte is inverted */
+	FAULT_SHORT,	/* a read or write moves only part of the buffer */
+	FAULT_DELAY,	/* a call takes up to delay_us longer */
+	FAULT_STALL,	/* a call blocks for stall_ms, a read then returns nothing */
+	FAULT_DISCONNECT,	/* the call and every later one fail with ENODEV */
+	FAULT_TYPES,
+};
+
+#define FAULT_READ		0
+#define FAULT_WRITE		1
+
+/* Fires once, on the call that moves byte @pos of the @dir stream */
+struct fault_event {
+	int type;
+	int dir;
+	unsigned long long pos;
+};
+
+#define FAULT_SCRIPT_MAX	32
+
+/*
+ * Rates are per million, of bytes for drops and flips and of calls for
+ * the rest. Read positions count bytes as the backend returned them,
+ * write positions bytes as the caller handed them over, so a seed and a
+ * script replay the same faults on the same traffic.
+ */
+struct fault_config {
+	unsigned seed;
+	unsigned rate[FAULT_TYPES];
+	unsigned delay_us;
+	unsigned stall_ms;
+	unsigned nscript;
+	struct fault_event script[FAULT_SCRIPT_MAX];
+};
+
+/* Wrap @lower, which is closed along with the returned transport */
+struct transport *fault_transport_open(struct transport *lower, const struct fault_config *cfg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FAULT_TRANSPORT_H__*/
@@ -1,45 +1,160 @@
 /*
  * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
- * 
- * SPDX-License-Identifier: 
+ *
+ * SPDX-License-Identifier:
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <wchar.h>
+#include <pthread.h>
 #include "transport.h"
 #include "mcu_transport.h"
+#include "hidapi_transport.h"
+#include "log.h"
 #include <hidapi/hidapi.h>
 
-static int hidapi_read(void *hndl, unsigned char id, void *buf, unsigned size)
+/*
+ * hid_init()/hid_exit() are process wide, so every open device and
+ * enumeration holds one reference and the last one out calls hid_exit().
+ */
+static pthread_mutex_t hidapi_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned hidapi_refs;
+
+static int hidapi_get(void)
 {
-	return hid_read(hndl, buf, size);
+	int rc = 0;
+
+	pthread_mutex_lock(&hidapi_lock);
+	if (hidapi_refs == 0 && hid_init() != 0) {
+		errno = EIO;
+		rc = -1;
+	} else {
+		hidapi_refs++;
+	}
+	pthread_mutex_unlock(&hidapi_lock);
+
+	return rc;
 }
 
-static int hidapi_write(void *hndl, unsigned char id, const void *buf, unsigned size)
+static void hidapi_put(void)
 {
-	return hid_write(hndl, buf, size);
+	pthread_mutex_lock(&hidapi_lock);
+	if (--hidapi_refs == 0) {
+		hid_exit();
+	}
+	pthread_mutex_unlock(&hidapi_lock);
 }
 
-static void hidapi_close(void *hndl)
+/* @timeout is already cut short by the session deadline */
+static int hidapi_read(void *hndl, unsigned char id, void *buf, unsigned size, unsigned timeout)
 {
-	hid_close(hndl);
-	hid_exit();
+	int rc = hid_read_timeout(hndl, buf, size, timeout);
+
+	if (rc == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	if (rc < 0) {
+		pr_debug("hid_read: %ls\n", hid_error(hndl));
+		errno = EIO;
+	}
+
+	return rc;
 }
 
-struct transport *hidapi_transport_open(uint16_t vid, uint16_t pid)
+/* hidapi has no write timeout, an output report is queued at once */
+static int hidapi_write(void *hndl, unsigned char id, const void *buf, unsigned size, unsigned timeout)
 {
-	int rc;
-	hid_device *dev;
+	int rc = hid_write(hndl, buf, size);
+
+	if (rc < 0) {
+		pr_debug("hid_write: %ls\n", hid_error(hndl));
+		errno = EIO;
+	}
 
-	rc = hid_init();
+	return rc;
+}
+
+static void hidapi_close(void *hndl)
+{
+	hid_close(hndl);
+	hidapi_put();
+}
 
-	dev = hid_open(vid, pid, NULL);
+static struct transport *hidapi_wrap(hid_device *dev)
+{
 	if (dev == NULL) {
 		errno = ENODEV;
-		hid_exit();
+		hidapi_put();
 		return NULL;
 	}
 
 	return mcu_transport_open(dev, hidapi_close, hidapi_read, hidapi_write);
 }
+
+int hidapi_enumerate(uint16_t vid, uint16_t pid, struct hidapi_device *devs, int max)
+{
+	int n = 0;
+	struct hid_device_info *info, *cur;
+
+	if (hidapi_get()) {
+		return -1;
+	}
+
+	info = hid_enumerate(vid, pid);
+	for (cur = info; cur; cur = cur->next, n++) {
+		if (n >= max)
+			continue;
+
+		memset(&devs[n], 0, sizeof(devs[n]));
+		snprintf(devs[n].path, sizeof(devs[n].path), "%s", cur->path);
+		if (cur->serial_number) {
+			snprintf(devs[n].serial, sizeof(devs[n].serial), "%ls", cur->serial_number);
+		}
+		devs[n].vid = cur->vendor_id;
+		devs[n].pid = cur->product_id;
+		devs[n].iface = cur->interface_number;
+	}
+	hid_free_enumeration(info);
+
+	hidapi_put();
+	return n;
+}
+
+struct transport *hidapi_transport_open(uint16_t vid, uint16_t pid)
+{
+	if (hidapi_get()) {
+		return NULL;
+	}
+
+	return hidapi_wrap(hid_open(vid, pid, NULL));
+}
+
+struct transport *hidapi_transport_open_path(const char *path)
+{
+	if (hidapi_get()) {
+		return NULL;
+	}
+
+	return hidapi_wrap(hid_open_path(path));
+}
+
+struct transport *hidapi_transport_open_serial(uint16_t vid, uint16_t pid, const char *serial)
+{
+	wchar_t wserial[HIDAPI_SERIAL_SIZE];
+
+	if (mbstowcs(wserial, serial, HIDAPI_SERIAL_SIZE) >= HIDAPI_SERIAL_SIZE) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (hidapi_get()) {
+		return NULL;
+	}
+
+	return hidapi_wrap(hid_open(vid, pid, wserial));
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ *
+ * SPDX-License-Identifier:
+ */
+
+#ifndef __HIDAPI_TRANSPORT_H__
+#define __HIDAPI_TRANSPORT_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HIDAPI_PATH_SIZE	256
+#define HIDAPI_SERIAL_SIZE	64
+
+struct transport;
+
+struct hidapi_device {
+	char path[HIDAPI_PATH_SIZE];
+	char serial[HIDAPI_SERIAL_SIZE];	/* empty if the bridge has none */
+	uint16_t vid, pid;
+	int iface;
+};
+
+/* Fill @devs with up to @max bridges matching @vid:@pid, returns how many matched */
+int hidapi_enumerate(uint16_t vid, uint16_t pid, struct hidapi_device *devs, int max);
+
+/* The first match, as before */
+struct transport *hidapi_transport_open(uint16_t vid, uint16_t pid);
+struct transport *hidapi_transport_open_path(const char *path);
+struct transport *hidapi_transport_open_serial(uint16_t vid, uint16_t pid, const char *serial);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HIDAPI_TRANSPORT_H__*/
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ * 
+ * SPDX-License-Identifier: 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include "log.h"
+
+#define LOG_RING_MASK	(LOG_RING_SIZE - 1)
+
+/*
+ * Bounded multi-producer queue (Vyukov). Each slot carries a sequence
+ * number telling whether it is free for position @pos (seq == pos) or
+ * holds the message for it (seq == pos + 1). The stored value is biased
+ * by the slot index so that the zero-initialised ring is already valid.
+ */
+struct log_slot {
+	atomic_uint seq;
+	int level;
+	char msg[LOG_MSG_SIZE];
+};
+
+static struct log_slot ring[LOG_RING_SIZE];
+static atomic_uint ring_head, ring_tail;
+static atomic_ulong ring_dropped;
+static atomic_int ring_notified;
+static int log_level = LOG_LEVEL_INFO;
+static void (*log_notify)(void *arg);
+static void *log_notify_arg;
+
+static unsigned slot_seq(unsigned idx)
+{
+	return atomic_load_explicit(&ring[idx].seq, memory_order_acquire) + idx;
+}
+
+static void slot_set_seq(unsigned idx, unsigned seq)
+{
+	atomic_store_explicit(&ring[idx].seq, seq - idx, memory_order_release);
+}
+
+void log_set_level(int level)
+{
+	log_level = level;
+}
+
+unsigned long log_dropped(void)
+{
+	return atomic_load(&ring_dropped);
+}
+
+void log_set_notify(void (*notify)(void *arg), void *arg)
+{
+	log_notify_arg = arg;
+	log_notify = notify;
+}
+
+void log_printf(int level, const char *fmt, ...)
+{
+	va_list va;
+	unsigned idx;
+	unsigned pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+
+	if (level > log_level)
+		return;
+
+	for (;;) {
+		int dif;
+
+		idx = pos & LOG_RING_MASK;
+		dif = (int)(slot_seq(idx) - pos);
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&ring_head, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (dif < 0) {
+			atomic_fetch_add(&ring_dropped, 1);
+			return;
+		} else {
+			pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+		}
+	}
+
+	va_start(va, fmt);
+	vsnprintf(ring[idx].msg, LOG_MSG_SIZE, fmt, va);
+	va_end(va);
+	ring[idx].level = level;
+	slot_set_seq(idx, pos + 1);
+
+	if (log_notify && !atomic_exchange(&ring_notified, 1))
+		log_notify(log_notify_arg);
+}
+
+unsigned log_drain(void (*sink)(int level, const char *msg, void *arg),
+	void *arg, unsigned max)
+{
+	unsigned n = 0;
+	unsigned pos = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+
+	atomic_store(&ring_notified, 0);
+
+	while (n < max) {
+		int dif;
+		unsigned idx = pos & LOG_RING_MASK;
+
+		dif = (int)(slot_seq(idx) - (pos + 1));
+		if (dif < 0)
+			break;
+
+		if (dif > 0 || !atomic_compare_exchange_weak_explicit(&ring_tail, &pos, pos + 1,
+				memory_order_relaxed, memory_order_relaxed)) {
+			pos = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+			continue;
+		}
+
+		sink(ring[idx].level, ring[idx].msg, arg);
+		slot_set_seq(idx, pos + LOG_RING_SIZE);
+		pos++;
+		n++;
+	}
+
+	return n;
+}
+
+static sem_t stdout_sem;
+static pthread_t stdout_tid;
+static atomic_int stdout_running;
+
+static void stdout_notify(void *arg)
+{
+	sem_post(&stdout_sem);
+}
+
+static void stdout_sink(int level, const char *msg, void *arg)
+{
+	fputs(msg, level <= LOG_LEVEL_WARN ? stderr : stdout);
+}
+
+static void stdout_flush(void)
+{
+	log_drain(stdout_sink, NULL, UINT_MAX);
+	fflush(stdout);
+}
+
+static void *stdout_thread(void *arg)
+{
+	do {
+		sem_wait(&stdout_sem);
+		stdout_flush();
+	} while (atomic_load(&stdout_running));
+
+	return NULL;
+}
+
+int log_stdout_start(void)
+{
+	if (sem_init(&stdout_sem, 0, 0))
+		return -1;
+
+	atomic_store(&stdout_running, 1);
+	if (pthread_create(&stdout_tid, NULL, stdout_thread, NULL)) {
+		sem_destroy(&stdout_sem);
+		return -1;
+	}
+
+	log_set_notify(stdout_notify, NULL);
+	/* exit() from deep inside a transport must not lose its reason */
+	atexit(stdout_flush);
+	return 0;
+}
+
+void log_stdout_stop(void)
+{
+	log_set_notify(NULL, NULL);
+	atomic_store(&stdout_running, 0);
+	sem_post(&stdout_sem);
+	pthread_join(stdout_tid, NULL);
+	sem_destroy(&stdout_sem);
+
+	/* Whatever raced with the shutdown */
+	stdout_flush();
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ * 
+ * SPDX-License-Identifier: 
+ */
+
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LOG_LEVEL_ERROR	0
+#define LOG_LEVEL_WARN	1
+#define LOG_LEVEL_INFO	2
+#define LOG_LEVEL_DEBUG	3
+
+/* Ring capacity in messages (power of 2) and maximum message length */
+#define LOG_RING_SIZE	256
+#define LOG_MSG_SIZE	248
+
+/*
+ * Never allocates or blocks: the message is formatted straight into a
+ * preallocated ring slot, and dropped (and counted) if the ring is full.
+ */
+void log_printf(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_set_level(int level);
+unsigned long log_dropped(void);
+
+/*
+ * @notify is called by the producer when the ring turns non-empty, at
+ * most once until the next log_drain(). It must not block.
+ */
+void log_set_notify(void (*notify)(void *arg), void *arg);
+unsigned log_drain(void (*sink)(int level, const char *msg, void *arg),
+	void *arg, unsigned max);
+
+/* Drain the ring to stdout from a background thread */
+int log_stdout_start(void);
+void log_stdout_stop(void);
+
+#define pr_err(...)		log_printf(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define pr_warn(...)	log_printf(LOG_LEVEL_WARN, __VA_ARGS__)
+#define pr_info(...)	log_printf(LOG_LEVEL_INFO, __VA_ARGS__)
+#define pr_debug(...)	log_printf(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LOG_H__*/
@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ *
+ * SPDX-License-Identifier:
+ */
+
+/*
+ * Bridge firmware emulated behind the mcu_transport callbacks. The
+ * target side is a loopback: every byte written comes back on read.
+ */
+
+#include "defs.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "transport.h"
+#include "mcu_transport.h"
+#include "mcu_protocol.h"
+#include "log.h"
+
+#define EMU_LOOPBACK_SIZE	4096
+
+struct mcu_emulator {
+	unsigned version;	/* highest the bridge speaks */
+	unsigned packet;	/* v2 packet size it offers */
+	unsigned quirks;
+	struct mcu_framing framing;	/* in use */
+	uint32_t baudrate;
+	/* One answer waits for the host to read it */
+	uint8_t rsp[MCU_PACKET_MAX];
+	unsigned rsp_size;
+	uint8_t loop[EMU_LOOPBACK_SIZE];
+	unsigned loop_head, loop_count;
+};
+
+static void emu_reply(struct mcu_emulator *emu, uint8_t cmd, const void *data, unsigned size)
+{
+	mcu_pack(&emu->framing, emu->rsp, MCU_ID_BRIDGE, cmd, data, size);
+	emu->rsp_size = emu->framing.packet;
+}
+
+static void emu_ack(struct mcu_emulator *emu, uint8_t cmd, uint8_t status)
+{
+	emu_reply(emu, 0, (uint8_t[]){cmd, status}, 2);
+}
+
+static void emu_start(struct mcu_emulator *emu, const uint8_t *param, unsigned size)
+{
+	uint8_t ack[5] = {USB_TRANS_CMD_START, 0, MCU_VERSION,
+		emu->packet & 0xff, emu->packet >> 8};
+
+	emu->framing.version = 1;
+	emu->framing.packet = MCU_V1_PACKET;
+	if (size < 4) {
+		emu_ack(emu, USB_TRANS_CMD_START, 1);
+		return;
+	}
+	memcpy(&emu->baudrate, param, 4);
+
+	if ((emu->quirks & MCU_EMU_NACK_LONG_START) && size > 4) {
+		emu_ack(emu, USB_TRANS_CMD_START, 1);
+		return;
+	}
+
+	/* A v1 bridge ignores the offer, the ack is the same either way */
+	if (emu->version < 2 || size < 7 || param[4] < 2) {
+		emu_ack(emu, USB_TRANS_CMD_START, 0);
+		return;
+	}
+
+	/* The ack still goes out in v1 framing, then both ends switch */
+	emu_reply(emu, 0, ack, sizeof(ack));
+	emu->framing.version = 2;
+	emu->framing.packet = MIN(MIN(emu->packet, (unsigned)(param[5] | param[6] << 8)),
+		MCU_PACKET_MAX);
+}
+
+static void emu_write(struct mcu_emulator *emu, const uint8_t *data, unsigned size)
+{
+	unsigned i;
+
+	if (emu->loop_count + size > EMU_LOOPBACK_SIZE) {
+		emu_ack(emu, USB_TRANS_CMD_WRITE, 1);
+		return;
+	}
+
+	for (i = 0; i < size; i++) {
+		emu->loop[(emu->loop_head + emu->loop_count++) % EMU_LOOPBACK_SIZE] = data[i];
+	}
+	emu_ack(emu, USB_TRANS_CMD_WRITE, 0);
+}
+
+static void emu_read(struct mcu_emulator *emu, const uint8_t *param, unsigned size)
+{
+	unsigned i, n;
+	uint8_t data[MCU_PACKET_MAX];
+
+	n = param[0];
+	if (emu->framing.version >= 2 && size >= 2) {
+		n |= param[1] << 8;
+	}
+	n = MIN(MIN(n, emu->loop_count), mcu_payload_max(&emu->framing));
+
+	for (i = 0; i < n; i++) {
+		data[i] = emu->loop[emu->loop_head];
+		emu->loop_head = (emu->loop_head + 1) % EMU_LOOPBACK_SIZE;
+		emu->loop_count--;
+	}
+	emu_reply(emu, USB_TRANS_CMD_READ, data, n);
+}
+
+static int emu_host_write(void *hndl, unsigned char id, const void *buf, unsigned size, unsigned timeout)
+{
+	struct mcu_emulator *emu = hndl;
+	const uint8_t *pkt = buf;
+	const uint8_t *param;
+	unsigned len;
+	uint8_t cmd;
+	const struct mcu_framing v1 = { 1, MCU_V1_PACKET };
+	const struct mcu_framing *f = &emu->framing;
+
+	/* START is always v1, whatever was settled before */
+	if (size == MCU_V1_PACKET && pkt[1] == USB_TRANS_CMD_START) {
+		f = &v1;
+	}
+
+	if (size != f->packet || pkt[0] != MCU_ID_HOST ||
+		mcu_unpack(f, pkt, &cmd, &param, &len)) {
+		errno = EIO;
+		return -1;
+	}
+
+	if (pkt[size - 1] != mcu_checksum(pkt, size - 1)) {
+		emu_ack(emu, cmd, 2);
+		return size;
+	}
+
+	switch (cmd) {
+	case USB_TRANS_CMD_START:
+		emu_start(emu, param, len);
+	break;
+
+	case USB_TRANS_CMD_SET_BAUDRATE:
+		memcpy(&emu->baudrate, param, MIN(len, 4));
+		emu_ack(emu, cmd, 0);
+	break;
+
+	case USB_TRANS_CMD_WRITE:
+		emu_write(emu, param, len);
+	break;
+
+	case USB_TRANS_CMD_READ:
+		emu_read(emu, param, len);
+	break;
+
+	case USB_TRANS_CMD_FINISH:
+		emu_ack(emu, cmd, 0);
+	break;
+
+	default:
+		emu_ack(emu, cmd, 3);
+	break;
+	}
+
+	return size;
+}
+
+static int emu_host_read(void *hndl, unsigned char id, void *buf, unsigned size, unsigned timeout)
+{
+	struct mcu_emulator *emu = hndl;
+	unsigned n;
+
+	if (emu->rsp_size == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	n = MIN(size, emu->rsp_size);
+	memcpy(buf, emu->rsp, n);
+	emu->rsp_size = 0;
+
+	return n;
+}
+
+static void emu_close(void *hndl)
+{
+	free(hndl);
+}
+
+/* @packet may be out of range, to see the host turn such a bridge down */
+struct transport *mcu_emulator_open(unsigned version, unsigned packet, unsigned quirks)
+{
+	struct mcu_emulator *emu;
+
+	if (version < 1 || version > MCU_VERSION || packet < 8 || packet > 0xffff) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	emu = calloc(1, sizeof(struct mcu_emulator));
+	if (emu == NULL) {
+		return NULL;
+	}
+
+	emu->version = version;
+	emu->packet = packet;
+	emu->quirks = quirks;
+	emu->framing.version = 1;
+	emu->framing.packet = MCU_V1_PACKET;
+
+	return mcu_transport_open(emu, emu_close, emu_host_read, emu_host_write);
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ *
+ * SPDX-License-Identifier:
+ */
+
+#ifndef __MCU_PROTOCOL_H__
+#define __MCU_PROTOCOL_H__
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Bridge protocol, one fixed size packet per transfer each way:
+ *
+ *   v1: 64 bytes   id, cmd, len, payload[60], checksum
+ *   v2: N bytes    id, cmd, len lo, len hi, payload[N - 5], checksum
+ *
+ * The host sends with id 0x03 and the bridge answers with id 0x01. A
+ * command is acked with cmd 0 and the payload {cmd, status}. START is
+ * always v1; the host offers {baudrate, version, packet size} and a v2
+ * bridge acks with {cmd, status, version, packet size}, after which
+ * both ends switch. A v1 bridge acks as usual and nothing changes.
+ */
+#define USB_TRANS_CMD_START			0x01
+#define USB_TRANS_CMD_SET_BAUDRATE	0x02
+#define USB_TRANS_CMD_WRITE			0x03
+#define USB_TRANS_CMD_READ			0x04
+#define USB_TRANS_CMD_FINISH		0x05
+
+#define MCU_ID_HOST			0x03
+#define MCU_ID_BRIDGE		0x01
+
+#define MCU_VERSION			2
+#define MCU_V1_PACKET		64
+/* Largest v2 packet the host handles, a high speed bulk packet */
+#define MCU_PACKET_MAX		512
+
+struct mcu_framing {
+	unsigned version;
+	unsigned packet;
+};
+
+static inline unsigned mcu_header_size(const struct mcu_framing *f)
+{
+	return f->version >= 2 ? 4 : 3;
+}
+
+/* Payload bytes that fit in one packet */
+static inline unsigned mcu_payload_max(const struct mcu_framing *f)
+{
+	return f->packet - mcu_header_size(f) - 1;
+}
+
+static inline uint8_t mcu_checksum(const uint8_t *data, unsigned size)
+{
+	unsigned i;
+	uint8_t sum = 0;
+
+	for (i = 0; i < size; i++) {
+		sum += data[i];
+	}
+
+	return sum;
+}
+
+/* Fill @pkt, f->packet bytes, with @size bytes of @param */
+static inline void mcu_pack(const struct mcu_framing *f, uint8_t *pkt, uint8_t id,
+	uint8_t cmd, const void *param, unsigned size)
+{
+	memset(pkt, 0, f->packet);
+	pkt[0] = id;
+	pkt[1] = cmd;
+	pkt[2] = size & 0xff;
+	if (f->version >= 2) {
+		pkt[3] = size >> 8;
+	}
+
+	if (param && size) {
+		memcpy(pkt + mcu_header_size(f), param, size);
+	}
+	pkt[f->packet - 1] = mcu_checksum(pkt, f->packet - 1);
+}
+
+/* Command and payload of @pkt, returns -1 if its length doesn't fit */
+static inline int mcu_unpack(const struct mcu_framing *f, const uint8_t *pkt,
+	uint8_t *cmd, const uint8_t **data, unsigned *size)
+{
+	*cmd = pkt[1];
+	*size = pkt[2];
+	if (f->version >= 2) {
+		*size |= pkt[3] << 8;
+	}
+	*data = pkt + mcu_header_size(f);
+
+	return *size > mcu_payload_max(f) ? -1 : 0;
+}
+
+#endif /* __MCU_PROTOCOL_H__*/
@@ -7,131 +7,169 @@
 #include <string.h>
 #include "transport.h"
 #include "mcu_transport.h"
+#include "mcu_protocol.h"
+#include "log.h"
 
 #define USB_START_TIMEOUT		2000
 #define USB_WRITE_TIMEOUT		2000
 #define USB_READ_TIMEOUT		2000
 #define USB_TRANS_TIMEOUT		2000
 #define FLAG_AUTO_DETACH_KERNEL_DRIVER	0x0001
-
-#define USB_TRANS_CMD_START			0x01
-#define USB_TRANS_CMD_SET_BAUDRATE	0x02
-#define USB_TRANS_CMD_WRITE			0x03
-#define USB_TRANS_CMD_READ			0x04
-#define USB_TRANS_CMD_FINISH		0x05
-
-#define TRANS_BLOCK_SIZE	60
+/* Most READ blocks a flush throws away before it gives up */
+#define MCU_FLUSH_BLOCKS		64
 
 struct mcu_transport {
 	void *hndl;
+	struct mcu_framing framing;
 	void (*close)(void *hndl);
-	int (*read)(void *hndl, unsigned char id, void *buf, unsigned size);
-	int (*write)(void *hndl, unsigned char id, const void *buf, unsigned size);
+	int (*read)(void *hndl, unsigned char id, void *buf, unsigned size, unsigned timeout);
+	int (*write)(void *hndl, unsigned char id, const void *buf, unsigned size, unsigned timeout);
 	struct transport transport;
 };
 
 
-static unsigned char checksum(unsigned char *data, unsigned size)
+/* What is left of @timeout for the next transfer, 0 once it is used up */
+static unsigned mcu_timeout(struct mcu_transport *trans, unsigned long long start, unsigned timeout)
 {
-	int i;
-	unsigned char sum = 0;
+	unsigned long long elapsed = (transport_now_us() - start) / 1000;
 
-	for (i = 0; i < size; i++) {
-		sum += data[i];
-	}
+	if (elapsed >= timeout)
+		return 0;
 
-	return sum;
+	return transport_wait_ms(&trans->transport, timeout - elapsed);
 }
 
-static int mcu_write_command(struct mcu_transport *trans, uint8_t cmd, const void *param, uint8_t size, unsigned timeout)
+/*
+ * Send @cmd and wait for its ack. Whatever the ack carries past the
+ * status goes to @ext, up to @ext_size bytes, and its length is returned.
+ */
+static int mcu_command(struct mcu_transport *trans, uint8_t cmd, const void *param, unsigned size,
+	unsigned timeout, uint8_t *ext, unsigned ext_size)
 {
 	int rc;
-	int trans_number;
 	int retry = 10;
-	uint8_t tmp[64];
-	uint8_t rsp[64];
-
-	memset(tmp, 0, 64);
-
-	tmp[0] = 0x03;
-	tmp[1] = cmd;
-	tmp[2] = size;
-	memcpy(tmp + 3, param, size);
-	tmp[63] = checksum(tmp, 63);
-
-	rc = trans->write(trans->hndl, 0x02, tmp, 64);
+	unsigned ms, len;
+	uint8_t id;
+	const uint8_t *data;
+	const struct mcu_framing *f = &trans->framing;
+	uint8_t tmp[MCU_PACKET_MAX];
+	uint8_t rsp[MCU_PACKET_MAX];
+	unsigned long long start = transport_now_us();
+
+	mcu_pack(f, tmp, MCU_ID_HOST, cmd, param, size);
+
+	trans->transport.stats.round_trips++;
+	ms = mcu_timeout(trans, start, timeout);
+	if (ms == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
 
-	if (rc <= 0) {
-		return rc;
+	rc = trans->write(trans->hndl, 0x02, tmp, f->packet, ms);
+	if (rc != f->packet) {
+		return -1;
 	}
 
 	while (retry--) {
-		rc = trans->read(trans->hndl, 0x81, rsp, 64);
-		if (rc <= 0) {
-			return rc;
+		ms = mcu_timeout(trans, start, timeout);
+		if (ms == 0) {
+			trans->transport.stats.timeouts++;
+			errno = ETIMEDOUT;
+			return -1;
 		}
 
-		if (rc != 64 || rsp[0] != 0x01) {
+		rc = trans->read(trans->hndl, 0x81, rsp, f->packet, ms);
+		if (rc < 0) {
 			return -1;
 		}
 
-		if (rsp[1] == 0 && rsp[2] == 2 && rsp[3] == cmd && rsp[4] == 0) {
-			return 0;
+		if (rc != f->packet || rsp[0] != MCU_ID_BRIDGE ||
+			mcu_unpack(f, rsp, &id, &data, &len)) {
+			errno = EPROTO;
+			return -1;
+		}
+
+		if (id == 0 && len >= 2 && data[0] == cmd) {
+			if (data[1] != 0) {
+				pr_debug("bridge nack %02x: %d\n", cmd, data[1]);
+				errno = EIO;
+				return -1;
+			}
+
+			len = MIN(len - 2, ext_size);
+			if (ext && len) {
+				memcpy(ext, data + 2, len);
+			}
+			return len;
 		}
+
+		trans->transport.stats.ack_retries++;
 	}
 
+	errno = EPROTO;
 	return -1;
 }
 
+static int mcu_write_command(struct mcu_transport *trans, uint8_t cmd, const void *param,
+	unsigned size, unsigned timeout)
+{
+	return mcu_command(trans, cmd, param, size, timeout, NULL, 0) < 0 ? -1 : 0;
+}
+
 static int mcu_read_block(struct mcu_transport *trans, void *buf, unsigned size, unsigned *read_size, unsigned timeout)
 {
 	int rc;
-	int sum;
-	uint8_t crc;
-	uint8_t tmp[64];
-	uint8_t rsp[64];
-
-	memset(tmp, 0, 64);
-	tmp[0] = 0x03;
-	tmp[1] = USB_TRANS_CMD_READ;
-	tmp[2] = 1;
-	tmp[3] = size;
-	tmp[63] = checksum(tmp, 63);
+	unsigned ms, len;
+	uint8_t cmd;
+	const uint8_t *data;
+	const struct mcu_framing *f = &trans->framing;
+	uint8_t req[2] = { size & 0xff, size >> 8 };
+	uint8_t tmp[MCU_PACKET_MAX];
+	uint8_t rsp[MCU_PACKET_MAX];
+	unsigned long long start = transport_now_us();
+
+	/* v1 asks with one length byte, v2 with two */
+	mcu_pack(f, tmp, MCU_ID_HOST, USB_TRANS_CMD_READ, req, f->version >= 2 ? 2 : 1);
 
 	*read_size = 0;
-	rc = trans->write(trans->hndl, 2, tmp, 64);
-	if (rc != 64) {
+	trans->transport.stats.round_trips++;
+	ms = mcu_timeout(trans, start, timeout);
+	if (ms == 0) {
+		errno = ETIMEDOUT;
 		return -1;
 	}
 
-	rc = trans->read(trans->hndl, 0x81, rsp, 64);
-	if (rc != 64) {
+	rc = trans->write(trans->hndl, 2, tmp, f->packet, ms);
+	if (rc != f->packet) {
 		return -1;
 	}
 
-	if (rsp[0] != 0x01) {
+	ms = mcu_timeout(trans, start, timeout);
+	if (ms == 0) {
+		trans->transport.stats.timeouts++;
+		errno = ETIMEDOUT;
 		return -1;
 	}
 
-	//sum = checksum(rsp, 63);
-	//if (sum != rsp[63]) {
-	//	return LIBUSB_ERROR_OTHER + 0x01;
-	//}
-
-	if (rsp[1] == 0x00 && rsp[2] == 2 && rsp[3] == 0x04) {
-		return -1 - rsp[4];
+	rc = trans->read(trans->hndl, 0x81, rsp, f->packet, ms);
+	if (rc != f->packet) {
+		return -1;
 	}
 
-	if (rsp[1] != 0x04) {
+	if (rsp[0] != MCU_ID_BRIDGE || mcu_unpack(f, rsp, &cmd, &data, &len)) {
 		return -1;
 	}
 
-	if (rsp[2] > size) {
+	if (cmd == 0x00 && len == 2 && data[0] == USB_TRANS_CMD_READ) {
+		return -1 - data[1];
+	}
+
+	if (cmd != USB_TRANS_CMD_READ || len > size) {
 		return -1;
 	}
 
-	memcpy(buf, rsp + 3, rsp[2]);
-	*read_size = rsp[2];
+	memcpy(buf, data, len);
+	*read_size = len;
 
 	return 0;
 }
@@ -143,7 +181,7 @@ static int mcu_write(struct transport *trans, const void *buf, unsigned size)
 	struct mcu_transport *mcu = container_of(trans, struct mcu_transport, transport);
 
 	while (write_number < size) {
-		unsigned count = MIN(size - write_number, TRANS_BLOCK_SIZE);
+		unsigned count = MIN(size - write_number, mcu_payload_max(&mcu->framing));
 
 		rc = mcu_write_command(mcu, USB_TRANS_CMD_WRITE,
 			buf + write_number, count, USB_WRITE_TIMEOUT);
@@ -159,13 +197,13 @@ static int mcu_write(struct transport *trans, const void *buf, unsigned size)
 static int mcu_read(struct transport *trans, void *buf, unsigned size)
 {
 	int rc;
-	int retry = 300;
 	unsigned read_number = 0;
+	unsigned long long start = transport_now_us();
 	struct mcu_transport *mcu = container_of(trans, struct mcu_transport, transport);
 
 	while (read_number < size) {
 		unsigned bytes = 0;
-		unsigned count = MIN(size - read_number, TRANS_BLOCK_SIZE);
+		unsigned count = MIN(size - read_number, mcu_payload_max(&mcu->framing));
 
 		rc = mcu_read_block(mcu, buf + read_number, count, &bytes, USB_READ_TIMEOUT);
 		if (rc != 0) {
@@ -173,11 +211,16 @@ static int mcu_read(struct transport *trans, void *buf, unsigned size)
 		}
 
 		if (bytes == 0) {
-			if (retry-- <= 0) {
+			if (mcu_timeout(mcu, start, USB_READ_TIMEOUT) == 0) {
+				mcu->transport.stats.timeouts++;
 				errno = ETIMEDOUT;
 				return read_number;
 			}
 
+			if (transport_check(trans)) {
+				return read_number;
+			}
+
 			usleep(1000);
 		}
 
@@ -187,6 +230,37 @@ static int mcu_read(struct transport *trans, void *buf, unsigned size)
 	return read_number;
 }
 
+/*
+ * Drop what the bridge holds, one READ block per round trip until one
+ * comes back empty, instead of the read fallback that waits out the
+ * whole transfer timeout.
+ */
+static int mcu_flush(struct transport *trans)
+{
+	int i, rc;
+	unsigned bytes;
+	uint8_t buf[MCU_PACKET_MAX];
+	struct mcu_transport *mcu = container_of(trans, struct mcu_transport, transport);
+
+	for (i = 0; i < MCU_FLUSH_BLOCKS; i++) {
+		if (transport_check(trans)) {
+			return -1;
+		}
+
+		/* A nack has the bridge's status below -1, nothing to drop then */
+		rc = mcu_read_block(mcu, buf, mcu_payload_max(&mcu->framing), &bytes, USB_READ_TIMEOUT);
+		if (rc != 0) {
+			return rc == -1 ? -1 : 0;
+		}
+
+		if (bytes == 0) {
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
 static void mcu_close(struct transport *trans)
 {
 	struct mcu_transport *mcu = container_of(trans, struct mcu_transport, transport);
@@ -212,30 +286,107 @@ static int mcu_set_baudrate(struct transport *trans, unsigned speed)
 static const struct transport_ops mcu_transport_ops = {
 	.write = mcu_write,
 	.read = mcu_read,
+	.flush = mcu_flush,
 	.close = mcu_close,
 	.set_baudrate = mcu_set_baudrate,
 };
 
+/*
+ * START, offering the v2 protocol. A bridge that takes the offer acks
+ * with its version and packet size; one that refuses the longer START
+ * gets a plain v1 START. So does one whose packets would be no larger
+ * than v1's, v2 would only carry a byte less per round trip in them.
+ */
+static int mcu_start(struct mcu_transport *mcu, uint32_t baudrate)
+{
+	int rc;
+	unsigned packet;
+	uint8_t ext[3];
+	uint8_t offer[7] = {
+		baudrate & 0xff, (baudrate >> 8) & 0xff, (baudrate >> 16) & 0xff, baudrate >> 24,
+		MCU_VERSION, MCU_PACKET_MAX & 0xff, MCU_PACKET_MAX >> 8,
+	};
+
+	mcu->framing.version = 1;
+	mcu->framing.packet = MCU_V1_PACKET;
+
+	rc = mcu_command(mcu, USB_TRANS_CMD_START, offer, sizeof(offer), USB_START_TIMEOUT,
+		ext, sizeof(ext));
+	if (rc < 0) {
+		if (errno == ECANCELED || errno == ETIMEDOUT) {
+			return -1;
+		}
+
+		pr_debug("bridge refused the v2 START: %s\n", strerror(errno));
+		return mcu_write_command(mcu, USB_TRANS_CMD_START, offer, 4, USB_START_TIMEOUT);
+	}
+
+	if (rc < 3 || ext[0] < 2) {
+		pr_debug("bridge v1, %u byte packets\n", mcu->framing.packet);
+		return 0;
+	}
+
+	packet = ext[1] | ext[2] << 8;
+	if (packet < MCU_V1_PACKET || packet > MCU_PACKET_MAX) {
+		pr_err("bridge v2 packet size %u out of range\n", packet);
+		errno = EPROTO;
+		return -1;
+	}
+
+	/* START is always v1, a plain one takes the bridge back to v1 */
+	if (packet == MCU_V1_PACKET) {
+		pr_debug("bridge v2 with %u byte packets, staying on v1\n", packet);
+		return mcu_write_command(mcu, USB_TRANS_CMD_START, offer, 4, USB_START_TIMEOUT);
+	}
+
+	mcu->framing.version = 2;
+	mcu->framing.packet = packet;
+	pr_info("bridge v2, %u byte packets\n", packet);
+
+	return 0;
+}
+
+int mcu_transport_framing(struct transport *trans, unsigned *version, unsigned *packet)
+{
+	struct mcu_transport *mcu = container_of(trans, struct mcu_transport, transport);
+
+	if (trans->ops != &mcu_transport_ops) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*version = mcu->framing.version;
+	*packet = mcu->framing.packet;
+	return 0;
+}
+
 struct transport *mcu_transport_open(void *hndl,
 	void (*close)(void *hndl),
-	int (*read)(void *hndl, unsigned char id, void *buf, unsigned size),
-	int (*write)(void *hndl, unsigned char id, const void *buf, unsigned size))
+	int (*read)(void *hndl, unsigned char id, void *buf, unsigned size, unsigned timeout),
+	int (*write)(void *hndl, unsigned char id, const void *buf, unsigned size, unsigned timeout))
 {
-	int rc;
-	uint32_t baudrate = 115200;
 	struct mcu_transport *mcu;
 
-	mcu = malloc(sizeof(struct mcu_transport));
+	mcu = calloc(1, sizeof(struct mcu_transport));
+	if (mcu == NULL) {
+		if (close) {
+			close(hndl);
+		}
+		return NULL;
+	}
+
 	mcu->hndl = hndl;
 	mcu->read = read;
 	mcu->write = write;
 	mcu->close = close;
 	mcu->transport.ops = &mcu_transport_ops;
 
-	rc = mcu_write_command(mcu, USB_TRANS_CMD_START, &baudrate, 4, USB_START_TIMEOUT);
-	if (rc != 0) {
-		printf("start MP failure: %s\n", strerror(errno));
+	if (mcu_start(mcu, 115200)) {
+		int err = errno;
+
+		pr_err("start MP failure: %s\n", strerror(err));
 		mcu_close(&mcu->transport);
+		errno = err;
 		return NULL;
 	}
 
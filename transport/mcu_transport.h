@@ -12,10 +12,24 @@ extern "C" {
 #endif
 
 struct transport;
+/* @timeout is in milliseconds, already cut short by the session deadline */
 struct transport *mcu_transport_open(void *hndl,
 		void (*close)(void *hndl),
-		int (*read)(void *hndl, unsigned char id, void *buf, unsigned size),
-		int (*write)(void *hndl, unsigned char id, const void *buf, unsigned size));
+		int (*read)(void *hndl, unsigned char id, void *buf, unsigned size, unsigned timeout),
+		int (*write)(void *hndl, unsigned char id, const void *buf, unsigned size, unsigned timeout));
+
+/* The bridge protocol version and packet size @trans settled on */
+int mcu_transport_framing(struct transport *trans, unsigned *version, unsigned *packet);
+
+/* Emulated bridge quirks */
+#define MCU_EMU_NACK_LONG_START	0x01	/* refuse a START that carries the v2 offer */
+
+/*
+ * A bridge emulated in memory behind the same callbacks, speaking up to
+ * protocol @version and offering @packet byte packets in v2, whatever
+ * the host asked for. Bytes written to the target come back on read.
+ */
+struct transport *mcu_emulator_open(unsigned version, unsigned packet, unsigned quirks);
 
 #ifdef __cplusplus
 }
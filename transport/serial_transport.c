@@ -4,21 +4,64 @@
  * Copyright 2020 ZhongYao Luo
  */
 
+#define _GNU_SOURCE
 #include <stdint.h>
+#include <stdbool.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <linux/serial.h>
 #include <limits.h>
+#include <poll.h>
 #include <termios.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include "transport.h"
 #include "baudrate.h"
 #include "defs.h"
+#include "log.h"
+
+/* Longest a single read waits, callers loop up to their own timeout */
+#define SERIAL_READ_TIMEOUT	100
+
+#define SERIAL_RX_RING_MIN	4096
+
+/*
+ * Receive side drained by a reader thread into a single producer, single
+ * consumer ring. The thread owns head, serial_read() owns tail, and the
+ * consumer only makes a syscall when the ring is empty.
+ */
+struct serial_rx {
+	pthread_t thread;
+	uint8_t *ring;
+	unsigned mask;
+	atomic_uint head, tail;
+	/* transport_now_us() when the ring last went from empty to not */
+	atomic_ullong stamp;
+	atomic_int waiting;	/* consumer sleeps on wake[0] */
+	atomic_int stop;
+	atomic_int err;	/* errno the reader stopped on */
+	atomic_ullong overruns, ring_full;
+	unsigned long long overruns_seen, ring_full_seen;
+	/*
+	 * Flushes are done by the thread, between two reads, so no byte it
+	 * read before the tcflush() is published after the flush returns.
+	 * flush_head is where the ring stood at the flush flush_done acks.
+	 */
+	atomic_uint flush_req, flush_done;
+	unsigned flush_head;
+	int wake[2], ctl[2];	/* ctl[] wakes the reader to stop or flush */
+	int icount_base;	/* kernel overruns at start */
+};
 
 struct serial_transport {
 	int fd;
+	struct serial_rx *rx;
 	struct transport transport;
 };
 
@@ -45,7 +88,7 @@ static speed_t tty_get_speed(int speed)
 		_(3500000); break;
 		_(4000000); break;
 	default:
-		printf("Not support %d\n", speed);
+		pr_debug("Not support %d, use custom baudrate\n", speed);
 	break;
 	}
 #undef _
@@ -64,7 +107,7 @@ static int uart_open(const char *dev, int speed)
 
 	fd = open(dev, O_RDWR | O_NOCTTY);
 	if (fd < 0) {
-		perror(dev);
+		pr_err("%s: %s\n", dev, strerror(errno));
 		exit(1);
 	}
 
@@ -74,7 +117,7 @@ static int uart_open(const char *dev, int speed)
 	tcflush(fd, TCIOFLUSH);
 
 	if (tcgetattr(fd, &ti) < 0) {
-		perror("get port settings");
+		pr_err("get port settings: %s\n", strerror(errno));
 		exit(1);
 	}
 	cfmakeraw(&ti);
@@ -92,14 +135,14 @@ static int uart_open(const char *dev, int speed)
 	}
 
 	if (tcsetattr(fd, TCSANOW, &ti) < 0) {
-		perror("set port settings");
+		pr_err("set port settings: %s\n", strerror(errno));
 		exit(1);
 	}
 
 	tcflush(fd, TCIOFLUSH);
 	if (baudrate == -1) {
 		if (set_baudrate(fd, speed)) {
-			perror("set baudrate");
+			pr_err("set baudrate: %s\n", strerror(errno));
 			exit(1);
 		}
 	}
@@ -107,7 +150,7 @@ static int uart_open(const char *dev, int speed)
 	if (ioctl(fd, TIOCGSERIAL, &serial) == 0) {
 		serial.flags |= ASYNC_LOW_LATENCY;
 		if (ioctl(fd, TIOCSSERIAL, &serial)) {
-			perror("set serial");
+			pr_err("set serial: %s\n", strerror(errno));
 		}
 	}
 
@@ -126,15 +169,18 @@ static int uart_set_baudrate(int fd, unsigned speed)
 		cfsetospeed(&ti, baudrate);
 	}
 
-	if (tcsetattr(fd, TCSANOW, &ti) < 0) {
-		perror("set port settings");
+	/*
+	 * Let queued output go out at the old speed, and keep the input:
+	 * the first bytes at the new speed may already be on their way.
+	 */
+	if (tcsetattr(fd, TCSADRAIN, &ti) < 0) {
+		pr_err("set port settings: %s\n", strerror(errno));
 		return -1;
 	}
 
-	tcflush(fd, TCIOFLUSH);
 	if (baudrate == -1) {
 		if (set_baudrate(fd, speed)) {
-			perror("set baudrate");
+			pr_err("set baudrate: %s\n", strerror(errno));
 			return -1;
 		}
 	}
@@ -142,6 +188,276 @@ static int uart_set_baudrate(int fd, unsigned speed)
 	return 0;
 }
 
+/* Overruns the UART driver and the tty layer counted, -1 if it can't tell */
+static int uart_overruns(int fd)
+{
+	struct serial_icounter_struct icount;
+
+	if (ioctl(fd, TIOCGICOUNT, &icount)) {
+		return -1;
+	}
+
+	return icount.overrun + icount.buf_overrun;
+}
+
+static void serial_rx_wake(struct serial_rx *rx)
+{
+	char c = 0;
+
+	if (atomic_exchange(&rx->waiting, 0)) {
+		if (write(rx->wake[1], &c, 1) < 0)
+			;
+	}
+}
+
+static void serial_rx_drain(int fd)
+{
+	char c[16];
+
+	while (read(fd, c, sizeof(c)) > 0)
+		;
+}
+
+static void *serial_rx_thread(void *arg)
+{
+	int rc;
+	bool full = false;
+	unsigned head, tail, room, req;
+	struct serial_transport *ser = arg;
+	struct serial_rx *rx = ser->rx;
+	struct pollfd pfd[2] = {
+		{ .fd = ser->fd, .events = POLLIN },
+		{ .fd = rx->ctl[0], .events = POLLIN },
+	};
+
+	while (!atomic_load(&rx->stop)) {
+		head = atomic_load_explicit(&rx->head, memory_order_relaxed);
+
+		/* Everything read so far is published, drop the rest at the source */
+		req = atomic_load_explicit(&rx->flush_req, memory_order_acquire);
+		if (req != atomic_load_explicit(&rx->flush_done, memory_order_relaxed)) {
+			serial_rx_drain(rx->ctl[0]);
+			tcflush(ser->fd, TCIFLUSH);
+			rx->flush_head = head;
+			atomic_store_explicit(&rx->flush_done, req, memory_order_release);
+			serial_rx_wake(rx);
+		}
+
+		tail = atomic_load_explicit(&rx->tail, memory_order_acquire);
+		room = rx->mask + 1 - (head - tail);
+
+		/* Leave the bytes to the tty buffer until the consumer catches up */
+		if (room == 0) {
+			full = true;
+			if (poll(&pfd[1], 1, 1) > 0)
+				serial_rx_drain(rx->ctl[0]);
+			continue;
+		}
+
+		/* Once per stall, not once per poll spent waiting it out */
+		if (full) {
+			atomic_fetch_add(&rx->ring_full, 1);
+			full = false;
+		}
+
+		rc = poll(pfd, 2, SERIAL_READ_TIMEOUT);
+		if (rc < 0 && errno != EINTR) {
+			break;
+		}
+
+		if (rc > 0 && (pfd[1].revents & POLLIN)) {
+			serial_rx_drain(rx->ctl[0]);
+			continue;
+		}
+
+		if (rc <= 0 || !(pfd[0].revents & (POLLIN | POLLERR | POLLHUP))) {
+			rc = uart_overruns(ser->fd);
+			if (rc >= 0 && rx->icount_base >= 0) {
+				atomic_store(&rx->overruns, rc - rx->icount_base);
+			}
+			continue;
+		}
+
+		/* Straight into the ring, up to where it wraps */
+		room = MIN(room, rx->mask + 1 - (head & rx->mask));
+		rc = read(ser->fd, rx->ring + (head & rx->mask), room);
+		if (rc < 0 && (errno == EINTR || errno == EAGAIN)) {
+			continue;
+		}
+
+		if (rc <= 0) {
+			atomic_store(&rx->err, rc < 0 ? errno : EIO);
+			break;
+		}
+
+		/* The consumer may have emptied the ring while the poll blocked */
+		tail = atomic_load_explicit(&rx->tail, memory_order_acquire);
+		if (head == tail) {
+			atomic_store_explicit(&rx->stamp, transport_now_us(), memory_order_relaxed);
+		}
+		atomic_store_explicit(&rx->head, head + rc, memory_order_release);
+		serial_rx_wake(rx);
+	}
+
+	if (atomic_load(&rx->err) == 0 && !atomic_load(&rx->stop)) {
+		atomic_store(&rx->err, errno ? errno : EIO);
+	}
+	atomic_store(&rx->waiting, 1);
+	serial_rx_wake(rx);
+
+	return NULL;
+}
+
+/* Move what the reader thread counted into the transport stats */
+static void serial_rx_stats(struct serial_transport *ser)
+{
+	struct serial_rx *rx = ser->rx;
+	unsigned long long n;
+
+	n = atomic_load(&rx->overruns);
+	ser->transport.stats.rx_overruns += n - rx->overruns_seen;
+	rx->overruns_seen = n;
+
+	n = atomic_load(&rx->ring_full);
+	ser->transport.stats.rx_ring_full += n - rx->ring_full_seen;
+	rx->ring_full_seen = n;
+}
+
+static int serial_rx_read(struct serial_transport *ser, void *buf, unsigned size)
+{
+	unsigned head, tail, n, first;
+	struct serial_rx *rx = ser->rx;
+	struct pollfd pfd = { .fd = rx->wake[0], .events = POLLIN };
+
+	serial_rx_stats(ser);
+
+	tail = atomic_load_explicit(&rx->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&rx->head, memory_order_acquire);
+	if (head == tail) {
+		/* Announce the wait, then look again so a push in between is not missed */
+		atomic_store(&rx->waiting, 1);
+		head = atomic_load_explicit(&rx->head, memory_order_acquire);
+		if (head == tail) {
+			if (atomic_load(&rx->err)) {
+				errno = atomic_load(&rx->err);
+				return -1;
+			}
+
+			poll(&pfd, 1, transport_wait_ms(&ser->transport, SERIAL_READ_TIMEOUT));
+			serial_rx_drain(rx->wake[0]);
+			head = atomic_load_explicit(&rx->head, memory_order_acquire);
+		}
+		atomic_store(&rx->waiting, 0);
+
+		if (head == tail) {
+			return 0;
+		}
+	}
+
+	transport_latency_add(&ser->transport.stats.rx_drain_latency,
+		transport_now_us() - atomic_load_explicit(&rx->stamp, memory_order_relaxed));
+
+	n = MIN(size, head - tail);
+	first = MIN(n, rx->mask + 1 - (tail & rx->mask));
+	memcpy(buf, rx->ring + (tail & rx->mask), first);
+	memcpy((uint8_t *)buf + first, rx->ring, n - first);
+	atomic_store_explicit(&rx->tail, tail + n, memory_order_release);
+
+	return n;
+}
+
+static void serial_rx_stop(struct serial_transport *ser)
+{
+	struct serial_rx *rx = ser->rx;
+	char c = 0;
+
+	atomic_store(&rx->stop, 1);
+	if (write(rx->ctl[1], &c, 1) < 0)
+		;
+	pthread_join(rx->thread, NULL);
+
+	close(rx->wake[0]);
+	close(rx->wake[1]);
+	close(rx->ctl[0]);
+	close(rx->ctl[1]);
+	free(rx->ring);
+	free(rx);
+	ser->rx = NULL;
+}
+
+static int serial_rx_start(struct serial_transport *ser, unsigned ring, int cpu)
+{
+	int rc;
+	unsigned size = SERIAL_RX_RING_MIN;
+	struct serial_rx *rx;
+	pthread_attr_t attr;
+	cpu_set_t set;
+
+	while (size < ring && size < (1U << 30))
+		size <<= 1;
+
+	rx = calloc(1, sizeof(struct serial_rx));
+	if (rx == NULL) {
+		return -1;
+	}
+
+	rx->ring = malloc(size);
+	if (rx->ring == NULL) {
+		free(rx);
+		return -1;
+	}
+
+	if (pipe(rx->wake)) {
+		free(rx->ring);
+		free(rx);
+		return -1;
+	}
+
+	if (pipe(rx->ctl)) {
+		close(rx->wake[0]);
+		close(rx->wake[1]);
+		free(rx->ring);
+		free(rx);
+		return -1;
+	}
+
+	fcntl(rx->wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(rx->wake[1], F_SETFL, O_NONBLOCK);
+	fcntl(rx->ctl[0], F_SETFL, O_NONBLOCK);
+	rx->mask = size - 1;
+	rx->icount_base = uart_overruns(ser->fd);
+	ser->rx = rx;
+
+	/* Pinned from its first instruction, so it never migrates mid burst */
+	pthread_attr_init(&attr);
+	if (cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+
+	rc = pthread_create(&rx->thread, &attr, serial_rx_thread, ser);
+	if (rc && cpu >= 0) {
+		pr_warn("pin serial reader to cpu %d: %s\n", cpu, strerror(rc));
+		rc = pthread_create(&rx->thread, NULL, serial_rx_thread, ser);
+	}
+	pthread_attr_destroy(&attr);
+	if (rc) {
+		close(rx->wake[0]);
+		close(rx->wake[1]);
+		close(rx->ctl[0]);
+		close(rx->ctl[1]);
+		free(rx->ring);
+		free(rx);
+		ser->rx = NULL;
+		errno = rc;
+		return -1;
+	}
+
+	pr_debug("serial reader thread, %u byte ring\n", size);
+	return 0;
+}
+
 static int serial_write(struct transport *trans, const void *buf, unsigned size)
 {
 	struct serial_transport *ser = container_of(trans, struct serial_transport, transport);
@@ -151,15 +467,93 @@ static int serial_write(struct transport *trans, const void *buf, unsigned size)
 
 static int serial_read(struct transport *trans, void *buf, unsigned size)
 {
+	int rc;
+	struct pollfd pfd;
 	struct serial_transport *ser = container_of(trans, struct serial_transport, transport);
 
+	if (ser->rx) {
+		return serial_rx_read(ser, buf, size);
+	}
+
+	pfd.fd = ser->fd;
+	pfd.events = POLLIN;
+	rc = poll(&pfd, 1, transport_wait_ms(trans, SERIAL_READ_TIMEOUT));
+	if (rc <= 0) {
+		return rc;
+	}
+
 	return read(ser->fd, buf, size);
 }
 
+/*
+ * Have the reader flush between two of its reads and wait for it, then
+ * drop what the ring held up to that point. Bytes it reads after that
+ * arrived after the flush.
+ */
+static int serial_rx_flush(struct serial_transport *ser)
+{
+	char c = 0;
+	unsigned req;
+	struct serial_rx *rx = ser->rx;
+	struct pollfd pfd = { .fd = rx->wake[0], .events = POLLIN };
+	unsigned long long end = transport_now_us() + SERIAL_READ_TIMEOUT * 1000ULL;
+
+	req = atomic_fetch_add(&rx->flush_req, 1) + 1;
+	if (write(rx->ctl[1], &c, 1) < 0)
+		;
+
+	while (atomic_load_explicit(&rx->flush_done, memory_order_acquire) != req) {
+		/* Announce the wait, then look again so an ack in between is not missed */
+		atomic_store(&rx->waiting, 1);
+		if (atomic_load_explicit(&rx->flush_done, memory_order_acquire) == req)
+			break;
+
+		/* The reader is gone, nothing races the flush any more */
+		if (atomic_load(&rx->err)) {
+			atomic_store(&rx->waiting, 0);
+			atomic_store_explicit(&rx->tail,
+				atomic_load_explicit(&rx->head, memory_order_acquire),
+				memory_order_release);
+			return tcflush(ser->fd, TCIFLUSH);
+		}
+
+		if (transport_now_us() >= end) {
+			atomic_store(&rx->waiting, 0);
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		poll(&pfd, 1, transport_wait_ms(&ser->transport, (end - transport_now_us()) / 1000 + 1));
+		serial_rx_drain(rx->wake[0]);
+		if (transport_check(&ser->transport)) {
+			atomic_store(&rx->waiting, 0);
+			return -1;
+		}
+	}
+	atomic_store(&rx->waiting, 0);
+
+	atomic_store_explicit(&rx->tail, rx->flush_head, memory_order_release);
+	return 0;
+}
+
+static int serial_flush(struct transport *trans)
+{
+	struct serial_transport *ser = container_of(trans, struct serial_transport, transport);
+
+	if (ser->rx) {
+		return serial_rx_flush(ser);
+	}
+
+	return tcflush(ser->fd, TCIFLUSH);
+}
+
 static void serial_close(struct transport *trans)
 {
 	struct serial_transport *ser = container_of(trans, struct serial_transport, transport);
 
+	if (ser->rx) {
+		serial_rx_stop(ser);
+	}
 	close(ser->fd);
 	free(ser);
 }
@@ -174,6 +568,7 @@ static int serial_set_baudrate(struct transport *trans, unsigned speed)
 static const struct transport_ops serial_transport_ops = {
 	.write = serial_write,
 	.read = serial_read,
+	.flush = serial_flush,
 	.close = serial_close,
 	.set_baudrate = serial_set_baudrate,
 };
@@ -188,10 +583,35 @@ struct transport *serial_transport_open(const char *dev, unsigned speed)
 		return NULL;
 	}
 
-	ser = malloc(sizeof(struct serial_transport));
+	ser = calloc(1, sizeof(struct serial_transport));
 
 	ser->transport.ops = &serial_transport_ops;
 	ser->fd = fd;
 
 	return &ser->transport;
 }
+
+/*
+ * As serial_transport_open(), with a reader thread draining the port into
+ * a @ring byte ring so pauses between reads don't overrun the UART at
+ * 3-4 Mbaud, where flow control is off. @cpu pins the thread, -1 for any.
+ */
+struct transport *serial_transport_open_rx(const char *dev, unsigned speed, unsigned ring, int cpu)
+{
+	struct transport *trans;
+	struct serial_transport *ser;
+
+	trans = serial_transport_open(dev, speed);
+	if (trans == NULL) {
+		return NULL;
+	}
+
+	ser = container_of(trans, struct serial_transport, transport);
+	if (serial_rx_start(ser, ring, cpu)) {
+		pr_err("serial reader thread: %s\n", strerror(errno));
+		serial_close(trans);
+		return NULL;
+	}
+
+	return trans;
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ *
+ * SPDX-License-Identifier:
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "transport.h"
+
+static const unsigned long long latency_bounds[TRANSPORT_LATENCY_BUCKETS - 1] = {
+	50, 100, 250, 500,
+	1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+	1000000, 2500000,
+};
+
+unsigned long long transport_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+unsigned long long transport_wall_us(unsigned long long now_us)
+{
+	struct timespec ts;
+	unsigned long long wall, now;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	wall = (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	now = transport_now_us();
+
+	return wall - (now - now_us);
+}
+
+void transport_latency_add(struct transport_latency *lat, unsigned long long us)
+{
+	int i;
+
+	for (i = 0; i < TRANSPORT_LATENCY_BUCKETS - 1; i++) {
+		if (us <= latency_bounds[i])
+			break;
+	}
+
+	lat->bucket[i]++;
+	lat->count++;
+	lat->sum_us += us;
+}
+
+const struct transport_stats *transport_get_stats(struct transport *trans)
+{
+	return &trans->stats;
+}
+
+void transport_reset_stats(struct transport *trans)
+{
+	memset(&trans->stats, 0, sizeof(trans->stats));
+}
+
+static void export_counter(FILE *fp, const char *name, const char *help,
+	const char *label, unsigned long long value)
+{
+	fprintf(fp, "# HELP mptool_transport_%s %s\n", name, help);
+	fprintf(fp, "# TYPE mptool_transport_%s counter\n", name);
+	fprintf(fp, "mptool_transport_%s{transport=\"%s\"} %llu\n", name, label, value);
+}
+
+static void export_latency(FILE *fp, const char *name, const char *help,
+	const char *label, const struct transport_latency *lat)
+{
+	int i;
+	unsigned long long cumulative = 0;
+
+	fprintf(fp, "# HELP mptool_transport_%s %s\n", name, help);
+	fprintf(fp, "# TYPE mptool_transport_%s histogram\n", name);
+	for (i = 0; i < TRANSPORT_LATENCY_BUCKETS - 1; i++) {
+		cumulative += lat->bucket[i];
+		fprintf(fp, "mptool_transport_%s_bucket{transport=\"%s\",le=\"%g\"} %llu\n",
+			name, label, latency_bounds[i] / 1e6, cumulative);
+	}
+	fprintf(fp, "mptool_transport_%s_bucket{transport=\"%s\",le=\"+Inf\"} %llu\n",
+		name, label, lat->count);
+	fprintf(fp, "mptool_transport_%s_sum{transport=\"%s\"} %g\n",
+		name, label, lat->sum_us / 1e6);
+	fprintf(fp, "mptool_transport_%s_count{transport=\"%s\"} %llu\n",
+		name, label, lat->count);
+}
+
+/*
+ * Write the counters in Prometheus text format. The file is written next
+ * to @path and renamed over it, so a scraper never sees a partial file.
+ */
+int transport_stats_export(struct transport *trans, const char *path, const char *label)
+{
+	FILE *fp;
+	char tmp[1024];
+	const struct transport_stats *st = &trans->stats;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		return -1;
+	}
+
+	export_counter(fp, "bytes_in_total", "Bytes read from the transport", label, st->bytes_in);
+	export_counter(fp, "bytes_out_total", "Bytes written to the transport", label, st->bytes_out);
+	export_counter(fp, "reads_total", "Read calls", label, st->reads);
+	export_counter(fp, "writes_total", "Write calls", label, st->writes);
+	export_counter(fp, "zero_reads_total", "Read calls that returned no data", label, st->zero_reads);
+	export_counter(fp, "retries_total", "Retried reads", label, st->retries);
+	export_counter(fp, "timeouts_total", "Operations that timed out", label, st->timeouts);
+	export_counter(fp, "errors_total", "Read or write calls that failed", label, st->errors);
+	export_counter(fp, "frame_errors_total", "Responses dropped for a bad CRC or command", label, st->frame_errors);
+	export_counter(fp, "round_trips_total", "Bridge command round trips", label, st->round_trips);
+	export_counter(fp, "ack_retries_total", "Bridge acks that did not match the command", label, st->ack_retries);
+	export_counter(fp, "rx_overruns_total", "Receive overruns the UART driver counted", label, st->rx_overruns);
+	export_counter(fp, "rx_ring_full_total", "Times the serial reader stalled on a full ring", label, st->rx_ring_full);
+	export_counter(fp, "faults_injected_total", "Faults the fault transport injected", label, st->faults);
+	export_latency(fp, "read_latency_seconds", "Read call latency", label, &st->read_latency);
+	export_latency(fp, "write_latency_seconds", "Write call latency", label, &st->write_latency);
+	export_latency(fp, "rx_drain_latency_seconds", "Time received bytes waited in the serial ring", label, &st->rx_drain_latency);
+
+	if (fclose(fp) != 0) {
+		remove(tmp);
+		return -1;
+	}
+
+#if defined(__WIN32__)
+	remove(path);
+#endif
+	if (rename(tmp, path) != 0) {
+		remove(tmp);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ *
+ * SPDX-License-Identifier:
+ */
+
+/*
+ * Bridge protocol negotiation against the emulated bridge: what each
+ * kind of bridge settles on, and that writes come back intact through
+ * the loopback in the framing settled on.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "transport.h"
+#include "mcu_transport.h"
+#include "mcu_protocol.h"
+
+struct negotiate_case {
+	const char *name;
+	unsigned version, packet, quirks;
+	/* Settled on, version 0 when the open has to fail */
+	unsigned want_version, want_packet;
+};
+
+static const struct negotiate_case cases[] = {
+	{ "v1 bridge", 1, MCU_V1_PACKET, 0, 1, MCU_V1_PACKET },
+	{ "v1 bridge, nacks the long START", 1, MCU_V1_PACKET, MCU_EMU_NACK_LONG_START,
+		1, MCU_V1_PACKET },
+	{ "v2 bridge, 512 byte packets", 2, 512, 0, 2, 512 },
+	{ "v2 bridge, 128 byte packets", 2, 128, 0, 2, 128 },
+	{ "v2 bridge, 64 byte packets", 2, MCU_V1_PACKET, 0, 1, MCU_V1_PACKET },
+	{ "v2 bridge, packet too small", 2, 32, 0, 0, 0 },
+	{ "v2 bridge, packet too large", 2, 1024, 0, 0, 0 },
+};
+
+/* Write @size bytes and read them back through the loopback */
+static int loopback(struct transport *trans, unsigned size)
+{
+	int rz;
+	unsigned i, have = 0;
+	uint8_t out[3000], in[3000];
+
+	for (i = 0; i < size; i++) {
+		out[i] = i * 7 + 1;
+	}
+
+	if (transport_write(trans, out, size) != (int)size) {
+		return -1;
+	}
+
+	while (have < size) {
+		rz = transport_read(trans, in + have, size - have);
+		if (rz <= 0) {
+			return -1;
+		}
+		have += rz;
+	}
+
+	return memcmp(in, out, size) ? -1 : 0;
+}
+
+static int run(const struct negotiate_case *c)
+{
+	int rc = 0;
+	unsigned version, packet;
+	struct transport *trans;
+
+	trans = mcu_emulator_open(c->version, c->packet, c->quirks);
+	if (trans == NULL) {
+		if (c->want_version == 0 && errno == EPROTO) {
+			return 0;
+		}
+		printf("%s: open failed: %s\n", c->name, strerror(errno));
+		return -1;
+	}
+
+	if (c->want_version == 0) {
+		printf("%s: opened, expected a refusal\n", c->name);
+		transport_close(trans);
+		return -1;
+	}
+
+	if (mcu_transport_framing(trans, &version, &packet) ||
+		version != c->want_version || packet != c->want_packet) {
+		printf("%s: v%u, %u byte packets, expected v%u, %u\n", c->name,
+			version, packet, c->want_version, c->want_packet);
+		rc = -1;
+	} else if (loopback(trans, 1) || loopback(trans, 3000)) {
+		printf("%s: loopback: %s\n", c->name, strerror(errno));
+		rc = -1;
+	}
+
+	transport_close(trans);
+	return rc;
+}
+
+int main(void)
+{
+	unsigned i, failed = 0;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		if (run(&cases[i])) {
+			failed++;
+		} else {
+			printf("%s: ok\n", cases[i].name);
+		}
+	}
+
+	return failed ? 1 : 0;
+}
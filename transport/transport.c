@@ -8,14 +8,102 @@
 #include <string.h>
 #include <stddef.h>
 #include "transport.h"
+#include "defs.h"
+#include "hidapi_transport.h"
 
 struct transport *serial_transport_open(const char *dev, unsigned speed);
+struct transport *serial_transport_open_rx(const char *dev, unsigned speed, unsigned ring, int cpu);
 struct transport *usb_transport_open(uint16_t vid, uint16_t pid, int iface, unsigned flags);
-struct transport *hidapi_transport_open(uint16_t vid, uint16_t pid);
+
+void transport_cancel_init(struct transport_cancel *cancel, unsigned timeout_ms)
+{
+	atomic_init(&cancel->cancelled, 0);
+	cancel->deadline = timeout_ms ? transport_now_us() + timeout_ms * 1000ULL : 0;
+	cancel->parent = NULL;
+}
+
+/* May be called from any thread */
+void transport_cancel(struct transport_cancel *cancel)
+{
+	atomic_store(&cancel->cancelled, 1);
+}
+
+void transport_set_cancel(struct transport *trans, struct transport_cancel *cancel)
+{
+	trans->cancel = cancel;
+}
+
+int transport_check(struct transport *trans)
+{
+	struct transport_cancel *c;
+
+	for (c = trans->cancel; c; c = c->parent) {
+		if (atomic_load(&c->cancelled)) {
+			errno = ECANCELED;
+			return -1;
+		}
+
+		if (c->deadline && transport_now_us() >= c->deadline) {
+			trans->stats.timeouts++;
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* @ms, cut short by the session deadline */
+unsigned transport_wait_ms(struct transport *trans, unsigned ms)
+{
+	unsigned long long now = 0;
+	struct transport_cancel *c;
+
+	for (c = trans->cancel; c; c = c->parent) {
+		if (c->deadline == 0)
+			continue;
+
+		if (now == 0)
+			now = transport_now_us();
+		if (now >= c->deadline)
+			return 0;
+
+		ms = MIN(ms, (c->deadline - now + 999) / 1000);
+	}
+
+	return ms;
+}
+
+/*
+ * Drop pending input, so the next read starts on a fresh response.
+ * Backends without a flush op are drained until a read comes back empty.
+ */
+int transport_flush(struct transport *trans)
+{
+	int rc;
+	uint8_t buf[256];
+
+	if (trans->ops && trans->ops->flush)
+		return trans->ops->flush(trans);
+
+	while ((rc = transport_read(trans, buf, sizeof(buf))) > 0)
+		;
+
+	return rc;
+}
 
 struct transport *transport_open(const char *transport_name, union transport_param *param)
 {
 	if (!strcmp(transport_name, TRANSPORT_IFACE_HIDAPI)) {
+		if (param->hidapi.path) {
+			return hidapi_transport_open_path(param->hidapi.path);
+		}
+
+		if (param->hidapi.serial) {
+			return hidapi_transport_open_serial(param->hidapi.vid, param->hidapi.pid,
+				param->hidapi.serial);
+		}
+
 		return hidapi_transport_open(param->hidapi.vid, param->hidapi.pid);
 	}
 
@@ -25,6 +113,11 @@ struct transport *transport_open(const char *transport_name, union transport_par
 	}
 
 	if (!strcmp(transport_name, TRANSPORT_IFACE_SERAIL)) {
+		if (param->serial.rx_ring) {
+			return serial_transport_open_rx(param->serial.tty, param->serial.speed,
+				param->serial.rx_ring, param->serial.rx_cpu);
+		}
+
 		return serial_transport_open(param->serial.tty, param->serial.speed);
 	}
 
@@ -8,19 +8,82 @@
 #define __TRANSPORT_H__
 
 #include <errno.h>
+#include <stdatomic.h>
 
 struct transport;
 struct transport_ops {
 	int (*set_baudrate)(struct transport *trans, unsigned speed);
 	int (*read)(struct transport *trans, void *buf, unsigned size);
 	int (*write)(struct transport *trans, const void *buf, unsigned size);
+	/* Optional, drop pending input */
+	int (*flush)(struct transport *trans);
 	void (*close)(struct transport *trnas);
 };
 
+/* Latency buckets are upper bounds in microseconds, the last one is +Inf */
+#define TRANSPORT_LATENCY_BUCKETS	16
+
+struct transport_latency {
+	unsigned long long count;
+	unsigned long long sum_us;
+	unsigned long long bucket[TRANSPORT_LATENCY_BUCKETS];
+};
+
+struct transport_stats {
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	unsigned long long reads;
+	unsigned long long writes;
+	unsigned long long zero_reads;
+	unsigned long long retries;
+	unsigned long long timeouts;
+	unsigned long long errors;
+	/* Responses dropped for a bad CRC or an unexpected command */
+	unsigned long long frame_errors;
+	/* Bridge (mcu_transport) only */
+	unsigned long long round_trips;
+	unsigned long long ack_retries;
+	/* Serial reader thread only */
+	unsigned long long rx_overruns;
+	unsigned long long rx_ring_full;
+	/* Fault transport only */
+	unsigned long long faults;
+	struct transport_latency read_latency;
+	struct transport_latency write_latency;
+	/* How long received bytes waited in the ring for a read */
+	struct transport_latency rx_drain_latency;
+};
+
+/*
+ * Session deadline and cancellation token. Once attached to a transport
+ * every read and write fails with ETIMEDOUT past the deadline or with
+ * ECANCELED after transport_cancel(), and backends bound their waits by
+ * what is left of the deadline.
+ */
+struct transport_cancel {
+	atomic_int cancelled;
+	unsigned long long deadline;	/* transport_now_us() based, 0 = none */
+	struct transport_cancel *parent;	/* checked too, e.g. the host's token */
+};
+
 struct transport {
 	const struct transport_ops *ops;
+	struct transport_stats stats;
+	struct transport_cancel *cancel;
 };
 
+unsigned long long transport_now_us(void);
+/* Wall clock us since the epoch at transport_now_us() time @now_us */
+unsigned long long transport_wall_us(unsigned long long now_us);
+void transport_latency_add(struct transport_latency *lat, unsigned long long us);
+
+void transport_cancel_init(struct transport_cancel *cancel, unsigned timeout_ms);
+void transport_cancel(struct transport_cancel *cancel);
+void transport_set_cancel(struct transport *trans, struct transport_cancel *cancel);
+int transport_check(struct transport *trans);
+unsigned transport_wait_ms(struct transport *trans, unsigned ms);
+int transport_flush(struct transport *trans);
+
 static inline int transport_set_baudrate(struct transport *trans, unsigned speed)
 {
 	if (trans->ops && trans->ops->set_baudrate)
@@ -32,8 +95,23 @@ static inline int transport_set_baudrate(struct transport *trans, unsigned speed
 
 static inline int transport_write(struct transport *trans, const void *buf, unsigned size)
 {
-	if (trans->ops && trans->ops->write)
-		return trans->ops->write(trans, buf, size);
+	if (transport_check(trans))
+		return -1;
+
+	if (trans->ops && trans->ops->write) {
+		int rc;
+		unsigned long long start = transport_now_us();
+
+		rc = trans->ops->write(trans, buf, size);
+		transport_latency_add(&trans->stats.write_latency, transport_now_us() - start);
+		trans->stats.writes++;
+		if (rc > 0)
+			trans->stats.bytes_out += rc;
+		else if (rc < 0)
+			trans->stats.errors++;
+
+		return rc;
+	}
 
 	errno = -ENOSYS;
 	return -1;
@@ -41,8 +119,25 @@ static inline int transport_write(struct transport *trans, const void *buf, unsi
 
 static inline int transport_read(struct transport *trans, void *buf, unsigned size)
 {
-	if (trans->ops && trans->ops->read)
-		return trans->ops->read(trans, buf, size);
+	if (transport_check(trans))
+		return -1;
+
+	if (trans->ops && trans->ops->read) {
+		int rc;
+		unsigned long long start = transport_now_us();
+
+		rc = trans->ops->read(trans, buf, size);
+		transport_latency_add(&trans->stats.read_latency, transport_now_us() - start);
+		trans->stats.reads++;
+		if (rc > 0)
+			trans->stats.bytes_in += rc;
+		else if (rc == 0)
+			trans->stats.zero_reads++;
+		else
+			trans->stats.errors++;
+
+		return rc;
+	}
 
 	errno = -ENOSYS;
 	return -1;
@@ -62,6 +157,7 @@ static inline int transport_close(struct transport *trans)
 #define TRANSPORT_IFACE_LIBUSB	"libusb"
 #define TRANSPORT_IFACE_HIDAPI	"hidapi"
 #define TRANSPORT_IFACE_SERAIL	"serial"
+#define TRANSPORT_IFACE_EMULATOR	"emulator"
 
 union transport_param {
 	struct {
@@ -71,15 +167,24 @@ union transport_param {
 
 	struct {
 		unsigned short vid, pid;
+		/* Pick one of several bridges, NULL for the first match */
+		const char *path, *serial;
 	} hidapi;
 
 	struct {
 		const char *tty;
 		unsigned speed;
+		/* Ring size for a reader thread draining the port, 0 for none */
+		unsigned rx_ring;
+		int rx_cpu;	/* pin the reader, -1 for any */
 	} serial;
 };
 
 struct transport *transport_open(const char *transport_name, union transport_param *param);
 
+const struct transport_stats *transport_get_stats(struct transport *trans);
+void transport_reset_stats(struct transport *trans);
+int transport_stats_export(struct transport *trans, const char *path, const char *instance);
+
 #endif /* __TRANSPORT_H__*/
 
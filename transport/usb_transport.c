@@ -2,12 +2,18 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+#include "transport.h"
 #include "mcu_transport.h"
+#include "usb_transport.h"
+#include "log.h"
 #include <libusb-1.0/libusb.h>
 
-#define USB_TRANS_TIMEOUT	2000
 #define FLAG_AUTO_DETACH_KERNEL_DRIVER	0x0001
 
 struct usb_context {
@@ -30,8 +36,8 @@ static int hotplug_arrived_callback(libusb_context *ctx, libusb_device *dev,
 
 		rc = libusb_open(dev, hndl);
 		if (LIBUSB_SUCCESS != rc) {
-			printf("libusb_open: %s\n", libusb_strerror(rc));
-			exit(1);
+			pr_err("libusb_open: %s\n", libusb_strerror(rc));
+			*hndl = NULL;
 		}
 	}
 
@@ -46,20 +52,35 @@ static int usb_init(int usb_log_level)
 #if defined(__WIN32__)
 	rc = libusb_set_option(NULL, LIBUSB_OPTION_USE_USBDK);
 	if (rc != LIBUSB_SUCCESS) {
-		printf("libusb_set_option(LIBUSB_OPTION_USE_USBDK): %s\n", libusb_strerror(rc));
+		pr_err("libusb_set_option(LIBUSB_OPTION_USE_USBDK): %s\n", libusb_strerror(rc));
 	}
 #endif
 
 	if (usb_log_level >= LIBUSB_LOG_LEVEL_NONE && usb_log_level <= LIBUSB_LOG_LEVEL_DEBUG) {
 		rc = libusb_set_option(NULL, LIBUSB_OPTION_LOG_LEVEL, usb_log_level);
 		if (rc != LIBUSB_SUCCESS) {
-			printf("libusb_set_option(LIBUSB_OPTION_LOG_LEVEL): %s\n", libusb_strerror(rc));
+			pr_err("libusb_set_option(LIBUSB_OPTION_LOG_LEVEL): %s\n", libusb_strerror(rc));
 		}
 	}
 
 	return 0;
 }
 
+static int usb_claim(libusb_device_handle *hndl, int iface, int flags, int *res)
+{
+	if (flags & FLAG_AUTO_DETACH_KERNEL_DRIVER) {
+		libusb_set_auto_detach_kernel_driver(hndl, 1);
+	}
+
+	*res = libusb_claim_interface(hndl, iface);
+	if (*res != LIBUSB_SUCCESS) {
+		libusb_close(hndl);
+		return -1;
+	}
+
+	return 0;
+}
+
 static libusb_device_handle *usb_open_timeout(uint16_t vid, uint16_t pid,
 	int iface, uint32_t ms, int *res, int flags)
 {
@@ -85,42 +106,36 @@ static libusb_device_handle *usb_open_timeout(uint16_t vid, uint16_t pid,
 	}
 #endif
 
-	if (hndl != NULL) {
-		if (flags & FLAG_AUTO_DETACH_KERNEL_DRIVER) {
-			libusb_set_auto_detach_kernel_driver(hndl, 1);
-		}
-
-		*res = libusb_claim_interface(hndl, iface);
-		if (*res != LIBUSB_SUCCESS) {
-			libusb_close(hndl);
-			return NULL;
-		}
+	if (hndl != NULL && usb_claim(hndl, iface, flags, res)) {
+		return NULL;
 	}
 
 	return hndl;
 }
 
-static int usb_read(void *hndl, unsigned char id, void *buf, unsigned size)
+static int usb_read(void *hndl, unsigned char id, void *buf, unsigned size, unsigned timeout)
 {
 	struct usb_context *usb = hndl;
 	int rc, trans_number;
 
-	rc = libusb_interrupt_transfer(usb->hndl, id, buf, size, &trans_number, USB_TRANS_TIMEOUT);
+	rc = libusb_interrupt_transfer(usb->hndl, id, buf, size, &trans_number, timeout);
 	if (rc != 0) {
+		errno = rc == LIBUSB_ERROR_TIMEOUT ? ETIMEDOUT : EIO;
 		return -1;
 	}
 
 	return trans_number;
 }
 
-static int usb_write(void *hndl, unsigned char id, const void *buf, unsigned size)
+static int usb_write(void *hndl, unsigned char id, const void *buf, unsigned size, unsigned timeout)
 {
 	struct usb_context *usb = hndl;
 	int rc, trans_number;
 
-	rc = libusb_interrupt_transfer(usb->hndl, id, (void*)buf, size, &trans_number, USB_TRANS_TIMEOUT);
+	rc = libusb_interrupt_transfer(usb->hndl, id, (void*)buf, size, &trans_number, timeout);
 	if (rc != 0) {
-		printf("libusb_write: %s\n", libusb_strerror(rc));
+		pr_err("libusb_write: %s\n", libusb_strerror(rc));
+		errno = rc == LIBUSB_ERROR_TIMEOUT ? ETIMEDOUT : EIO;
 		return -1;
 	}
 
@@ -140,12 +155,23 @@ static void usb_close(void *user_data)
 	free(usb);
 }
 
+/* Takes over @hndl and one libusb_init() reference, both dropped by usb_close() */
+static struct transport *usb_transport_wrap(libusb_device_handle *hndl, int iface, unsigned flags)
+{
+	struct usb_context *usb;
+
+	usb = malloc(sizeof(struct usb_context));
+	usb->hndl = hndl;
+	usb->flags = flags;
+	usb->iface = iface;
+
+	return mcu_transport_open(usb, usb_close, usb_read, usb_write);
+}
+
 struct transport *usb_transport_open(uint16_t vid, uint16_t pid, int iface, unsigned flags)
 {
 	int rc;
-	uint32_t baudrate = 115200;
 	libusb_device_handle *hndl;
-	struct usb_context *usb;
 
 	usb_init(LIBUSB_LOG_LEVEL_NONE);
 	hndl = usb_open_timeout(vid, pid, iface, 10 * 1000, &rc, flags);
@@ -154,10 +180,279 @@ struct transport *usb_transport_open(uint16_t vid, uint16_t pid, int iface, unsi
 		return NULL;
 	}
 
-	usb = malloc(sizeof(struct usb_context));
-	usb->hndl = hndl;
-	usb->flags = flags;
-	usb->iface = iface;
+	return usb_transport_wrap(hndl, iface, flags);
+}
 
-	return mcu_transport_open(usb, usb_close, usb_read, usb_write);
+/*
+ * Station mode: one hotplug monitor for the life of the process. Each
+ * matching bridge gets a slot keyed by its physical port, so a fixture
+ * position keeps its identity across plug cycles.
+ */
+enum {
+	SLOT_EMPTY,
+	SLOT_READY,	/* attached, waiting for a session */
+	SLOT_BUSY,	/* session running */
+	SLOT_DONE,	/* session over, waiting for the device to leave */
+};
+
+struct usb_slot {
+	int state;
+	bool gone;
+	libusb_device *dev;
+	struct transport *trans;
+	struct transport_cancel cancel;
+	char port[USB_PORT_PATH_SIZE];
+};
+
+struct usb_station {
+	int iface;
+	unsigned flags;
+	atomic_int stop;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	libusb_hotplug_callback_handle cb;
+	struct usb_slot slot[USB_STATION_SLOTS];
+};
+
+static void usb_port_path(libusb_device *dev, char *port, unsigned size)
+{
+	int i, n, len;
+	uint8_t numbers[8];
+
+	len = snprintf(port, size, "%u", libusb_get_bus_number(dev));
+	n = libusb_get_port_numbers(dev, numbers, sizeof(numbers));
+	for (i = 0; i < n && len < size; i++) {
+		len += snprintf(port + len, size - len, "%c%u", i ? '.' : '-', numbers[i]);
+	}
+}
+
+static int station_hotplug_callback(libusb_context *ctx, libusb_device *dev,
+	libusb_hotplug_event event, void *user_data)
+{
+	int i;
+	struct usb_slot *slot = NULL;
+	struct usb_station *st = user_data;
+
+	pthread_mutex_lock(&st->lock);
+	if (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED == event) {
+		for (i = 0; i < USB_STATION_SLOTS; i++) {
+			if (st->slot[i].state == SLOT_EMPTY) {
+				slot = &st->slot[i];
+				break;
+			}
+		}
+
+		if (slot == NULL) {
+			pr_warn("station: no free slot, device ignored\n");
+		} else {
+			slot->dev = libusb_ref_device(dev);
+			slot->gone = false;
+			slot->state = SLOT_READY;
+			usb_port_path(dev, slot->port, sizeof(slot->port));
+			pr_info("station: %s attached\n", slot->port);
+			pthread_cond_broadcast(&st->cond);
+		}
+	} else {
+		for (i = 0; i < USB_STATION_SLOTS; i++) {
+			if (st->slot[i].state != SLOT_EMPTY && st->slot[i].dev == dev) {
+				slot = &st->slot[i];
+				break;
+			}
+		}
+
+		if (slot) {
+			pr_info("station: %s detached\n", slot->port);
+			if (slot->state == SLOT_BUSY) {
+				/* usb_station_release() frees the slot once the session unwinds */
+				slot->gone = true;
+				transport_cancel(&slot->cancel);
+			} else {
+				libusb_unref_device(slot->dev);
+				slot->state = SLOT_EMPTY;
+			}
+		}
+	}
+	pthread_mutex_unlock(&st->lock);
+
+	return 0;
+}
+
+static void *station_thread(void *arg)
+{
+	struct usb_station *st = arg;
+	struct timeval tv = { 0, 100 * 1000 };
+
+	while (!atomic_load(&st->stop)) {
+		libusb_handle_events_timeout(NULL, &tv);
+	}
+
+	return NULL;
+}
+
+struct usb_station *usb_station_open(uint16_t vid, uint16_t pid, int iface, unsigned flags)
+{
+	int rc;
+	struct usb_station *st;
+
+	usb_init(LIBUSB_LOG_LEVEL_NONE);
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		libusb_exit(NULL);
+		errno = ENOSYS;
+		return NULL;
+	}
+
+	st = calloc(1, sizeof(struct usb_station));
+	st->iface = iface;
+	st->flags = flags;
+	atomic_init(&st->stop, 0);
+	pthread_mutex_init(&st->lock, NULL);
+	pthread_cond_init(&st->cond, NULL);
+
+	/* Devices already plugged in are reported as arrivals too */
+	rc = libusb_hotplug_register_callback(NULL,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		LIBUSB_HOTPLUG_ENUMERATE, vid, pid, LIBUSB_HOTPLUG_MATCH_ANY,
+		station_hotplug_callback, st, &st->cb);
+	if (rc != LIBUSB_SUCCESS) {
+		pr_err("libusb_hotplug_register_callback: %s\n", libusb_strerror(rc));
+		goto _err;
+	}
+
+	if (pthread_create(&st->thread, NULL, station_thread, st)) {
+		libusb_hotplug_deregister_callback(NULL, st->cb);
+		goto _err;
+	}
+
+	return st;
+
+_err:
+	pthread_cond_destroy(&st->cond);
+	pthread_mutex_destroy(&st->lock);
+	free(st);
+	libusb_exit(NULL);
+	errno = EIO;
+	return NULL;
+}
+
+/*
+ * Wait up to @ms for a bridge that hasn't been flashed yet and open it.
+ * The transport carries a cancel token with @timeout_ms as deadline,
+ * which detaching the device cancels. Returns NULL with ETIMEDOUT when
+ * nothing shows up.
+ */
+struct transport *usb_station_wait(struct usb_station *st, unsigned ms,
+	unsigned timeout_ms, char *port, unsigned size)
+{
+	int i, rc;
+	struct timespec ts;
+	struct usb_slot *slot;
+	libusb_device_handle *hndl;
+	struct transport *trans;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&st->lock);
+	for (;;) {
+		slot = NULL;
+		for (i = 0; i < USB_STATION_SLOTS; i++) {
+			if (st->slot[i].state == SLOT_READY) {
+				slot = &st->slot[i];
+				break;
+			}
+		}
+
+		if (slot == NULL) {
+			if (pthread_cond_timedwait(&st->cond, &st->lock, &ts)) {
+				pthread_mutex_unlock(&st->lock);
+				errno = ETIMEDOUT;
+				return NULL;
+			}
+			continue;
+		}
+
+		/* Opening talks to the device, don't hold up the hotplug thread */
+		slot->state = SLOT_BUSY;
+		transport_cancel_init(&slot->cancel, timeout_ms);
+		pthread_mutex_unlock(&st->lock);
+
+		trans = NULL;
+		rc = libusb_open(slot->dev, &hndl);
+		if (rc != LIBUSB_SUCCESS) {
+			pr_err("station: %s: libusb_open: %s\n", slot->port, libusb_strerror(rc));
+		} else if (usb_claim(hndl, st->iface, st->flags, &rc) == 0) {
+			usb_init(LIBUSB_LOG_LEVEL_NONE);
+			trans = usb_transport_wrap(hndl, st->iface, st->flags);
+		} else {
+			pr_err("station: %s: libusb_claim_interface: %s\n", slot->port, libusb_strerror(rc));
+		}
+
+		pthread_mutex_lock(&st->lock);
+		if (trans) {
+			slot->trans = trans;
+			transport_set_cancel(trans, &slot->cancel);
+			snprintf(port, size, "%s", slot->port);
+			pthread_mutex_unlock(&st->lock);
+			return trans;
+		}
+
+		/* Leave it alone until it is plugged again */
+		if (slot->gone) {
+			libusb_unref_device(slot->dev);
+			slot->state = SLOT_EMPTY;
+		} else {
+			slot->state = SLOT_DONE;
+		}
+	}
+}
+
+/* Close a transport from usb_station_wait(), its device won't be opened again until replugged */
+void usb_station_release(struct usb_station *st, struct transport *trans)
+{
+	int i;
+
+	transport_close(trans);
+
+	pthread_mutex_lock(&st->lock);
+	for (i = 0; i < USB_STATION_SLOTS; i++) {
+		struct usb_slot *slot = &st->slot[i];
+
+		if (slot->state != SLOT_BUSY || slot->trans != trans)
+			continue;
+
+		slot->trans = NULL;
+		if (slot->gone) {
+			libusb_unref_device(slot->dev);
+			slot->state = SLOT_EMPTY;
+		} else {
+			slot->state = SLOT_DONE;
+		}
+	}
+	pthread_mutex_unlock(&st->lock);
+}
+
+void usb_station_close(struct usb_station *st)
+{
+	int i;
+
+	libusb_hotplug_deregister_callback(NULL, st->cb);
+	atomic_store(&st->stop, 1);
+	pthread_join(st->thread, NULL);
+
+	for (i = 0; i < USB_STATION_SLOTS; i++) {
+		if (st->slot[i].state != SLOT_EMPTY) {
+			libusb_unref_device(st->slot[i].dev);
+		}
+	}
+
+	pthread_cond_destroy(&st->cond);
+	pthread_mutex_destroy(&st->lock);
+	free(st);
+	libusb_exit(NULL);
 }
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ * 
+ * SPDX-License-Identifier: 
+ */
+
+#ifndef __USB_TRANSPORT_H__
+#define __USB_TRANSPORT_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Fixture positions watched at once, and "bus-port.port..." name size */
+#define USB_STATION_SLOTS	16
+#define USB_PORT_PATH_SIZE	32
+
+struct transport;
+struct usb_station;
+
+struct transport *usb_transport_open(uint16_t vid, uint16_t pid, int iface, unsigned flags);
+
+struct usb_station *usb_station_open(uint16_t vid, uint16_t pid, int iface, unsigned flags);
+struct transport *usb_station_wait(struct usb_station *st, unsigned ms,
+	unsigned timeout_ms, char *port, unsigned size);
+void usb_station_release(struct usb_station *st, struct transport *trans);
+void usb_station_close(struct usb_station *st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __USB_TRANSPORT_H__*/
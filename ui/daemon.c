@@ -0,0 +1,628 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ *
+ * SPDX-License-Identifier:
+ */
+
+/*
+ * Long running job server. Requests are text lines on a Unix socket:
+ *
+ *   flash <device> [verify=chunk|image|end] [speed=<baud>] [timeout=<s>]
+ *   status
+ *   reload
+ *
+ * where <device> is serial:<tty>, usb:<vid>:<pid>[,<iface>],
+ * hid:<vid>:<pid>[,<serial>] or hid:<hidraw path>. Replies are one JSON
+ * object per line. Images are loaded once and reloaded when they change
+ * on disk; transports stay open between jobs.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "daemon.h"
+#include "rtlmptool.h"
+#include "transport.h"
+#include "log.h"
+
+#define DAEMON_MAX_CLIENTS	32
+#define DAEMON_MAX_DEVICES	32
+#define DAEMON_LINE_SIZE	512
+/* Room for one escaped text field of a reply, a reply has at most two */
+#define DAEMON_FIELD_SIZE	160
+
+/* Image change check period, and least gap between progress messages */
+#define DAEMON_TICK_MS		500
+#define DAEMON_PROGRESS_US	250000
+
+/* Speed the bridge and the chip start every job at */
+#define DAEMON_BOOT_BAUDRATE	115200
+
+struct daemon_image {
+	const char *path;
+	int type;
+	struct rtlmptool_image *img;
+	/* Last seen on disk, a change is taken once it holds for one tick */
+	time_t mtime;
+	off_t size;
+	bool changed;
+};
+
+struct daemon_client {
+	int fd;
+	unsigned len;
+	char line[DAEMON_LINE_SIZE];
+};
+
+struct daemon_device {
+	char spec[128];
+	struct transport *trans;
+	/* Running job, if any */
+	struct rtlmptool_session *session;
+	struct daemon_client *client;
+	unsigned job;
+	unsigned long long start_us, progress_us;
+	int stage;
+};
+
+struct daemon {
+	const struct daemon_config *cfg;
+	int fd;
+	unsigned jobs;
+	struct daemon_image fw, mp;
+	struct daemon_client client[DAEMON_MAX_CLIENTS];
+	struct daemon_device device[DAEMON_MAX_DEVICES];
+};
+
+static const char *stage_name[] = {
+	[RTLMPTOOL_STAGE_PATCH] = "patch",
+	[RTLMPTOOL_STAGE_FLASH] = "flash",
+	[RTLMPTOOL_STAGE_READBACK] = "readback",
+	[RTLMPTOOL_STAGE_DONE] = "done",
+};
+
+/*
+ * @s escaped as the inside of a JSON string, into @buf. Text that doesn't
+ * fit is cut between characters and ends in "...", so a reply carrying
+ * it still fits its line.
+ */
+static const char *json_str(char *buf, size_t size, const char *s)
+{
+	size_t n = 0, m, cut = 0;
+	char esc[8];
+	const unsigned char *p;
+
+	for (p = (const unsigned char *)s; *p; p++) {
+		if (*p == '"' || *p == '\\') {
+			esc[0] = '\\';
+			esc[1] = *p;
+			esc[2] = '\0';
+		} else if (*p < 0x20 || *p == 0x7f) {
+			snprintf(esc, sizeof(esc), "\\u%04x", *p);
+		} else {
+			esc[0] = *p;
+			esc[1] = '\0';
+		}
+
+		/* Not inside a UTF-8 sequence, and "..." still fits after it */
+		if ((*p & 0xc0) != 0x80 && n + 4 <= size)
+			cut = n;
+
+		m = strlen(esc);
+		if (n + m + 1 > size) {
+			memcpy(buf + cut, "...", 4);
+			return buf;
+		}
+		memcpy(buf + n, esc, m);
+		n += m;
+	}
+	buf[n] = '\0';
+
+	return buf;
+}
+
+/* Replies never block the daemon, a client that doesn't read loses them */
+static void reply(struct daemon_client *c, const char *fmt, ...)
+{
+	int len;
+	va_list ap;
+	char buf[DAEMON_LINE_SIZE];
+
+	if (c == NULL || c->fd < 0)
+		return;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
+	va_end(ap);
+
+	if (len < 0)
+		return;
+	/* Never half an object, fields are sized so this shouldn't happen */
+	if (len > (int)sizeof(buf) - 2) {
+		pr_warn("client %d: reply of %d bytes dropped\n", c->fd, len);
+		len = snprintf(buf, sizeof(buf), "{\"event\":\"error\",\"error\":\"reply too long\"}");
+	}
+	buf[len++] = '\n';
+
+	if (send(c->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 && errno != EAGAIN) {
+		pr_debug("client %d: %s\n", c->fd, strerror(errno));
+	}
+}
+
+static int image_reload(struct daemon_image *di, bool force)
+{
+	struct stat st;
+	struct rtlmptool_image *img;
+
+	if (stat(di->path, &st)) {
+		return -1;
+	}
+
+	if (!force) {
+		if (st.st_mtime != di->mtime || st.st_size != di->size) {
+			/* Still being written maybe, look again next tick */
+			di->mtime = st.st_mtime;
+			di->size = st.st_size;
+			di->changed = true;
+			return 0;
+		}
+
+		if (!di->changed) {
+			return 0;
+		}
+	}
+
+	di->mtime = st.st_mtime;
+	di->size = st.st_size;
+	di->changed = false;
+
+	img = rtlmptool_image_load(di->path, di->type);
+	if (img == NULL) {
+		pr_err("reload %s: %s, keeping the old image\n", di->path, strerror(errno));
+		return -1;
+	}
+
+	/* Jobs already running hold their own reference to the old one */
+	rtlmptool_image_put(di->img);
+	di->img = img;
+	pr_info("loaded %s, %u bytes\n", di->path, rtlmptool_image_size(img));
+
+	return 0;
+}
+
+static struct transport *device_open(const char *spec)
+{
+	unsigned vid, pid;
+	int iface = 0;
+	union transport_param param;
+
+	memset(&param, 0, sizeof(param));
+	if (!strncmp(spec, "serial:", 7)) {
+		param.serial.tty = spec + 7;
+		param.serial.speed = DAEMON_BOOT_BAUDRATE;
+		return transport_open(TRANSPORT_IFACE_SERAIL, &param);
+	}
+
+	if (!strncmp(spec, "usb:", 4) && sscanf(spec + 4, "%x:%x,%d", &vid, &pid, &iface) >= 2) {
+		param.libusb.vid = vid;
+		param.libusb.pid = pid;
+		param.libusb.iface = iface;
+		return transport_open(TRANSPORT_IFACE_LIBUSB, &param);
+	}
+
+	if (!strncmp(spec, "hid:/", 5)) {
+		param.hidapi.path = spec + 4;
+		return transport_open(TRANSPORT_IFACE_HIDAPI, &param);
+	}
+
+	if (!strncmp(spec, "hid:", 4) && sscanf(spec + 4, "%x:%x", &vid, &pid) == 2) {
+		param.hidapi.vid = vid;
+		param.hidapi.pid = pid;
+		/* hid:<vid>:<pid>,<serial> picks one of several bridges */
+		if (strchr(spec, ',')) {
+			param.hidapi.serial = strchr(spec, ',') + 1;
+		}
+		return transport_open(TRANSPORT_IFACE_HIDAPI, &param);
+	}
+
+	errno = EINVAL;
+	return NULL;
+}
+
+/* Find the warm transport for @spec, or open it */
+static struct daemon_device *device_get(struct daemon *d, const char *spec)
+{
+	int i;
+	struct daemon_device *free_dev = NULL;
+
+	for (i = 0; i < DAEMON_MAX_DEVICES; i++) {
+		struct daemon_device *dev = &d->device[i];
+
+		if (dev->trans && !strcmp(dev->spec, spec))
+			return dev;
+
+		if (dev->trans == NULL && free_dev == NULL)
+			free_dev = dev;
+	}
+
+	if (free_dev == NULL) {
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	free_dev->trans = device_open(spec);
+	if (free_dev->trans == NULL) {
+		return NULL;
+	}
+	snprintf(free_dev->spec, sizeof(free_dev->spec), "%s", spec);
+
+	return free_dev;
+}
+
+static void device_drop(struct daemon_device *dev)
+{
+	transport_close(dev->trans);
+	dev->trans = NULL;
+}
+
+static void job_progress(const struct rtlmptool_progress *p, void *arg)
+{
+	struct daemon_device *dev = arg;
+	unsigned long long now = transport_now_us();
+
+	if (p->stage == dev->stage && now - dev->progress_us < DAEMON_PROGRESS_US)
+		return;
+
+	dev->stage = p->stage;
+	dev->progress_us = now;
+	reply(dev->client, "{\"event\":\"progress\",\"job\":%u,\"stage\":\"%s\","
+		"\"done\":%u,\"total\":%u,\"rate\":%.0f}",
+		dev->job, stage_name[p->stage], p->done, p->total, p->throughput);
+}
+
+static void job_start(struct daemon *d, struct daemon_client *c, char *args)
+{
+	char *spec, *opt, *save;
+	char espec[DAEMON_FIELD_SIZE], etext[DAEMON_FIELD_SIZE];
+	unsigned speed = d->cfg->speed, timeout = d->cfg->timeout;
+	int verify = d->cfg->verify;
+	struct daemon_device *dev;
+	struct rtlmptool_session *s;
+
+	spec = strtok_r(args, " ", &save);
+	if (spec == NULL) {
+		reply(c, "{\"event\":\"error\",\"error\":\"flash needs a device\"}");
+		return;
+	}
+
+	while ((opt = strtok_r(NULL, " ", &save)) != NULL) {
+		if (!strncmp(opt, "speed=", 6)) {
+			speed = strtoul(opt + 6, NULL, 0);
+		} else if (!strncmp(opt, "timeout=", 8)) {
+			timeout = strtoul(opt + 8, NULL, 0) * 1000;
+		} else if (!strcmp(opt, "verify=chunk")) {
+			verify = RTLMPTOOL_VERIFY_CHUNK;
+		} else if (!strcmp(opt, "verify=image")) {
+			verify = RTLMPTOOL_VERIFY_IMAGE;
+		} else if (!strcmp(opt, "verify=end")) {
+			verify = RTLMPTOOL_VERIFY_END;
+		} else {
+			reply(c, "{\"event\":\"error\",\"error\":\"unknown option %s\"}",
+				json_str(etext, sizeof(etext), opt));
+			return;
+		}
+	}
+
+	json_str(espec, sizeof(espec), spec);
+
+	if (d->fw.img == NULL || d->mp.img == NULL) {
+		reply(c, "{\"event\":\"error\",\"device\":\"%s\",\"error\":\"no image loaded\"}", espec);
+		return;
+	}
+
+	dev = device_get(d, spec);
+	if (dev == NULL) {
+		reply(c, "{\"event\":\"error\",\"device\":\"%s\",\"error\":\"%s\"}", espec,
+			json_str(etext, sizeof(etext), strerror(errno)));
+		return;
+	}
+
+	if (dev->session) {
+		reply(c, "{\"event\":\"error\",\"device\":\"%s\",\"error\":\"busy with job %u\"}",
+			espec, dev->job);
+		return;
+	}
+
+	/* The previous job left the link at its MP speed */
+	transport_set_baudrate(dev->trans, DAEMON_BOOT_BAUDRATE);
+	transport_reset_stats(dev->trans);
+
+	s = rtlmptool_session_create(dev->trans);
+	if (s == NULL) {
+		reply(c, "{\"event\":\"error\",\"device\":\"%s\",\"error\":\"%s\"}", espec,
+			json_str(etext, sizeof(etext), strerror(errno)));
+		return;
+	}
+
+	rtlmptool_session_set_speed(s, speed);
+	rtlmptool_session_set_verify(s, verify);
+	rtlmptool_session_set_timeout(s, timeout);
+	rtlmptool_session_set_progress(s, job_progress, dev);
+	rtlmptool_session_set_journal(s, d->cfg->journal, spec);
+	rtlmptool_session_download_image(s, d->fw.img, d->mp.img);
+	if (rtlmptool_session_start(s)) {
+		reply(c, "{\"event\":\"error\",\"device\":\"%s\",\"error\":\"%s\"}", espec,
+			json_str(etext, sizeof(etext), strerror(errno)));
+		rtlmptool_session_destroy(s);
+		return;
+	}
+
+	dev->session = s;
+	dev->client = c;
+	dev->job = ++d->jobs;
+	dev->stage = -1;
+	dev->start_us = transport_now_us();
+	dev->progress_us = 0;
+	reply(c, "{\"event\":\"accepted\",\"job\":%u,\"device\":\"%s\"}", dev->job, espec);
+}
+
+static void job_finish(struct daemon_device *dev)
+{
+	int rc, err;
+	char espec[DAEMON_FIELD_SIZE], etext[DAEMON_FIELD_SIZE];
+	const struct transport_stats *st = transport_get_stats(dev->trans);
+
+	rc = rtlmptool_session_result(dev->session);
+	err = errno;
+	json_str(espec, sizeof(espec), dev->spec);
+
+	if (rc == 0) {
+		reply(dev->client, "{\"event\":\"result\",\"job\":%u,\"device\":\"%s\",\"ok\":true,"
+			"\"seconds\":%.3f,\"bytes_out\":%llu,\"retries\":%llu}",
+			dev->job, espec, (transport_now_us() - dev->start_us) / 1e6,
+			st->bytes_out, st->retries);
+	} else {
+		reply(dev->client, "{\"event\":\"result\",\"job\":%u,\"device\":\"%s\",\"ok\":false,"
+			"\"seconds\":%.3f,\"error\":\"%s\"}",
+			dev->job, espec, (transport_now_us() - dev->start_us) / 1e6,
+			json_str(etext, sizeof(etext), strerror(err)));
+	}
+	pr_info("job %u %s: %s\n", dev->job, dev->spec, rc == 0 ? "PASS" : strerror(err));
+
+	rtlmptool_session_destroy(dev->session);
+	dev->session = NULL;
+	dev->client = NULL;
+
+	/* Reopen from scratch next time if the link itself broke */
+	if (rc != 0 && err != ECANCELED && err != ETIMEDOUT) {
+		device_drop(dev);
+	}
+}
+
+static void status(struct daemon *d, struct daemon_client *c)
+{
+	int i;
+	char espec[DAEMON_FIELD_SIZE];
+
+	reply(c, "{\"event\":\"status\",\"fw\":%u,\"mp\":%u,\"jobs\":%u}",
+		d->fw.img ? rtlmptool_image_size(d->fw.img) : 0,
+		d->mp.img ? rtlmptool_image_size(d->mp.img) : 0, d->jobs);
+
+	for (i = 0; i < DAEMON_MAX_DEVICES; i++) {
+		struct daemon_device *dev = &d->device[i];
+
+		if (dev->trans == NULL)
+			continue;
+
+		reply(c, "{\"event\":\"device\",\"device\":\"%s\",\"busy\":%s,\"job\":%u}",
+			json_str(espec, sizeof(espec), dev->spec),
+			dev->session ? "true" : "false", dev->job);
+	}
+}
+
+static void request(struct daemon *d, struct daemon_client *c, char *line)
+{
+	char etext[DAEMON_FIELD_SIZE];
+
+	if (!strncmp(line, "flash ", 6)) {
+		job_start(d, c, line + 6);
+	} else if (!strcmp(line, "status")) {
+		status(d, c);
+	} else if (!strcmp(line, "reload")) {
+		if (image_reload(&d->fw, true) || image_reload(&d->mp, true)) {
+			reply(c, "{\"event\":\"error\",\"error\":\"reload: %s\"}",
+				json_str(etext, sizeof(etext), strerror(errno)));
+		} else {
+			reply(c, "{\"event\":\"reloaded\"}");
+		}
+	} else if (line[0]) {
+		reply(c, "{\"event\":\"error\",\"error\":\"unknown request\"}");
+	}
+}
+
+static void client_close(struct daemon *d, struct daemon_client *c)
+{
+	int i;
+
+	/* Jobs keep running, their replies go nowhere */
+	for (i = 0; i < DAEMON_MAX_DEVICES; i++) {
+		if (d->device[i].client == c)
+			d->device[i].client = NULL;
+	}
+
+	close(c->fd);
+	c->fd = -1;
+}
+
+static void client_read(struct daemon *d, struct daemon_client *c)
+{
+	int rz;
+	char *nl;
+
+	rz = recv(c->fd, c->line + c->len, sizeof(c->line) - 1 - c->len, 0);
+	if (rz <= 0) {
+		client_close(d, c);
+		return;
+	}
+	c->len += rz;
+	c->line[c->len] = '\0';
+
+	while ((nl = strchr(c->line, '\n')) != NULL) {
+		*nl = '\0';
+		if (nl > c->line && nl[-1] == '\r')
+			nl[-1] = '\0';
+
+		request(d, c, c->line);
+		if (c->fd < 0)
+			return;
+
+		c->len -= nl + 1 - c->line;
+		memmove(c->line, nl + 1, c->len + 1);
+	}
+
+	if (c->len == sizeof(c->line) - 1) {
+		reply(c, "{\"event\":\"error\",\"error\":\"line too long\"}");
+		client_close(d, c);
+	}
+}
+
+static void client_accept(struct daemon *d)
+{
+	int i, fd;
+
+	fd = accept(d->fd, NULL, NULL);
+	if (fd < 0) {
+		return;
+	}
+
+	for (i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+		if (d->client[i].fd < 0) {
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+			d->client[i].fd = fd;
+			d->client[i].len = 0;
+			return;
+		}
+	}
+
+	close(fd);
+}
+
+static int daemon_listen(const char *path)
+{
+	int fd;
+	struct sockaddr_un addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 8)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int daemon_run(const struct daemon_config *cfg)
+{
+	int i, n, rc;
+	struct daemon d;
+	struct pollfd pfd[1 + DAEMON_MAX_CLIENTS + DAEMON_MAX_DEVICES];
+	/* What each pollfd is: client index, or DAEMON_MAX_CLIENTS + device index */
+	int owner[1 + DAEMON_MAX_CLIENTS + DAEMON_MAX_DEVICES];
+
+	memset(&d, 0, sizeof(d));
+	d.cfg = cfg;
+	d.fw.path = cfg->fw;
+	d.fw.type = RTLMPTOOL_IMAGE_PATCH;
+	d.mp.path = cfg->mp;
+	d.mp.type = RTLMPTOOL_IMAGE_MP;
+	for (i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+		d.client[i].fd = -1;
+	}
+
+	if (image_reload(&d.fw, true) || image_reload(&d.mp, true)) {
+		pr_err("load images: %s\n", strerror(errno));
+		return -1;
+	}
+
+	d.fd = daemon_listen(cfg->socket);
+	if (d.fd < 0) {
+		pr_err("listen %s: %s\n", cfg->socket, strerror(errno));
+		return -1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	pr_info("daemon: listening on %s\n", cfg->socket);
+
+	for (;;) {
+		n = 0;
+		pfd[n].fd = d.fd;
+		pfd[n].events = POLLIN;
+		owner[n++] = -1;
+
+		for (i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+			if (d.client[i].fd < 0)
+				continue;
+			pfd[n].fd = d.client[i].fd;
+			pfd[n].events = POLLIN;
+			owner[n++] = i;
+		}
+
+		for (i = 0; i < DAEMON_MAX_DEVICES; i++) {
+			if (d.device[i].session == NULL)
+				continue;
+			pfd[n].fd = rtlmptool_session_fd(d.device[i].session);
+			pfd[n].events = POLLIN;
+			owner[n++] = DAEMON_MAX_CLIENTS + i;
+		}
+
+		rc = poll(pfd, n, DAEMON_TICK_MS);
+		if (rc < 0 && errno != EINTR) {
+			pr_err("poll: %s\n", strerror(errno));
+			return -1;
+		}
+
+		for (i = 0; rc > 0 && i < n; i++) {
+			if (!pfd[i].revents)
+				continue;
+
+			if (owner[i] < 0) {
+				client_accept(&d);
+			} else if (owner[i] < DAEMON_MAX_CLIENTS) {
+				if (d.client[owner[i]].fd >= 0)
+					client_read(&d, &d.client[owner[i]]);
+			} else {
+				struct daemon_device *dev = &d.device[owner[i] - DAEMON_MAX_CLIENTS];
+
+				if (dev->session && rtlmptool_session_step(dev->session) != RTLMPTOOL_STATE_RUNNING)
+					job_finish(dev);
+			}
+		}
+
+		image_reload(&d.fw, false);
+		image_reload(&d.mp, false);
+	}
+}
@@ -0,0 +1,23 @@
+/*
+ * Copyright (c) 2020 ZhongYao Luo <luozhongyao@gmail.com>
+ *
+ * SPDX-License-Identifier:
+ */
+
+
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+struct daemon_config {
+	const char *socket;
+	const char *fw, *mp;
+	const char *journal;
+	unsigned speed;
+	int verify;
+	unsigned timeout;	/* ms per job, 0 = none */
+};
+
+/* Serve flash jobs on the Unix socket until killed, returns only on setup errors */
+int daemon_run(const struct daemon_config *cfg);
+
+#endif /* __DAEMON_H__*/
@@ -11,10 +11,11 @@
 #include <stdarg.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdbool.h>
 #include <gtk/gtk.h>
-#include "rtlbt.h"
 #include "rtlmptool.h"
 #include "transport.h"
+#include "log.h"
 
 static GtkButton *update_button;
 static GtkButton *start_button, *stop_button;
@@ -31,80 +32,138 @@ static gchar *firmware = "MP_LBA1127_BLE_v1.1.2.bin";
 static union transport_param trans_param;
 static const char *trans_name;
 static int trans_speed = 115200;
-static int progress = -1, channel = 0;
+static int channel = 0;
+static bool updating;
+static struct transport_cancel update_cancel;
 static pthread_cond_t  cond = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
-static int output_handler(void *buf)
-{
-	GtkTextIter	iter;
+/* Progress bar refresh period, callbacks in between are coalesced */
+#define PROGRESS_UPDATE_US	50000
 
-	gtk_text_buffer_get_end_iter(output_text_buffer, &iter);
-	gtk_text_buffer_insert (output_text_buffer, &iter, buf, -1);
-	free(buf);
-	return 0;
+static struct rtlmptool_progress progress;
+static unsigned long long progress_posted_us;
+static int progress_pending;
+static pthread_mutex_t progress_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Output view drain period and size limit */
+#define OUTPUT_DRAIN_MS		100
+#define OUTPUT_MAX_LINES	5000
+
+static void output_sink(int level, const char *msg, void *arg)
+{
+	g_string_append(arg, msg);
 }
 
-static int progress_handler(void *buf)
+static int output_handler(void *arg)
 {
-	if (progress >= 0) {
-		gtk_progress_bar_set_fraction(update_progress_bar, progress / 100.0);
+	int lines;
+	GtkTextIter	start, end;
+	GString *batch = arg;
+
+	if (!log_drain(output_sink, batch, LOG_RING_SIZE))
 		return 1;
+
+	gtk_text_buffer_get_end_iter(output_text_buffer, &end);
+	gtk_text_buffer_insert(output_text_buffer, &end, batch->str, batch->len);
+	g_string_truncate(batch, 0);
+
+	lines = gtk_text_buffer_get_line_count(output_text_buffer);
+	if (lines > OUTPUT_MAX_LINES) {
+		gtk_text_buffer_get_start_iter(output_text_buffer, &start);
+		gtk_text_buffer_get_iter_at_line(output_text_buffer, &end, lines - OUTPUT_MAX_LINES);
+		gtk_text_buffer_delete(output_text_buffer, &start, &end);
 	}
 
-	return 0;
+	return 1;
 }
 
-static int update_button_sensitive(void *arg)
+static int progress_handler(void *arg)
 {
-	gtk_widget_set_sensitive (GTK_WIDGET(update_button), TRUE);
+	char text[64];
+	struct rtlmptool_progress p;
+
+	pthread_mutex_lock(&progress_mutex);
+	p = progress;
+	progress_pending = 0;
+	pthread_mutex_unlock(&progress_mutex);
+
+	if (p.total != 0) {
+		gtk_progress_bar_set_fraction(update_progress_bar, (double)p.done / p.total);
+	}
+
+	if (p.stage == RTLMPTOOL_STAGE_DONE) {
+		snprintf(text, sizeof(text), "Done");
+	} else if (p.throughput > 0) {
+		snprintf(text, sizeof(text), "%s %.2f MB/s, ETA %.0f s",
+			p.stage == RTLMPTOOL_STAGE_PATCH ? "Patch" : "Flash",
+			p.throughput / 1e6, (p.total - p.done) / p.throughput);
+	} else {
+		snprintf(text, sizeof(text), "%s",
+			p.stage == RTLMPTOOL_STAGE_PATCH ? "Patch" : "Flash");
+	}
+	gtk_progress_bar_set_text(update_progress_bar, text);
+
 	return 0;
 }
 
-int gtk_text_printf(const char *fmt, ...)
+static void progress_post(void)
 {
-	int rc;
-	va_list va;
-	char *buf = malloc(1024);
-
-	va_start(va, fmt);
-	rc = vsnprintf(buf, 1024, fmt, va);
-	va_end(va);
+	if (!progress_pending) {
+		progress_pending = 1;
+		g_idle_add(progress_handler, NULL);
+	}
+}
 
-	g_idle_add(output_handler, buf);
+static void progress_callback(const struct rtlmptool_progress *p, void *arg)
+{
+	int stage_changed;
+	unsigned long long now = transport_now_us();
+
+	pthread_mutex_lock(&progress_mutex);
+	stage_changed = p->stage != progress.stage;
+	progress = *p;
+	if (stage_changed || now - progress_posted_us >= PROGRESS_UPDATE_US) {
+		progress_posted_us = now;
+		progress_post();
+	}
+	pthread_mutex_unlock(&progress_mutex);
+}
 
-	return rc;
+static int update_button_sensitive(void *arg)
+{
+	updating = false;
+	gtk_button_set_label(update_button, "Update");
+	gtk_widget_set_sensitive (GTK_WIDGET(update_button), TRUE);
+	return 0;
 }
-int __wrap_printf(const char *fmt, ...) __attribute__((alias("gtk_text_printf")));
+
 
 static void *update_handler(void *arg)
 {
 	int rc;
-	clock_t start = clock(), cost;
+	time_t start = time(NULL), cost;
 	struct transport *transport;
 
 	transport = transport_open(trans_name, &trans_param);
 	if (transport == NULL) {
-		gtk_text_printf("Unable to open transport(%s): %s\n", trans_name, strerror(errno));
+		pr_err("Unable to open transport(%s): %s\n", trans_name, strerror(errno));
 		goto quit;
 	}
 
-	progress = 0;
-
-	g_idle_add(progress_handler, NULL);
+	transport_set_cancel(transport, &update_cancel);
 	rc = rtlmptool_download_firmware(transport, trans_speed,
-		"image/firmware0.bin", firmware, &progress);
+		"image/firmware0.bin", firmware, progress_callback, NULL);
 	transport_close(transport);
 
-	cost = (clock() - start) / CLOCKS_PER_SEC;
+	cost = time(NULL) - start;
 	if (rc != 0) {
-		gtk_text_printf("Update %s failure: %s, time cost: %d seconds\n",
-			firmware, strerror(errno), cost);
+		pr_err("Update %s failure: %s, time cost: %d seconds\n",
+			firmware, strerror(errno), (int)cost);
 	} else {
-		gtk_text_printf("Update Finish, Time cost: %d seconds\n", cost);
+		pr_info("Update Finish, Time cost: %d seconds\n", (int)cost);
 	}
 
-	progress = -1;
 quit:
 	g_idle_add(update_button_sensitive, NULL);
 	return NULL;
@@ -117,13 +176,12 @@ static void *single_tone_handler(void *arg)
 
 	transport = transport_open(trans_name, &trans_param);
 	if (transport == NULL) {
-		gtk_text_printf("Unable to open transport(%s): %s\n", trans_name, strerror(errno));
+		pr_err("Unable to open transport(%s): %s\n", trans_name, strerror(errno));
 		return NULL;
 	}
 
-	rtlmptoo_set_tranport(transport);
-	gtk_text_printf("Start single tone, Channel %d\n", channel);
-	rc = rtlbt_single_tone(channel);
+	pr_info("Start single tone, Channel %d\n", channel);
+	rc = rtlmptool_single_tone(transport, channel);
 	if (rc == 1) {
 		pthread_mutex_lock(&mutex);
 		pthread_cond_wait(&cond, &mutex);
@@ -131,7 +189,7 @@ static void *single_tone_handler(void *arg)
 	}
 
 	transport_close(transport);
-	gtk_text_printf("Stop single tone\n");
+	pr_info("Stop single tone\n");
 	return NULL;
 }
 
@@ -150,19 +208,22 @@ static int do_bg_work(void* (*handler)(void *))
 		trans_param.libusb.pid = pid;
 		trans_param.libusb.flags = 0x01;
 		trans_param.libusb.iface = 0x00;
-		gtk_text_printf("Select libusb %04x:%04x\n", vid, pid);
+		pr_info("Select libusb %04x:%04x\n", vid, pid);
 	} else if (!strcmp(trans_name, TRANSPORT_IFACE_HIDAPI)) {
 		trans_param.hidapi.vid = vid;
 		trans_param.hidapi.pid = pid;
-		gtk_text_printf("Select hidapi %04x:%04x\n", vid, pid);
+		trans_param.hidapi.path = NULL;
+		trans_param.hidapi.serial = NULL;
+		pr_info("Select hidapi %04x:%04x\n", vid, pid);
 	} else if(!strcmp(trans_name, TRANSPORT_IFACE_SERAIL)) {
 		const char *tty_name = "/dev/ttyS0";
 		tty_name = gtk_entry_get_text(entry_com);
 		trans_param.serial.tty = tty_name;
 		trans_param.serial.speed = 115200;
-		gtk_text_printf("Select serial %s\n", tty_name);
+		trans_param.serial.rx_ring = 0;
+		pr_info("Select serial %s\n", tty_name);
 	} else {
-		gtk_text_printf("Unsupported transport type %s\n", trans_name);
+		pr_err("Unsupported transport type %s\n", trans_name);
 		return -1;
 	}
 
@@ -189,16 +250,26 @@ void on_stop_button_clicked(void)
 
 void on_update_btn_clicked(void)
 {
+	/* The same button stops a running update */
+	if (updating) {
+		transport_cancel(&update_cancel);
+		gtk_widget_set_sensitive (GTK_WIDGET(update_button), FALSE);
+		return;
+	}
+
 	gtk_progress_bar_set_fraction(update_progress_bar, 0.0);
+	gtk_progress_bar_set_text(update_progress_bar, NULL);
+	transport_cancel_init(&update_cancel, 0);
 	if (!do_bg_work(update_handler)) {
-		gtk_widget_set_sensitive (GTK_WIDGET(update_button), FALSE);
+		updating = true;
+		gtk_button_set_label(update_button, "Stop");
 	}
 }
 
 void on_firmware_chooser_file_set(void)
 {
 	firmware = gtk_file_chooser_get_filename(chooser);
-	gtk_text_printf("Select firmware %s\n", firmware);
+	pr_info("Select firmware %s\n", firmware);
 }
 
 void on_combo_box_transport_changed(void)
@@ -275,6 +346,10 @@ int main(int argc, char **argv)
 	assert(entry_pid && entry_vid && entry_com);
 	assert(combox_speed && combox_transport && combox_channel);
 	assert(firmware_radio && factory_radio);
+	assert(update_progress_bar);
+
+	gtk_progress_bar_set_show_text(update_progress_bar, TRUE);
+	g_timeout_add(OUTPUT_DRAIN_MS, output_handler, g_string_sized_new(LOG_RING_SIZE * 64));
 
 	window = GTK_APPLICATION_WINDOW(gtk_builder_get_object(builder, "window"));
 	gtk_widget_show_all(GTK_WIDGET(window));
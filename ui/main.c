@@ -1,16 +1,30 @@
+#include "defs.h"
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <ctype.h>
 #include <getopt.h>
+#include <unistd.h>
 #include "rtlmptool.h"
 #include "transport.h"
+#include "usb_transport.h"
+#include "hidapi_transport.h"
+#include "mcu_transport.h"
+#include "fault_transport.h"
+#if !defined(__WIN32__)
+#include <poll.h>
+#include "daemon.h"
+#endif
+#include "log.h"
 
 struct transport *trans;
-struct transport *hidapi_transport_open(uint16_t vid, uint16_t pid);
 struct transport *serial_transport_open(const char *dev, unsigned speed);
-struct transport *usb_transport_open(uint16_t vid, uint16_t pid, int iface, unsigned flags);
+struct transport *serial_transport_open_rx(const char *dev, unsigned speed, unsigned ring, int cpu);
+
+/* Serial reader thread ring, big enough for a 4 Mbaud burst of ~150 ms */
+#define SERIAL_RX_RING		(64 * 1024)
 
 #define TRANS_IFACE_NONE	0x00
 #define TRANS_IFACE_SERIAL	0x01
@@ -19,7 +33,7 @@ struct transport *usb_transport_open(uint16_t vid, uint16_t pid, int iface, unsi
 
 #define check_and_set_trans_iface(trans_iface, iface)	do {								\
 	if (trans_iface != TRANS_IFACE_NONE && trans_iface != iface) {							\
-		printf("can't set multiple transmission interfaces at the same time\n");	\
+		pr_err("can't set multiple transmission interfaces at the same time\n");	\
 		usage(1);																			\
 	}																						\
 	trans_iface = iface;																	\
@@ -30,6 +44,715 @@ static void usage(int rc)
 	exit(rc);
 }
 
+/* -P fields, laid over the MP image of every device flashed */
+static const char *patch_spec[16];
+static unsigned npatch;
+
+static int hexval(int c)
+{
+	return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+/*
+ * The fields for the @unit'th device from <addr>:<offset>=<hex bytes>[+].
+ * A trailing '+' adds @unit to the value, read as a big endian number,
+ * so each device gets the next BD address or serial. NULL in @pp if
+ * there are no fields.
+ */
+static int patch_build(unsigned unit, struct rtlmptool_patch **pp)
+{
+	unsigned i, n, carry;
+	uint32_t addr, off;
+	uint8_t value[64];
+	const char *v;
+	char *end;
+
+	*pp = NULL;
+	if (npatch == 0) {
+		return 0;
+	}
+
+	*pp = rtlmptool_patch_create();
+	if (*pp == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < npatch; i++) {
+		addr = strtoul(patch_spec[i], &end, 0);
+		if (*end != ':') {
+			goto bad;
+		}
+		off = strtoul(end + 1, &end, 0);
+		if (*end != '=') {
+			goto bad;
+		}
+
+		for (v = end + 1, n = 0; isxdigit(v[0]) && isxdigit(v[1]) && n < sizeof(value); v += 2) {
+			value[n++] = hexval(v[0]) << 4 | hexval(v[1]);
+		}
+
+		if (*v == '+') {
+			for (carry = unit, v++; n && carry; carry >>= 8) {
+				carry += value[--n];
+				value[n] = carry;
+			}
+			n = (v - end - 2) / 2;
+		}
+
+		if (*v != '\0' || n == 0) {
+			goto bad;
+		}
+
+		if (rtlmptool_patch_add(*pp, addr, off, value, n)) {
+			goto err;
+		}
+	}
+
+	return 0;
+bad:
+	pr_err("bad patch %s\n", patch_spec[i]);
+	errno = EINVAL;
+err:
+	rtlmptool_patch_destroy(*pp);
+	*pp = NULL;
+	return -1;
+}
+
+/*
+ * A session flashing @mp with @patch over @trans, with a resumable
+ * journal for @device under @journal, or only what changed since @base
+ * if it is set
+ */
+static struct rtlmptool_session *download_session(struct transport *trans,
+	unsigned speed, int verify, const char *fw, const char *mp, const char *base,
+	const struct rtlmptool_patch *patch, const char *journal, const char *device)
+{
+	int rc, err;
+	struct rtlmptool_session *s;
+
+	s = rtlmptool_session_create(trans);
+	if (s == NULL) {
+		return NULL;
+	}
+
+	rtlmptool_session_set_speed(s, speed);
+	rtlmptool_session_set_verify(s, verify);
+	rc = rtlmptool_session_set_journal(s, journal, device);
+	if (rc == 0) {
+		rc = rtlmptool_session_set_base(s, base);
+	}
+	if (rc == 0) {
+		rc = rtlmptool_session_set_patch(s, patch);
+	}
+	if (rc == 0) {
+		rc = rtlmptool_session_download(s, fw, mp);
+	}
+	if (rc != 0) {
+		err = errno;
+		rtlmptool_session_destroy(s);
+		errno = err;
+		return NULL;
+	}
+
+	return s;
+}
+
+static int download(struct transport *trans, unsigned speed, int verify,
+	const char *fw, const char *mp, const char *base, const struct rtlmptool_patch *patch,
+	const char *journal, const char *device)
+{
+	int rc, err;
+	struct rtlmptool_session *s;
+
+	s = download_session(trans, speed, verify, fw, mp, base, patch, journal, device);
+	if (s == NULL) {
+		return -1;
+	}
+
+	rc = rtlmptool_session_run(s);
+	err = errno;
+	rtlmptool_session_destroy(s);
+	errno = err;
+
+	return rc;
+}
+
+/*
+ * Tone step from <ch>[-<ch>[/<step>]][:...][@<ms>], e.g. 0-78/2@50 holds
+ * every other channel for 50 ms.
+ */
+static int recipe_add_tone(struct rtlmptool_recipe *r, const char *spec)
+{
+	unsigned n = 0, dwell = 1000;
+	unsigned first, last, step;
+	unsigned char channels[79];
+	const char *p = spec;
+	char *end;
+
+	for (;;) {
+		first = last = strtoul(p, &end, 0);
+		step = 1;
+		if (end == p) {
+			break;
+		}
+
+		if (*end == '-') {
+			last = strtoul(end + 1, &end, 0);
+			if (*end == '/') {
+				step = strtoul(end + 1, &end, 0);
+			}
+		}
+
+		for (; first <= last && step && n < sizeof(channels); first += step) {
+			channels[n++] = first;
+		}
+
+		if (*end != ':') {
+			break;
+		}
+		p = end + 1;
+	}
+
+	if (*end == '@') {
+		dwell = strtoul(end + 1, &end, 0);
+	}
+
+	if (*end != '\0') {
+		pr_err("bad channel list %s\n", spec);
+		errno = EINVAL;
+		return -1;
+	}
+
+	return rtlmptool_recipe_add_tone(r, channels, n, dwell);
+}
+
+/*
+ * Build a recipe from a comma separated step list:
+ *   chip[=<value>[/<mask>]], patch, flash, verify, reset, tone=<channels>
+ */
+static struct rtlmptool_recipe *recipe_parse(char *spec, const char *fw,
+	const char *mp, int verify)
+{
+	int rc = 0;
+	char *step, *save;
+	struct rtlmptool_recipe *r;
+	struct rtlmptool_image *fw_img = NULL, *mp_img = NULL;
+
+	r = rtlmptool_recipe_create();
+	if (r == NULL) {
+		return NULL;
+	}
+
+	for (step = strtok_r(spec, ",", &save); step && rc == 0; step = strtok_r(NULL, ",", &save)) {
+		if (!strncmp(step, "chip", 4)) {
+			unsigned value = 0, mask = 0;
+
+			if (step[4] == '=') {
+				mask = 0xffffffff;
+				sscanf(step + 5, "%x/%x", &value, &mask);
+			}
+			rc = rtlmptool_recipe_add_chip(r, value, mask);
+		} else if (!strcmp(step, "patch")) {
+			if (fw_img == NULL && (fw_img = rtlmptool_image_load(fw, RTLMPTOOL_IMAGE_PATCH)) == NULL) {
+				pr_err("load %s: %s\n", fw, strerror(errno));
+				rc = -1;
+				break;
+			}
+			rc = rtlmptool_recipe_add_patch(r, fw_img);
+		} else if (!strcmp(step, "flash") || !strcmp(step, "verify")) {
+			if (mp_img == NULL && (mp_img = rtlmptool_image_load(mp, RTLMPTOOL_IMAGE_MP)) == NULL) {
+				pr_err("load %s: %s\n", mp, strerror(errno));
+				rc = -1;
+				break;
+			}
+			rc = step[0] == 'f' ? rtlmptool_recipe_add_flash(r, mp_img, verify) :
+				rtlmptool_recipe_add_verify(r, mp_img);
+		} else if (!strcmp(step, "reset")) {
+			rc = rtlmptool_recipe_add_reset(r);
+		} else if (!strncmp(step, "tone=", 5)) {
+			rc = recipe_add_tone(r, step + 5);
+		} else {
+			pr_err("unknown recipe step %s\n", step);
+			errno = EINVAL;
+			rc = -1;
+		}
+	}
+
+	/* The recipe holds its own references */
+	rtlmptool_image_put(fw_img);
+	rtlmptool_image_put(mp_img);
+
+	if (rc != 0) {
+		rtlmptool_recipe_destroy(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+/* One line per channel: channel, on and off in s since the epoch, ack latency in us */
+static void print_tones(const struct rtlmptool_tone_mark *mark, unsigned n)
+{
+	int i;
+
+	for (i = 0; i < n; i++, mark++) {
+		printf("tone %u %llu.%06llu %llu.%06llu %u\n", mark->channel,
+			mark->on_us / 1000000, mark->on_us % 1000000,
+			mark->off_us / 1000000, mark->off_us % 1000000, mark->latency_us);
+	}
+}
+
+/* Run @r over @trans and print what each step did */
+static int run_recipe(struct transport *trans, unsigned speed,
+	struct rtlmptool_recipe *r, const char *journal, const char *device)
+{
+	int i, rc, err;
+	unsigned n;
+	struct rtlmptool_session *s;
+	const struct rtlmptool_step_result *res;
+
+	s = rtlmptool_session_create(trans);
+	if (s == NULL) {
+		return -1;
+	}
+
+	rtlmptool_session_set_speed(s, speed);
+	rc = rtlmptool_session_set_journal(s, journal, device);
+	if (rc == 0) {
+		rc = rtlmptool_session_recipe(s, r);
+	}
+	if (rc == 0) {
+		rc = rtlmptool_session_run(s);
+	}
+	err = errno;
+
+	for (i = 0; i < rtlmptool_recipe_steps(r); i++) {
+		res = rtlmptool_recipe_result(r, i);
+		printf("step %d: %s, %llu ms\n", i,
+			!res->run ? "skipped" : res->rc ? strerror(res->err) : "ok", res->us / 1000);
+
+		if (res->type == RTLMPTOOL_STEP_TONE && res->run) {
+			print_tones(rtlmptool_recipe_tones(r, i, &n), n);
+		}
+	}
+
+	rtlmptool_session_destroy(s);
+	errno = err;
+
+	return rc;
+}
+
+/* One fixture slot of the station */
+struct station_job {
+	struct transport *trans;
+	struct rtlmptool_session *s;
+	struct rtlmptool_patch *patch;
+	unsigned unit;
+	char port[USB_PORT_PATH_SIZE];
+};
+
+/*
+ * Metrics of the bridge at @port go to their own file, @metrics with
+ * the port before a ".prom" suffix or after it, so slots don't
+ * overwrite each other.
+ */
+static void station_metrics(struct transport *trans, const char *metrics, const char *port)
+{
+	char path[1024];
+	size_t len = strlen(metrics);
+
+	if (len > 5 && !strcmp(metrics + len - 5, ".prom")) {
+		snprintf(path, sizeof(path), "%.*s-%s.prom", (int)(len - 5), metrics, port);
+	} else {
+		snprintf(path, sizeof(path), "%s.%s", metrics, port);
+	}
+
+	if (transport_stats_export(trans, path, port)) {
+		pr_err("export metrics %s: %s\n", path, strerror(errno));
+	}
+}
+
+/*
+ * Flash every bridge that shows up, until the process is killed. Each
+ * ready slot gets its own session at once; a failed unit's fields are
+ * handed to the next bridge.
+ */
+static void station_loop(uint16_t vid, uint16_t pid, int iface, int flags,
+	unsigned speed, int verify, const char *fw, const char *mp, const char *base,
+	const char *journal, const char *metrics, unsigned timeout)
+{
+	int i, n, state;
+	unsigned next_unit = 0, nretry = 0;
+	unsigned retry_unit[USB_STATION_SLOTS];
+	struct usb_station *st;
+	struct station_job job[USB_STATION_SLOTS];
+	struct station_job *j;
+#if !defined(__WIN32__)
+	struct pollfd pfd[USB_STATION_SLOTS];
+#endif
+
+	memset(job, 0, sizeof(job));
+	st = usb_station_open(vid, pid, iface, flags);
+	if (st == NULL) {
+		pr_err("station (%04x:%04x,%d): %s\n", vid, pid, iface, strerror(errno));
+		exit(1);
+	}
+
+	pr_info("station: waiting for %04x:%04x\n", vid, pid);
+	for (;;) {
+		/* Start a session on every ready slot, only block when none runs */
+		for (n = 0, i = 0; i < USB_STATION_SLOTS; i++) {
+			n += job[i].s != NULL;
+		}
+
+		for (i = 0; i < USB_STATION_SLOTS; i++) {
+			j = &job[i];
+			if (j->s)
+				continue;
+
+			j->trans = usb_station_wait(st, n ? 0 : 1000, timeout, j->port, sizeof(j->port));
+			if (j->trans == NULL)
+				break;
+
+			/* The port path names the fixture slot, so each keeps its own journal */
+			j->unit = nretry ? retry_unit[--nretry] : next_unit++;
+			if (patch_build(j->unit, &j->patch) ||
+				(j->s = download_session(j->trans, speed, verify, fw, mp, base,
+					j->patch, journal, j->port)) == NULL ||
+				rtlmptool_session_start(j->s)) {
+				pr_err("station: %s FAIL: %s\n", j->port, strerror(errno));
+				retry_unit[nretry++] = j->unit;
+				if (j->s) {
+					rtlmptool_session_destroy(j->s);
+					j->s = NULL;
+				}
+				rtlmptool_patch_destroy(j->patch);
+				usb_station_release(st, j->trans);
+				continue;
+			}
+			pr_info("station: %s start\n", j->port);
+			n++;
+		}
+
+		if (n == 0)
+			continue;
+
+#if !defined(__WIN32__)
+		for (n = 0, i = 0; i < USB_STATION_SLOTS; i++) {
+			if (job[i].s) {
+				pfd[n].fd = rtlmptool_session_fd(job[i].s);
+				pfd[n].events = POLLIN;
+				n++;
+			}
+		}
+		/* Wake up now and then to pick up new bridges */
+		poll(pfd, n, 100);
+#else
+		usleep(50000);
+#endif
+
+		for (i = 0; i < USB_STATION_SLOTS; i++) {
+			j = &job[i];
+			if (j->s == NULL)
+				continue;
+
+			state = rtlmptool_session_step(j->s);
+			if (state == RTLMPTOOL_STATE_RUNNING)
+				continue;
+
+			if (rtlmptool_session_result(j->s) != 0) {
+				pr_err("station: %s FAIL: %s\n", j->port, strerror(errno));
+				retry_unit[nretry++] = j->unit;
+			} else {
+				pr_info("station: %s PASS\n", j->port);
+			}
+
+			rtlmptool_session_destroy(j->s);
+			j->s = NULL;
+			rtlmptool_patch_destroy(j->patch);
+			if (metrics) {
+				station_metrics(j->trans, metrics, j->port);
+			}
+			usb_station_release(st, j->trans);
+		}
+	}
+}
+
+static const char *const fault_types[FAULT_TYPES] = {
+	"drop", "flip", "short", "delay", "stall", "disconnect",
+};
+
+/*
+ * Fault injection from a comma separated list, rates per million:
+ *   seed=<n>, drop=<ppm>, flip=<ppm>, short=<ppm>, delay=<ppm>@<us>,
+ *   stall=<ppm>@<ms>, disconnect=<ppm>,
+ *   at=<type>@<r|w><byte> (once, at that byte of the stream, up to 32)
+ */
+static int fault_parse(char *spec, struct fault_config *cfg)
+{
+	int i;
+	char *opt, *save, *val, *at;
+	struct fault_event *e;
+
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->delay_us = 1000;
+	cfg->stall_ms = 1000;
+
+	for (opt = strtok_r(spec, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+		val = strchr(opt, '=');
+		if (val == NULL) {
+			pr_err("fault: %s needs a value\n", opt);
+			return -1;
+		}
+		*val++ = '\0';
+
+		at = strchr(val, '@');
+		if (at) {
+			*at++ = '\0';
+		}
+
+		if (!strcmp(opt, "seed")) {
+			cfg->seed = strtoul(val, NULL, 0);
+			continue;
+		}
+
+		if (!strcmp(opt, "at")) {
+			for (i = 0; i < FAULT_TYPES && strcmp(val, fault_types[i]); i++)
+				;
+			if (i == FAULT_TYPES || at == NULL || (*at != 'r' && *at != 'w') ||
+				cfg->nscript == FAULT_SCRIPT_MAX) {
+				pr_err("fault: bad event %s\n", val);
+				return -1;
+			}
+
+			e = &cfg->script[cfg->nscript++];
+			e->type = i;
+			e->dir = *at == 'r' ? FAULT_READ : FAULT_WRITE;
+			e->pos = strtoull(at + 1, NULL, 0);
+			continue;
+		}
+
+		for (i = 0; i < FAULT_TYPES && strcmp(opt, fault_types[i]); i++)
+			;
+		if (i == FAULT_TYPES) {
+			pr_err("fault: bad option %s\n", opt);
+			return -1;
+		}
+
+		cfg->rate[i] = strtoul(val, NULL, 0);
+		if (at && i == FAULT_DELAY) {
+			cfg->delay_us = strtoul(at, NULL, 0);
+		} else if (at && i == FAULT_STALL) {
+			cfg->stall_ms = strtoul(at, NULL, 0);
+		}
+	}
+
+	return 0;
+}
+
+#define ESTIMATE_TRACES		8
+
+static const char *const estimate_stages[RTLMPTOOL_ESTIMATE_STAGES] = {
+	"patch", "boot", "erase", "write", "verify",
+};
+
+/*
+ * Predict the flash time of one device and the fixtures a line needs,
+ * from a comma separated model:
+ *   baud=<bps>, report=<bridge packet>, rtt=<us>, bits=<per byte>,
+ *   erase=<ms>, crc=<us per KB>, boot=<ms>, write=<bytes>, span=<units>,
+ *   trace=<metrics file>@<bps> (calibrates, up to 8),
+ *   handling=<s per unit>, uph=<target units per hour>
+ */
+static int estimate(char *spec, unsigned speed, int verify, const char *fw, const char *mp)
+{
+	int i;
+	unsigned n = 0, fixtures;
+	char *opt, *save, *val, *at;
+	double handling = 0, uph = 0, per_hour;
+	const char *traces[ESTIMATE_TRACES];
+	unsigned bauds[ESTIMATE_TRACES];
+	struct rtlmptool_estimate_model m;
+	struct rtlmptool_estimate e;
+
+	rtlmptool_estimate_init(&m, speed);
+
+	for (opt = strtok_r(spec, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+		val = strchr(opt, '=');
+		if (val == NULL) {
+			pr_err("estimate: %s needs a value\n", opt);
+			return -1;
+		}
+		*val++ = '\0';
+
+		if (!strcmp(opt, "baud")) {
+			m.baud = strtoul(val, NULL, 0);
+		} else if (!strcmp(opt, "report")) {
+			m.report = strtoul(val, NULL, 0);
+		} else if (!strcmp(opt, "rtt")) {
+			m.rtt_us = strtod(val, NULL);
+		} else if (!strcmp(opt, "bits")) {
+			m.bits_per_byte = strtod(val, NULL);
+		} else if (!strcmp(opt, "erase")) {
+			m.erase_us = strtod(val, NULL) * 1000;
+		} else if (!strcmp(opt, "crc")) {
+			m.crc_us_per_kb = strtod(val, NULL);
+		} else if (!strcmp(opt, "boot")) {
+			m.boot_us = strtod(val, NULL) * 1000;
+		} else if (!strcmp(opt, "write")) {
+			m.write_size = strtoul(val, NULL, 0);
+		} else if (!strcmp(opt, "span")) {
+			m.verify_span = strtoul(val, NULL, 0);
+		} else if (!strcmp(opt, "handling")) {
+			handling = strtod(val, NULL) * 1e6;
+		} else if (!strcmp(opt, "uph")) {
+			uph = strtod(val, NULL);
+		} else if (!strcmp(opt, "trace") && n < ESTIMATE_TRACES &&
+			(at = strrchr(val, '@')) != NULL) {
+			*at = '\0';
+			traces[n] = val;
+			bauds[n++] = strtoul(at + 1, NULL, 0);
+		} else {
+			pr_err("estimate: bad option %s\n", opt);
+			return -1;
+		}
+	}
+
+	if (n && rtlmptool_estimate_calibrate(&m, fw, mp, verify, traces, bauds, n)) {
+		pr_err("calibrate: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (rtlmptool_estimate(&m, fw, mp, verify, &e)) {
+		pr_err("estimate: %s\n", strerror(errno));
+		return -1;
+	}
+
+	pr_info("Model: %u bps (patch %u), %s%u, rtt %.0f us, %.2f bits/byte\n",
+		m.baud, m.boot_baud, m.report ? "bridge " : "uart ", m.report,
+		m.rtt_us, m.bits_per_byte);
+	for (i = 0; i < RTLMPTOOL_ESTIMATE_STAGES; i++) {
+		pr_info("  %-8s %9.1f ms\n", estimate_stages[i], e.us[i] / 1000);
+	}
+	pr_info("  %-8s %9.1f ms, %llu round trips, %llu bytes, %.0f%% in the flash\n",
+		"total", e.total_us / 1000, e.round_trips, e.bytes,
+		100 * e.device_us / e.total_us);
+
+	per_hour = 3600e6 / (e.total_us + handling);
+	pr_info("Fixture: %.1f units per hour\n", per_hour);
+	if (uph > 0) {
+		fixtures = uph / per_hour;
+		if (fixtures * per_hour < uph)
+			fixtures++;
+		pr_info("Line: %.0f units per hour needs %u fixtures\n", uph, fixtures);
+	}
+
+	return 0;
+}
+
+/* Flash every HID bridge matching @vid:@pid at once, one session each */
+static int hid_all(uint16_t vid, uint16_t pid, unsigned speed, int verify,
+	const char *fw, const char *mp, const char *base, const char *journal, unsigned timeout)
+{
+	int i, n, running, failed = 0;
+	struct hidapi_device devs[16];
+	struct transport *trans[16] = { NULL };
+	struct rtlmptool_session *s[16] = { NULL };
+	struct rtlmptool_patch *patch[16] = { NULL };
+#if !defined(__WIN32__)
+	struct pollfd pfd[16];
+#endif
+
+	n = hidapi_enumerate(vid, pid, devs, (int)ARRAY_SIZE(devs));
+	if (n <= 0) {
+		pr_err("no HID bridge %04x:%04x\n", vid, pid);
+		return -1;
+	}
+	n = MIN(n, (int)ARRAY_SIZE(devs));
+
+	for (i = 0; i < n; i++) {
+		/* Each bridge keeps its own journal, by serial if it has one */
+		const char *name = devs[i].serial[0] ? devs[i].serial : devs[i].path;
+
+		trans[i] = hidapi_transport_open_path(devs[i].path);
+		if (trans[i] == NULL) {
+			pr_err("%s: %s\n", name, strerror(errno));
+			failed++;
+			continue;
+		}
+
+		s[i] = rtlmptool_session_create(trans[i]);
+		if (s[i] == NULL) {
+			failed++;
+			continue;
+		}
+
+		rtlmptool_session_set_speed(s[i], speed);
+		rtlmptool_session_set_verify(s[i], verify);
+		rtlmptool_session_set_timeout(s[i], timeout);
+		if (patch_build(i, &patch[i]) ||
+			rtlmptool_session_set_journal(s[i], journal, name) ||
+			rtlmptool_session_set_base(s[i], base) ||
+			rtlmptool_session_set_patch(s[i], patch[i]) ||
+			rtlmptool_session_download(s[i], fw, mp) ||
+			rtlmptool_session_start(s[i])) {
+			pr_err("%s: %s\n", name, strerror(errno));
+			rtlmptool_session_destroy(s[i]);
+			s[i] = NULL;
+			failed++;
+			continue;
+		}
+		pr_info("%s: start\n", name);
+	}
+
+	for (;;) {
+		running = 0;
+		for (i = 0; i < n; i++) {
+			if (s[i] == NULL || rtlmptool_session_step(s[i]) != RTLMPTOOL_STATE_RUNNING)
+				continue;
+#if !defined(__WIN32__)
+			pfd[running].fd = rtlmptool_session_fd(s[i]);
+			pfd[running].events = POLLIN;
+#endif
+			running++;
+		}
+
+		if (running == 0)
+			break;
+
+#if !defined(__WIN32__)
+		/* Every session signals its result, so there is nothing to time out on */
+		if (poll(pfd, running, -1) < 0 && errno != EINTR) {
+			pr_err("poll: %s\n", strerror(errno));
+			usleep(50000);
+		}
+#else
+		usleep(50000);
+#endif
+	}
+
+	for (i = 0; i < n; i++) {
+		const char *name = devs[i].serial[0] ? devs[i].serial : devs[i].path;
+
+		if (s[i]) {
+			if (rtlmptool_session_result(s[i]) != 0) {
+				pr_err("%s: FAIL: %s\n", name, strerror(errno));
+				failed++;
+			} else {
+				pr_info("%s: PASS\n", name);
+			}
+			rtlmptool_session_destroy(s[i]);
+		}
+		rtlmptool_patch_destroy(patch[i]);
+
+		if (trans[i]) {
+			transport_close(trans[i]);
+		}
+	}
+
+	return failed ? -1 : 0;
+}
+
 int main(int argc, char **argv)
 {
 	int c, rc;
@@ -39,10 +762,36 @@ int main(int argc, char **argv)
 	const char *tty = "/dev/ttyS0";
 	const char *fw = "firmware0.bin";
 	const char *mp = "app.bin";
+	const char *base = NULL;
+	const char *metrics = NULL;
+	const char *dump = NULL;
+	bool compare = false, station = false;
+	uint32_t dump_addr = 0, dump_size = 0;
+	char dump_file[256];
+	const char *journal = NULL, *device = NULL;
+	const char *daemon_socket = NULL;
+	const char *hid_path = NULL, *hid_serial = NULL;
+	unsigned emu_version = 0, emu_packet = 0, emu_quirks = 0;
+	char *estimate_spec = NULL;
+	char *fault_spec = NULL;
+	struct fault_config fault;
+	bool rx_thread = false;
+	int rx_cpu = -1;
+	char *recipe_spec = NULL;
+	const char *sweep = NULL;
+	struct rtlmptool_recipe *recipe = NULL;
+	char device_id[32];
+	unsigned timeout = 0;
+	int verify = RTLMPTOOL_VERIFY_CHUNK;
+	struct transport_cancel cancel;
+	const char *trans_label = TRANSPORT_IFACE_SERAIL;
+
+	log_stdout_start();
 
-	while (-1 != (c = getopt(argc, argv, "b:f:m:U:T:H:kh"))) {
+	while (-1 != (c = getopt(argc, argv, "b:f:m:o:P:M:U:T:H:V:D:J:I:R:W:E:F:t:d:r:ckSvh"))) {
 		switch (c) {
 		case 'k': flags |= 0x0001; break;
+		case 'v': log_set_level(LOG_LEVEL_DEBUG); break;
 		case 'T':  {
 			tty = optarg;
 			check_and_set_trans_iface(trans_iface, TRANS_IFACE_SERIAL);
@@ -50,7 +799,21 @@ int main(int argc, char **argv)
 
 		case 'H': {
 			check_and_set_trans_iface(trans_iface, TRANS_IFACE_HID);
-			sscanf(optarg, "%04hx:%04hx", &vid, &pid);
+			/*
+			 * <vid>:<pid>[,<serial>|,all], a device path, or
+			 * emu:<version>,<packet>[,<quirks>] for a bridge emulated
+			 * in memory
+			 */
+			if (!strncmp(optarg, "emu:", 4)) {
+				if (sscanf(optarg + 4, "%u,%u,%x", &emu_version, &emu_packet, &emu_quirks) < 2) {
+					pr_err("emulator expects emu:<version>,<packet>[,<quirks>]\n");
+					usage(1);
+				}
+			} else if (sscanf(optarg, "%04hx:%04hx", &vid, &pid) != 2) {
+				hid_path = optarg;
+			} else if (strchr(optarg, ',')) {
+				hid_serial = strchr(optarg, ',') + 1;
+			}
 		} break;
 
 		case 'U': {
@@ -60,37 +823,206 @@ int main(int argc, char **argv)
 		case 'b': speed = strtol(optarg, NULL, 0); break;
 		case 'f': fw = optarg; break;
 		case 'm': mp = optarg; break;
+		/* The app.bin the device holds, flash only what changed */
+		case 'o': base = optarg; break;
+		/* <addr>:<offset>=<hex bytes>[+], '+' counts up per device */
+		case 'P': {
+			if (npatch == ARRAY_SIZE(patch_spec)) {
+				pr_err("too many patch fields\n");
+				usage(1);
+			}
+			patch_spec[npatch++] = optarg;
+		} break;
+		case 'M': metrics = optarg; break;
+		case 'D': {
+			if (3 != sscanf(optarg, "%i,%i,%255s", &dump_addr, &dump_size, dump_file)) {
+				pr_err("dump expects <addr>,<size>,<file>\n");
+				usage(1);
+			}
+			dump = dump_file;
+		} break;
+		case 'c': compare = true; break;
+		case 'S': station = true; break;
+		case 'J': journal = optarg; break;
+		case 'I': device = optarg; break;
+		case 't': timeout = strtol(optarg, NULL, 0) * 1000; break;
+		case 'd': daemon_socket = optarg; break;
+		/* Drain the tty on a reader thread pinned to this cpu, -1 for any */
+		case 'r': rx_cpu = strtol(optarg, NULL, 0); rx_thread = true; break;
+		case 'R': recipe_spec = optarg; break;
+		case 'W': sweep = optarg; break;
+		case 'E': estimate_spec = optarg; break;
+		/* Inject faults between the tool and the transport */
+		case 'F': fault_spec = optarg; break;
+		case 'V': {
+			if (!strcmp(optarg, "chunk")) {
+				verify = RTLMPTOOL_VERIFY_CHUNK;
+			} else if (!strcmp(optarg, "image")) {
+				verify = RTLMPTOOL_VERIFY_IMAGE;
+			} else if (!strcmp(optarg, "end")) {
+				verify = RTLMPTOOL_VERIFY_END;
+			} else {
+				pr_err("unknown verify policy %s\n", optarg);
+				usage(1);
+			}
+		} break;
 		case 'h': usage(0); break;
 		default: usage(1); break;
 		}
 	}
 
+	if (fault_spec && fault_parse(fault_spec, &fault)) {
+		usage(1);
+	}
+
+	/* Nothing is opened, the model stands in for the line */
+	if (estimate_spec) {
+		rc = estimate(estimate_spec, speed, verify, fw, mp);
+		log_stdout_stop();
+		return rc ? 1 : 0;
+	}
+
+	if (daemon_socket) {
+#if !defined(__WIN32__)
+		struct daemon_config cfg = {
+			.socket = daemon_socket,
+			.fw = fw, .mp = mp,
+			.journal = journal,
+			.speed = speed,
+			.verify = verify,
+			.timeout = timeout,
+		};
+
+		exit(daemon_run(&cfg) ? 1 : 0);
+#else
+		pr_err("daemon mode is not supported on Windows\n");
+		usage(1);
+#endif
+	}
+
+	if (station) {
+		if (trans_iface != TRANS_IFACE_USB) {
+			pr_err("station mode needs a USB bridge (-U)\n");
+			usage(1);
+		}
+		station_loop(vid, pid, iface, flags, speed, verify, fw, mp, base, journal, metrics, timeout);
+	}
+
+	if (hid_serial && !strcmp(hid_serial, "all")) {
+		rc = hid_all(vid, pid, speed, verify, fw, mp, base, journal, timeout);
+		log_stdout_stop();
+		return rc;
+	}
+
 	switch (trans_iface) {
 	case TRANS_IFACE_NONE:
 	case TRANS_IFACE_SERIAL:
-		trans = serial_transport_open(tty, 115200);
+		if (rx_thread) {
+			trans = serial_transport_open_rx(tty, 115200, SERIAL_RX_RING, rx_cpu);
+		} else {
+			trans = serial_transport_open(tty, 115200);
+		}
 	break;
 
 	case TRANS_IFACE_USB:
 		trans = usb_transport_open(vid, pid, iface, flags);
+		trans_label = TRANSPORT_IFACE_LIBUSB;
 	break;
 
 	case TRANS_IFACE_HID:
-		trans = hidapi_transport_open(vid, pid);
+		if (emu_version) {
+			/* A loopback, what the tool writes comes back as the answer */
+			trans = mcu_emulator_open(emu_version, emu_packet, emu_quirks);
+			trans_label = TRANSPORT_IFACE_EMULATOR;
+			break;
+		}
+
+		if (hid_path) {
+			trans = hidapi_transport_open_path(hid_path);
+		} else if (hid_serial) {
+			trans = hidapi_transport_open_serial(vid, pid, hid_serial);
+		} else {
+			trans = hidapi_transport_open(vid, pid);
+		}
+		trans_label = TRANSPORT_IFACE_HIDAPI;
 	break;
 	}
 
+	if (journal && device == NULL) {
+		if (emu_version) {
+			device = "emu";
+		} else if (hid_path || hid_serial) {
+			/* Several bridges share a vid:pid, name the one picked */
+			device = hid_path ? hid_path : hid_serial;
+		} else if (trans_iface == TRANS_IFACE_USB || trans_iface == TRANS_IFACE_HID) {
+			snprintf(device_id, sizeof(device_id), "%04x:%04x", vid, pid);
+			device = device_id;
+		} else {
+			device = tty;
+		}
+	}
+
 	if(trans == NULL) {
-		printf("Transport interface (%04x:%04x,%d) or (%s) %s\n",
+		pr_err("Transport interface (%04x:%04x,%d) or (%s) %s\n",
 			vid, pid, iface, tty, strerror(errno));
 		exit(1);
 	}
 
-	rc = rtlmptool_download_firmware(trans, speed, fw, mp, NULL);
-	if (rc != 0) {
-		printf("donwload firmware failure: %s\n", strerror(errno));
+	if (fault_spec) {
+		struct transport *ft = fault_transport_open(trans, &fault);
+
+		if (ft == NULL) {
+			pr_err("fault transport: %s\n", strerror(errno));
+			transport_close(trans);
+			exit(1);
+		}
+		trans = ft;
+	}
+
+	/* The deadline covers the whole session, bring-up included */
+	transport_cancel_init(&cancel, timeout);
+	transport_set_cancel(trans, &cancel);
+
+	if (sweep) {
+		/* A tone only recipe, the ROM answers HCI without a patch */
+		recipe = rtlmptool_recipe_create();
+		rc = recipe && !recipe_add_tone(recipe, sweep) ?
+			run_recipe(trans, speed, recipe, NULL, NULL) : -1;
+		if (rc != 0) {
+			pr_err("sweep failure: %s\n", strerror(errno));
+		}
+		rtlmptool_recipe_destroy(recipe);
+	} else if (recipe_spec) {
+		recipe = recipe_parse(recipe_spec, fw, mp, verify);
+		rc = recipe ? run_recipe(trans, speed, recipe, journal, device) : -1;
+		if (rc != 0) {
+			pr_err("recipe failure: %s\n", strerror(errno));
+		}
+		rtlmptool_recipe_destroy(recipe);
+	} else if (dump) {
+		rc = rtlmptool_dump_flash(trans, speed, fw, dump_addr, dump_size,
+			dump, compare ? mp : NULL, NULL, NULL);
+		if (rc < 0) {
+			pr_err("dump flash failure: %s\n", strerror(errno));
+		}
+	} else {
+		struct rtlmptool_patch *patch;
+
+		rc = patch_build(0, &patch);
+		if (rc == 0) {
+			rc = download(trans, speed, verify, fw, mp, base, patch, journal, device);
+			rtlmptool_patch_destroy(patch);
+		}
+		if (rc != 0) {
+			pr_err("donwload firmware failure: %s\n", strerror(errno));
+		}
+	}
+
+	if (metrics && transport_stats_export(trans, metrics, trans_label)) {
+		pr_err("export metrics %s: %s\n", metrics, strerror(errno));
 	}
 	transport_close(trans);
+	log_stdout_stop();
 
 	return rc;
 }